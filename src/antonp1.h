@@ -2,23 +2,48 @@
  This is Anton Sigurjónsson implementation of reading out P1 port of Icelandic Iskraemeco meters and making the data available in a 
  structured way based on OBIS codes from the meter. No hardcoded OBIS codes - raw parsing only.
 
- p1ReadAndParseNow() function requests data from meter and parses it in the structure.
+ p1loop() function requests data from meter and parses it in the structure. It never blocks and should be
+ called from loop() as often as possible, the telegram is read in chunks as the bytes arrive.
 
  The structure can then be accessed and used from the list:
  OBISItem* item = p1parsed->items;
 
  */
-#include <Arduino.h>
-#define P1_REQUEST_PIN D5
-#define P1_MAXBUFFER 1750 
+#ifndef ANTONP1_H
+#define ANTONP1_H
+#include "p1hal.h"
+#include "p1timing.h"
+#include "p1filter.h"
+#include "p1scan.h"
+#include "p1profile.h"
+#include <atomic>
+#define P1_MAXBUFFER 1750 //Raw copy of the last telegram (for upload), parsing does not depend on it
+#define P1_MAXVALUE 128 //Max stored length of a string value within brackets, longer are cut
+#define P1_MAXUNIT 16 //Max length of a unit, e.g. kWh
+#ifndef P1_INDEX_SIZE
+#define P1_INDEX_SIZE 128 //Slots in the OBIS code index, must be a power of two
+#endif
+#ifndef P1_MAXITEMS
+#define P1_MAXITEMS 96 //Max different OBIS codes, keep below P1_INDEX_SIZE
+#endif
+#ifndef P1_MAXUNITS
+#define P1_MAXUNITS 16 //Max different units, e.g. kWh, kW, V, A
+#endif
+#ifndef P1_STRING_ARENA
+#define P1_STRING_ARENA 768 //Bytes for all string values, e.g. 96.1.1 device identifiers
+#endif
+//P1_LAZY_VALUES: values are kept as views into the parser's copy of the telegram, strings are not copied, see p1CommitTelegram()
 #define P1_READ_INTERVAL 2000 //Refresh P1 data every X seconds
+#define P1_READ_TIMEOUT 12000 //Give up on a telegram request after X ms
 
-char P1buffer[P1_MAXBUFFER];
-int P1length=0;
-boolean P1valid = false;
-String P1error="";
+bool P1valid = false;
+const char* P1error="";
 unsigned long P1NextMillis = 0;
-static uint16_t parsingobis[5]; //Temporary device+obis-code parsing array.
+unsigned long P1ReadStartMillis = 0;
+enum P1ReadState {P1_IDLE=0, P1_WAIT_START=1, P1_READING=2};
+P1ReadState P1readState = P1_IDLE;
+int P1readTarget = 0; //Write position in the buffer of the telegram being read
+int P1lineStart = 0; //Bytes of the buffer from here on are not parsed yet, see P1_ReadFromSerial()
 
 /*
 Simple telegram message:
@@ -47,154 +72,456 @@ Multiple items are likely to share the same units.
 class OBISUnit
 {
   public:
-  char* unitstr;
+  char unitstr[P1_MAXUNIT];
   OBISUnit* next;
-
-  ~OBISUnit()
-  {
-      if (unitstr != nullptr) {
-          delete[] unitstr;
-      }
-  }    
 };
 
-OBISUnit* unitList;
-
-
-int countDigits(int num) {
-    if (num == 0) {
-        return 1;  // Special case for zero
-    }
-    
-    int count = 0;
-    while (num != 0) {
-        num /= 10;
-        count++;
-    }
-    
-    return count;
-}
+class ParsedOBIS;
 
 class OBISItem
 {
     private:
-      char* obisString;
+      char obisString[18]; //"65535.65535.65535"
     public:
     uint16_t obis[5]; //The device ID pointer, e.g. 1-0 and then obis code, e.g. 31.7.2
+    uint64_t key; //obis packed into one value, see obisKey()
+    uint8_t outputs; //Outputs that include this code, bit (1 << P1FilterOutput), see p1SetFilter()
 
-    enum ValueType {NONE=0,DOUBLE=1, INT32=2, INT64=3, TIME=4,CHARARR=5};
+    enum ValueType {NONE=0,DOUBLE=1, INT32=2, INT64=3, TIME=4,CHARARR=5, VIEW=6};
     union Value {
-      double dValue;
+      struct {
+        uint64_t mantissa;
+        uint8_t decimals;
+      } fixed; //DOUBLE values are kept exact, e.g. 004107.331 is 4107331 with 3 decimals, see getDouble()
       uint32_t i32Value;
       uint64_t i64Value;
       char* stringValue;
     };
-    Value value;
-    ValueType type;
+    struct ValueSlot
+    {
+      Value value;
+      ValueType type; //VIEW while the telegram is parsed (P1_LAZY_VALUES), readers never see it, see p1Decoded()
+#ifdef P1_LAZY_VALUES
+      struct {
+        char* bytes; //Within the brackets, in the parser's copy of the telegram, nullptr if not from one
+        uint16_t length; //Up to the '*' or ')'
+        uint8_t unitLength;
+        bool star;
+        bool unitDot; //A dot in the unit makes it a decimal value, as one in the value does
+        uint8_t lineOffset; //Of the bytes from the start of their line, 255 if further, see p1KeepLine()
+      } view; //Kept after decoding, so an unchanged line reuses the value, see p1KeepLine()
+#endif
+      char* buffer; //Arena block for string values, kept when the type changes so it can be reused
+      uint16_t capacity;
+
+      /*
+        The DOUBLE value as double, only converted when an output needs it.
+        Exact for up to 15 digits, gives the same (nearest) double as strtod() would.
+      */
+      double getDouble() const
+      {
+        static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+        return (double)value.fixed.mantissa / pow10[value.fixed.decimals];
+      }
+    };
+    ValueSlot slots[2]; //Current and parsing, see p1Generation
     OBISUnit* unit;
+    OBISUnit* pendingUnit; //Unit from the telegram being parsed
+    bool isPending; //Has a value from the telegram being parsed
+    bool changed; //Its line in the last valid telegram was not the same as in the one before, for outputs
+    uint64_t lineHash; //Of the line the current value came from (p1LineHash()), 0 if not known
+    uint64_t pendingLineHash; //Of the line of the pending value
+    OBISItem* lineNext; //Item of the line after this one in the last telegram, see p1ExpectedLine()
  
     OBISItem* next;
 
-    ~OBISItem()
-    {
-        if (type == CHARARR && value.stringValue != nullptr) {
-            delete[] value.stringValue;
-        }
-    }
-
     /*
       Returns the OBIS code - note, only the obis code e.g. 1.8.0, not the whole with device id's etc
       The code is created, if it is not part of the object, and stored.
     */
     char* getObisCode()
     {
-      if (obisString == nullptr)
+      if (obisString[0] == '\0')
       {
-        int whatSize = 3; //two Dots + terminator
-        whatSize += countDigits(obis[2]);
-        whatSize += countDigits(obis[3]);
-        whatSize += countDigits(obis[4]);
-
-        obisString = new char[whatSize]; //"1-1:96.96.96"
-        snprintf(obisString, whatSize, "%d.%d.%d",obis[2],obis[3],obis[4]);
+        snprintf(obisString, sizeof(obisString), "%d.%d.%d",obis[2],obis[3],obis[4]);
       }
 
       return obisString;     
     }    
 
-    void setUnitType(const char* array, int startIndex, int endIndex)
+    /*
+      Value of the given generation, readers should check it is still stable after reading, see p1SnapshotStable().
+    */
+    const ValueSlot& at(uint32_t generation) const;
+
+    /*
+      Value of the last valid telegram of the device's parser (p1main), for code running in the same context
+      as the parser (e.g. loop()). Items of another parser use at() with its generation.
+    */
+    const ValueSlot& current() const;
+
+    /*
+      Slot the parser writes the telegram being parsed into, from the generation of its ParsedOBIS.
+    */
+    ValueSlot& parsing(uint32_t generation)
     {
-      int size = endIndex - startIndex;
-      OBISUnit* unitl = unitList;
-      while (unitl != nullptr)   //Finding existing declared unit
-      {     
-        if (strlen(unitl->unitstr) == size)
-        {
-          bool found = true;
-          for (int i = 0 ; i<size; i++)
-          {
-            if (unitl->unitstr[i] != array[startIndex + i])
-            {
-              found = false;
-              break;
-            }
-          }
-          if (found)
-          {
-            unit = unitl;
-            return;
-          }
-        }
-        unitl = unitl->next;
-      }
-      //Creating new unit in unit list
-      OBISUnit* newUnit = new OBISUnit();
-      newUnit->unitstr = new char[size + 1];
-      for (int i = 0 ; i<size; i++)
-      {
-        newUnit->unitstr[i] = array[startIndex + i];
-      }
-      newUnit->unitstr[size] = '\0';
-      newUnit->next = unitList;
-      unitList = newUnit;
-      unit = newUnit;
+      return slots[(generation & 1) ^ 1];
     }
+
+    ValueSlot& parsing(); //Of the device's parser
+
+    void setUnitType(ParsedOBIS& parsed, const char* array, int startIndex, int endIndex);
 };
 
-bool compareObisArrays(uint16_t (&ob1)[5], uint16_t (&ob2)[5])
+static_assert((int)P1PT_DOUBLE == OBISItem::DOUBLE && (int)P1PT_INT32 == OBISItem::INT32 && (int)P1PT_INT64 == OBISItem::INT64
+              && (int)P1PT_CHARARR == OBISItem::CHARARR, "Profile types are value types");
+
+#ifdef P1_LAZY_VALUES
+/*
+Decodes a VIEW value in place, with the same rules as p1CommitValue(): a value with a dot is DOUBLE if it
+is only digits and that dot, digits only are INT32 or INT64 by length (unit included), the rest is a string.
+Strings are not copied, they are terminated and left in the telegram copy. '\r' within brackets is dropped,
+as the parser does.
+*/
+void p1DecodeView(OBISItem::ValueSlot& slot)
 {
-  for (int i = 0; i<5;i++)
+  char* s = slot.view.bytes;
+  int length = slot.view.length;
+  int groupLength = slot.view.star ? slot.view.unitLength + 1 : 0;
+  bool dot = slot.view.unitDot, dotInValue = false, digitsOnly = true, doubleValid = true;
+  uint64_t mantissa = 0;
+  int digits = 0, decimals = 0, n = 0;
+  for (int i = 0; i < length; i++)
   {
-    if (ob1[i] != ob2[i]) 
+    char c = s[i];
+    if (c == '\r')
     {
-      return false;
+      continue;
+    }
+    s[n++] = c;
+    if (p1IsDigit(c))
+    {
+      mantissa = mantissa * 10 + (c - '0');
+      decimals += dotInValue;
+      doubleValid &= ++digits <= 18;
+      continue;
     }
+    digitsOnly = false;
+    doubleValid &= c == '.' && !dotInValue;
+    dotInValue |= c == '.';
   }
-  return true;
+  groupLength += n;
+  if ((dot || dotInValue) && doubleValid)
+  {
+    slot.value.fixed.mantissa = mantissa;
+    slot.value.fixed.decimals = decimals;
+    slot.type = OBISItem::DOUBLE;
+  }
+  else if (!dot && !dotInValue && digitsOnly && groupLength <= 18)
+  {
+    if (groupLength < 10)
+    {
+      slot.value.i32Value = (uint32_t)mantissa;
+      slot.type = OBISItem::INT32;
+    }
+    else
+    {
+      slot.value.i64Value = mantissa;
+      slot.type = OBISItem::INT64;
+    }
+  }
+  else
+  {
+    s[n < P1_MAXVALUE - 1 ? n : P1_MAXVALUE - 1] = '\0'; //Over the ')' or '*', or cut like a copied one
+    slot.value.stringValue = s;
+    slot.type = OBISItem::CHARARR;
+  }
+}
+#endif
+
+/*
+The parsing slot with its value decoded, for readers of it before the commit (a beforeCommit hook), in the
+parser's context. Current slots are always decoded, the parser does it when it commits, see p1CommitTelegram().
+*/
+inline OBISItem::ValueSlot& p1Decoded(OBISItem::ValueSlot& slot)
+{
+#ifdef P1_LAZY_VALUES
+  if (slot.type == OBISItem::VIEW)
+  {
+    p1DecodeView(slot);
+  }
+#endif
+  return slot;
+}
+
+inline const OBISItem::ValueSlot& OBISItem::at(uint32_t generation) const
+{
+  return slots[generation & 1];
+}
+
+/*
+Writes a fixed point value as text, exact and without float math, e.g. 4107331 with 3 decimals is "4107.331".
+Trailing zero decimals are left out ("0.020" is "0.02", "0.000" is "0"). Returns the length.
+*/
+int p1FormatFixed(char* out, int size, uint64_t mantissa, uint8_t decimals)
+{
+  char digits[24];
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + mantissa % 10;
+    mantissa /= 10;
+  } while (mantissa > 0 || n <= decimals); //At least one digit before the dot
+
+  int skip = 0; //Trailing zero decimals
+  while (skip < decimals && digits[skip] == '0')
+  {
+    skip++;
+  }
+
+  int len = 0;
+  for (int i = n - 1; i >= skip && len < size - 2; i--)
+  {
+    out[len++] = digits[i];
+    if (i == decimals && i > skip)
+    {
+      out[len++] = '.';
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+/*
+Writes the value as text (strings as is, no quoting), returns the length. Empty for NONE.
+*/
+int p1FormatValue(const OBISItem::ValueSlot& v, char* out, int size)
+{
+  switch (v.type)
+  {
+    case OBISItem::DOUBLE:
+      return p1FormatFixed(out, size, v.value.fixed.mantissa, v.value.fixed.decimals);
+    case OBISItem::INT32:
+      return snprintf(out, size, "%lu", (unsigned long)v.value.i32Value);
+    case OBISItem::INT64:
+      return snprintf(out, size, "%llu", (unsigned long long)v.value.i64Value);
+    case OBISItem::CHARARR:
+      return snprintf(out, size, "%s", v.value.stringValue);
+    default:
+      out[0] = '\0';
+      return 0;
+  }
+}
+
+/*
+Varint (7 bits per byte, low first) and zigzag (small negative numbers stay small) for the compact
+binary records of the history and the log. Returns the bytes written, at most 10.
+*/
+int p1VarintPut(uint8_t* out, uint64_t v)
+{
+  int len = 0;
+  while (v >= 0x80)
+  {
+    out[len++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  out[len++] = (uint8_t)v;
+  return len;
+}
+
+inline uint64_t p1Zigzag(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t p1Unzigzag(uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
 }
 
+/*
+Packs the device+obis-code into one key, e.g. 1-0:32.7.0. 
+Device digits fit in 8 bits each, the three OBIS code values in 16 bits each.
+*/
+uint64_t obisKey(uint16_t (&obcode)[5])
+{
+  return ((uint64_t)(obcode[0] & 0xFF) << 56) | ((uint64_t)(obcode[1] & 0xFF) << 48) 
+       | ((uint64_t)obcode[2] << 32) | ((uint64_t)obcode[3] << 16) | (uint64_t)obcode[4];
+}
+
+/*
+The parsed items of one meter and the pools their units and strings come from.
+*/
 class ParsedOBIS
 {
   public:
-  OBISItem* items;
+  OBISItem* items = nullptr;
+  int itemCount = 0; //Items taken from the pool, also the high-water mark
+  int listedCount = 0; //Items in the items list, the same unless there is a profile
+  OBISItem* firstLine = nullptr; //Item of the first line of the last telegram, see OBISItem::lineNext
+  OBISItem pool[P1_MAXITEMS]; //Items are never freed, no heap needed
+
+  /*
+  Generation of the parsed values, increased each time a complete and valid telegram is made current.
+  Each item keeps two value slots, readers use slot (generation & 1) and the parser fills the other one,
+  so readers never see a half parsed telegram and no locks are needed, see p1SnapshotGeneration().
+  */
+  std::atomic<uint32_t> generation{0};
+
+  /*
+  Fixed size pools for the units and string values, sizes are set at compile time (see P1_MAXUNITS, P1_STRING_ARENA).
+  Nothing is allocated from the heap, so long uptime does not fragment the ESP heap.
+  When a pool is full the value is skipped/cut and counted in allocFailures.
+  */
+  OBISUnit* unitList = nullptr;
+  OBISUnit unitPool[P1_MAXUNITS];
+  int unitCount = 0;
+  char stringArena[P1_STRING_ARENA];
+  int stringArenaUsed = 0; //Only grows, so it is also the high-water mark
+  int allocFailures = 0;
+
+  /*
+  Takes size bytes from the string arena, nullptr if full. Memory is never given back.
+  */
+  char* arenaAlloc(int size)
+  {
+    size = (size + 3) & ~3; //Keep blocks 4 byte aligned
+    if (stringArenaUsed + size > P1_STRING_ARENA)
+    {
+      allocFailures++;
+      return nullptr;
+    }
+    char* block = &stringArena[stringArenaUsed];
+    stringArenaUsed += size;
+    return block;
+  }
+
+  /*
+  Fixed size open-addressing index of the items by their packed key, no heap allocation.
+  The items list is still used to iterate over the items.
+  */
+  OBISItem* index[P1_INDEX_SIZE] = {};
+
+  static uint16_t indexSlot(uint64_t key)
+  {
+    uint32_t h = (uint32_t)(key ^ (key >> 29)) * 2654435761u;
+    return (h >> 16) & (P1_INDEX_SIZE - 1);
+  }
+
+  /*
+  Slot of the key in the index, or the empty slot where it should be added.
+  */
+  uint16_t findSlot(uint64_t key)
+  {
+    uint16_t slot = indexSlot(key);
+    while (index[slot] != nullptr && index[slot]->key != key)
+    {
+      slot = (slot + 1) & (P1_INDEX_SIZE - 1);
+    }
+    return slot;
+  }
+
+  /*
+  Codes known at compile time (p1profile.h), nullptr if none. Its items are the first ones of the pool, made
+  with the first item and not in the index. They go in the items list when first seen (bit per code), until
+  then they are not found, as codes not seen yet. Set it before any item is made.
+  */
+  const P1ProfileTable* profile = P1_PROFILE_TABLE;
+  uint64_t profileListed = 0;
+
+  void profileSetup()
+  {
+    if (profile->count > P1_MAXITEMS)
+    {
+      allocFailures++;
+      profile = nullptr;
+      return;
+    }
+    for (int code = 0; code < profile->count; code++)
+    {
+      OBISItem* item = &pool[code];
+      uint64_t key = profile->keys[code];
+      for (int r = 0; r < 5; r++)
+      {
+        item->obis[r] = r < 2 ? (key >> (56 - 8 * r)) & 0xFF : (key >> (64 - 16 * r)) & 0xFFFF;
+      }
+      item->key = key;
+      const char* unit = profile->units[code];
+      if (unit[0] != '\0')
+      {
+        item->setUnitType(*this, unit, 0, strlen(unit)); //Made current with its first value, as parsed ones
+      }
+    }
+    itemCount = profile->count;
+  }
+
+  OBISItem* profileItem(int code)
+  {
+    OBISItem* item = &pool[code];
+    if (!(profileListed & (1ull << code)))
+    {
+      profileListed |= 1ull << code;
+      item->outputs = p1FilterOutputs(item->obis, item->key); //The filters may have changed since setup
+      item->next = items;
+      items = item;
+      listedCount++;
+    }
+    return item;
+  }
+
+  OBISItem* findOBISItem(uint64_t key)
+  {
+    if (profile != nullptr)
+    {
+      int code = p1ProfileIndex(*profile, key);
+      if (code >= 0)
+      {
+        return profileListed & (1ull << code) ? &pool[code] : nullptr;
+      }
+    }
+    return index[findSlot(key)];
+  }
+
+  /*
+  Returns nullptr if the index is full (P1_MAXITEMS), the caller should then skip the line.
+  */
   OBISItem* findOrCreatOBISItem(uint16_t (&obcode)[5])
   {
-    OBISItem* item = items;
-    while (item != nullptr)
+    uint64_t key = obisKey(obcode);
+    if (profile != nullptr)
     {
-      if (compareObisArrays(obcode,item->obis))
+      if (itemCount == 0)
+      {
+        profileSetup();
+      }
+      int code = profile != nullptr ? p1ProfileIndex(*profile, key) : -1;
+      if (code >= 0)
       {
-        return item;
+        return profileItem(code);
       }
-      item = item->next;
+    }
+    uint16_t slot = findSlot(key);
+    if (index[slot] != nullptr)
+    {
+      return index[slot];
     }
 
     //Not found, create new
-    item = new OBISItem();
+    if (itemCount >= P1_MAXITEMS)
+    {
+      allocFailures++;
+      return nullptr;
+    }
+    OBISItem* item = &pool[itemCount];
     for (int r = 0; r<5;r++)
     {
       item->obis[r] = obcode[r];
     }
+    item->key = key;
+    item->outputs = p1FilterOutputs(item->obis, key);
+    index[slot] = item;
+    itemCount++;
+    listedCount++;
 
     item->next = items;
     items = item;
@@ -202,9 +529,236 @@ class ParsedOBIS
   }
 };
 
+void OBISItem::setUnitType(ParsedOBIS& parsed, const char* array, int startIndex, int endIndex)
+{
+  int size = endIndex - startIndex;
+  OBISUnit* unitl = parsed.unitList;
+  while (unitl != nullptr)   //Finding existing declared unit
+  {     
+    if (strlen(unitl->unitstr) == size)
+    {
+      bool found = true;
+      for (int i = 0 ; i<size; i++)
+      {
+        if (unitl->unitstr[i] != array[startIndex + i])
+        {
+          found = false;
+          break;
+        }
+      }
+      if (found)
+      {
+        pendingUnit = unitl;
+        return;
+      }
+    }
+    unitl = unitl->next;
+  }
+  //Creating new unit in unit list
+  if (parsed.unitCount >= P1_MAXUNITS || size >= P1_MAXUNIT)
+  {
+    parsed.allocFailures++;
+    return;
+  }
+  OBISUnit* newUnit = &parsed.unitPool[parsed.unitCount++];
+  for (int i = 0 ; i<size; i++)
+  {
+    newUnit->unitstr[i] = array[startIndex + i];
+  }
+  newUnit->unitstr[size] = '\0';
+  newUnit->next = parsed.unitList;
+  parsed.unitList = newUnit;
+  pendingUnit = newUnit;
+}
+
+
+/*
+Incremental (push) parser. Bytes are fed as they arrive from the serial, each OBIS line is finished 
+when its end-of-line is seen, so the items are up to date as soon as the '!' has been received.
+Values are converted while the bytes arrive, no second pass over the telegram or the value.
+All of its state is in a P1Parser, so several can run at once (e.g. one per thread, see host/p1bulk.h),
+the device has one, p1main. A P1Parser is large (the item pool), make it static or value-initialize it
+(new P1Parser()) so it starts zeroed.
+*/
+enum P1ParseState {P1P_LINESTART=0, P1P_DASH=1, P1P_CHANNEL=2, P1P_COLON=3, P1P_CODE=4, P1P_VALUE=5, P1P_UNIT=6, P1P_GAP=7, P1P_SKIP=8, P1P_CRC=9, P1P_DONE=10};
+
+struct P1Parser
+{
+  ParsedOBIS parsed;
+  char buffer[P1_MAXBUFFER]; //Raw copy of the last telegram read from the serial
+  int length = 0;
+
+  /*
+  Called for each valid telegram just before it is made current, the values of it are then in the parsing slots
+  (items not in it still in their current ones). Used to add derived values, see p1derived.h.
+  */
+  void (*beforeCommit)(P1Parser& parser) = nullptr;
+
+  P1ParseState state = P1P_LINESTART;
+  uint16_t obis[5]; //Device+obis-code of the line being parsed
+  uint16_t crc = 0; //CRC of the telegram so far
+  uint16_t crcReceived = 0; //CRC sent by the meter after the '!'
+  int crcDigits = 0;
+  bool crcValid = false; //Last finished telegram had a matching CRC (or the meter sends none)
+  int field = 0; //Which of the three OBIS code digit groups is being parsed
+  OBISItem* item = nullptr;
+  OBISItem* lastLine = nullptr; //Item of the previous line of this telegram
+  uint64_t lineHash = 0; //Of the line being parsed if it was whole in one chunk, else 0
+  bool skipUnchanged = true; //Off: every line is parsed, items in a telegram are always marked changed
+  long unchangedLines = 0; //Lines found the same as in the last telegram and not parsed again
+
+  //State of the value within brackets being parsed, e.g. (123.456*kWh)
+  char value[P1_MAXVALUE]; //Copy of the value, only used when it turns out to be a string
+  int valueLen = 0; //Length of the value, can be longer than what fits in value
+  char unit[P1_MAXUNIT];
+  int unitLen = 0;
+  bool star = false;
+  bool digitsOnly = true; //Only digits seen in the value
+  bool doubleValid = true; //Only digits and max single dot seen in the value
+  bool dotInGroup = false; //Dot seen anywhere within the brackets
+  uint64_t valueInt = 0; //All digits of the value, also the decimals
+  uint8_t digits = 0;
+  uint8_t decimals = 0; //Digits after the dot
+
+#ifdef P1_LAZY_VALUES
+  /*
+  Copies of the telegram being parsed and the last valid one, by generation as the value slots, so views
+  in the current slots stay valid until the telegram after the next one is parsed. Bytes past the end
+  are not kept, values in them are skipped and counted in allocFailures.
+  */
+  char raw[2][P1_MAXBUFFER];
+  int rawLength = 0; //Bytes of the telegram so far, also those that did not fit
+  int valueStart = 0; //Of the value being parsed, in raw
+  int lineStart = 0; //Of the line being parsed, in raw
+  int valueEnd = 0; //Its '*'
+#endif
+};
+
+/*
+The device's parser and the names the rest of the code knows its parts by.
+*/
+P1Parser p1main;
+ParsedOBIS* p1parsed = &p1main.parsed;
+std::atomic<uint32_t>& p1Generation = p1main.parsed.generation;
+char (&P1buffer)[P1_MAXBUFFER] = p1main.buffer;
+int& P1length = p1main.length;
+bool& P1crcValid = p1main.crcValid;
+OBISUnit*& unitList = p1main.parsed.unitList;
+int& unitCount = p1main.parsed.unitCount;
+int& stringArenaUsed = p1main.parsed.stringArenaUsed;
+int& p1AllocFailures = p1main.parsed.allocFailures;
+
+inline const OBISItem::ValueSlot& OBISItem::current() const
+{
+  return at(p1Generation.load(std::memory_order_acquire));
+}
+
+inline OBISItem::ValueSlot& OBISItem::parsing()
+{
+  return parsing(p1Generation.load(std::memory_order_relaxed));
+}
+
+bool p1ProfileSeen(ParsedOBIS& parsed, int code)
+{
+  return parsed.profile != nullptr && code < parsed.profile->count && (parsed.profileListed & (1ull << code));
+}
+
+/*
+Value of a profile item in the parser's last valid telegram, nullptr if it has none (yet).
+*/
+const OBISItem::ValueSlot* p1ProfileSlot(ParsedOBIS& parsed, int code)
+{
+  if (!p1ProfileSeen(parsed, code))
+  {
+    return nullptr;
+  }
+  return &parsed.pool[code].at(parsed.generation.load(std::memory_order_acquire));
+}
+
+double p1ProfileDouble(ParsedOBIS& parsed, int code)
+{
+  const OBISItem::ValueSlot* v = p1ProfileSlot(parsed, code);
+  return v != nullptr && v->type == OBISItem::DOUBLE ? v->getDouble() : 0;
+}
+
+uint32_t p1ProfileInt32(ParsedOBIS& parsed, int code)
+{
+  const OBISItem::ValueSlot* v = p1ProfileSlot(parsed, code);
+  return v != nullptr && v->type == OBISItem::INT32 ? v->value.i32Value : 0;
+}
+
+uint64_t p1ProfileInt64(ParsedOBIS& parsed, int code)
+{
+  const OBISItem::ValueSlot* v = p1ProfileSlot(parsed, code);
+  return v != nullptr && v->type == OBISItem::INT64 ? v->value.i64Value : 0;
+}
+
+const char* p1ProfileString(ParsedOBIS& parsed, int code)
+{
+  const OBISItem::ValueSlot* v = p1ProfileSlot(parsed, code);
+  return v != nullptr && v->type == OBISItem::CHARARR ? v->value.stringValue : "";
+}
+
+#ifdef P1_PROFILE
+P1_PROFILE p1profile = {p1main.parsed}; //e.g. p1profile.activePowerImport()
+#endif
+
+/*
+Sets the filter of an output (see p1filter.h) and matches the items there are already against it.
+Returns false if the spec cannot be read, the filter is then left as it was.
+*/
+bool p1SetFilter(P1FilterOutput output, const char* spec)
+{
+  if (!p1FilterCompile(p1Filters[output], spec))
+  {
+    return false;
+  }
+  for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+  {
+    item->outputs = p1FilterOutputs(item->obis, item->key);
+  }
+  return true;
+}
 
+/*
+Channel of the item when outputs are grouped by it: 0-B for a sub-device (e.g. 0-1, the first M-Bus device)
+as B * 256, the meter's own items (0-0, 1-0, 1-3 etc.) are all one group, A, and come first.
+*/
+inline uint16_t p1Channel(const OBISItem* item)
+{
+  return item->obis[0] == 0 && item->obis[1] > 0 ? (item->obis[1] & 0xFF) << 8 : item->obis[0] & 0xFF;
+}
 
-ParsedOBIS* p1parsed = new ParsedOBIS();
+/*
+Next item of the outputs (bitmask) with the items of a channel together and the channels in order, nullptr at
+the end. Start with nullptr. Within a channel the items keep their list order.
+*/
+OBISItem* p1NextGrouped(OBISItem* item, uint8_t outputs)
+{
+  if (item != nullptr)
+  {
+    for (OBISItem* i = item->next; i != nullptr; i = i->next)
+    {
+      if ((i->outputs & outputs) && p1Channel(i) == p1Channel(item))
+      {
+        return i;
+      }
+    }
+  }
+  OBISItem* first = nullptr; //First item of the next channel
+  for (OBISItem* i = p1parsed->items; i != nullptr; i = i->next)
+  {
+    if (!(i->outputs & outputs) || (item != nullptr && p1Channel(i) <= p1Channel(item)))
+    {
+      continue;
+    }
+    if (first == nullptr || p1Channel(i) < p1Channel(first))
+    {
+      first = i;
+    }
+  }
+  return first;
+}
 
 
 /*
@@ -213,12 +767,11 @@ TODO: Add as a configuration/input parameters to a setup function
 */
 void p1setup() 
 {
-    pinMode(P1_REQUEST_PIN, OUTPUT); //Request pin!
-    pinMode(D7,INPUT); //Using the "other Serial HW pins"
-    Serial.begin(9600,SERIAL_7N1,SERIAL_RX_ONLY);
-    Serial.swap();
-    Serial.flush();
-    P1NextMillis = millis() + P1_READ_INTERVAL;
+    p1HalSetup(); //Request pin and serial, see p1hal.h
+    p1SetFilter(P1F_API, P1_FILTER_API);
+    p1SetFilter(P1F_UPLOAD, P1_FILTER_UPLOAD);
+    p1SetFilter(P1F_MQTT, P1_FILTER_MQTT);
+    P1NextMillis = p1Millis() + P1_READ_INTERVAL;
 }
 
 /*
@@ -272,404 +825,921 @@ bool compareObisCode(OBISItem *item, OBISItem *pi)
 }
 
 
-void parseStrArrIntoItem(const char* array, int startIndex, int endIndex, OBISItem *item) 
+/*
+Copies a string into the slot's arena block. The block is only replaced when the value grows beyond it,
+then the capacity is doubled so a value changing length does not keep taking from the arena.
+*/
+void p1SlotString(ParsedOBIS& parsed, OBISItem::ValueSlot& slot, const char* str, int length)
 {
-  int newSize = endIndex - startIndex + 1;
-
-  if (item->type == OBISItem::CHARARR  && strlen(item->value.stringValue) == newSize) //We already have the itme definded with some CHARARR items
+  if (length + 1 > slot.capacity)
   {
-    for (int i = startIndex; i <= endIndex; i++) 
+    int capacity = slot.capacity * 2 > length + 1 ? slot.capacity * 2 : length + 1;
+    char* block = parsed.arenaAlloc(capacity);
+    if (block != nullptr)
     {
-      item->value.stringValue[i - startIndex] = array[i];
+      slot.buffer = block;
+      slot.capacity = (capacity + 3) & ~3;
+    }
+    else if (slot.buffer == nullptr) //Arena full and nothing to cut into
+    {
+      slot.type = OBISItem::NONE;
+      return;
+    }
+    else
+    {
+      length = slot.capacity - 1; //Cut to what we have
     }
-    item->value.stringValue[newSize] = '\0'; // Null-terminate the string
-    return;
-  } 
-
-  if (item->type == OBISItem::CHARARR && item->value.stringValue != nullptr) 
-  {
-    delete[] item->value.stringValue;
   }
 
-  item->value.stringValue = new char[newSize + 1];
-  item->type = OBISItem::CHARARR;
+  memcpy(slot.buffer, str, length);
+  slot.buffer[length] = '\0'; // Null-terminate the string
+  slot.value.stringValue = slot.buffer;
+  slot.type = OBISItem::CHARARR;
+}
 
-  for (int i = startIndex; i <= endIndex; i++) 
-  {
-    item->value.stringValue[i - startIndex] = array[i];
-  }
-  item->value.stringValue[newSize] = '\0'; // Null-terminate the string
+void parseStrArrIntoItem(ParsedOBIS& parsed, const char* array, int startIndex, int endIndex, OBISItem *item) 
+{
+  p1SlotString(parsed, item->parsing(parsed.generation.load(std::memory_order_relaxed)), array + startIndex, endIndex - startIndex + 1);
+}
+
+void p1MarkPending(OBISItem* item)
+{
+  item->isPending = true;
 }
 
 /*
-  This parse function assumes only positive double values and updates isValid=false if array contains other than only digits and single dot.
+Returns the generation to read, see OBISItem::at(). Lock free: after reading, check p1SnapshotStable()
+and read again if a new telegram was made current meanwhile.
 */
-double parseDoubleFromArray(const char* array, int startIndex, int endIndex, bool& isValid) {
+uint32_t p1SnapshotGeneration()
+{
+  return p1Generation.load(std::memory_order_acquire);
+}
 
-    double result = 0.0;
-    int i = startIndex;
-    for (; i <= endIndex; i++) 
-    {
-          if (array[i] == '.') 
-          {
-            i++;
-            double factor = 1.0;
-            for (; i <= endIndex; i++) 
-            {
-              factor *= 0.1;            
-              result += (getInteger(array[i],isValid)*factor);
-            }
-            break;
-          }
-        result = result * 10.0 + getInteger(array[i],isValid);
-    }
-    return result;
+bool p1SnapshotStable(uint32_t generation)
+{
+  std::atomic_thread_fence(std::memory_order_acquire); //Value reads above happen before the check
+  return p1Generation.load(std::memory_order_acquire) == generation;
 }
 
-uint32_t parseInt32FromArray(const char* array, int startIndex, int endIndex, bool& isValid) {
-    uint32_t result = 0;
-    int i = startIndex;
-    for (; i <= endIndex; i++) 
-    {
-        result = result * 10.0 + getInteger(array[i],isValid);
-    }
-    return result;
+/*
+Copies the current value of the item into its parsing slot.
+*/
+void p1KeepValue(ParsedOBIS& parsed, OBISItem* item, uint32_t generation)
+{
+  const OBISItem::ValueSlot& from = item->at(generation);
+  OBISItem::ValueSlot& to = item->parsing(generation);
+  if (from.type == OBISItem::CHARARR)
+  {
+    p1SlotString(parsed, to, from.value.stringValue, strlen(from.value.stringValue));
+  }
+  else
+  {
+    to.value = from.value;
+    to.type = from.type;
+  }
+#ifdef P1_LAZY_VALUES
+  to.view.bytes = nullptr; //Its bytes are not in the new copy of the telegram
+#endif
 }
 
-uint64_t parseInt64FromArray(const char* array, int startIndex, int endIndex, bool& isValid) {
-    uint64_t result = 0;
-    int i = startIndex;
-    for (; i <= endIndex; i++) 
+/*
+The telegram is complete and valid, the parsed slots become the current ones by increasing the generation.
+Items not in this telegram get their current value copied, so the new slots are a complete snapshot.
+Items in it are marked changed unless their line was the same as in the last one (a line not known,
+e.g. of a derived value, counts as changed). With P1_LAZY_VALUES their views are decoded here, in the parser's
+context, so readers of the current slots never write to them.
+*/
+void p1CommitTelegram(ParsedOBIS& parsed)
+{
+  uint32_t generation = parsed.generation.load(std::memory_order_relaxed);
+  for (OBISItem* item = parsed.items; item != nullptr; item = item->next)
+  {
+    if (item->isPending)
     {
-        result = result * 10.0 + getInteger(array[i],isValid);
+      p1Decoded(item->parsing(generation));
+      if (item->unit == nullptr)
+      {
+        item->unit = item->pendingUnit;
+      }
+      item->changed = item->pendingLineHash == 0 || item->pendingLineHash != item->lineHash;
+      item->lineHash = item->pendingLineHash;
+      item->isPending = false;
+      continue;
     }
-    return result;
+    item->changed = false;
+    p1KeepValue(parsed, item, generation);
+  }
+  parsed.generation.store(generation + 1, std::memory_order_release);
+}
+
+/*
+The telegram was not valid (CRC mismatch or cut), the last good values are kept.
+*/
+void p1DiscardTelegram(ParsedOBIS& parsed)
+{
+  for (OBISItem* item = parsed.items; item != nullptr; item = item->next)
+  {
+    item->isPending = false;
+  }
+}
+
+void p1DiscardTelegram()
+{
+  p1DiscardTelegram(p1main.parsed);
+}
+
+/*
+DSMR CRC16 (polynomial 0xA001, reflected, starting from 0) over the telegram from '/' up to and including '!'.
+Updated one byte at a time as the bytes arrive. The bitwise variant needs no memory, the table variant
+(select with P1_CRC_TABLE) trades 512 bytes of flash for a single lookup per byte.
+*/
+uint16_t p1Crc16Update(uint16_t crc, uint8_t c)
+{
+  crc ^= c;
+  for (int i = 0; i < 8; i++)
+  {
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  }
+  return crc;
+}
+
+static const uint16_t p1CrcTable[256] PROGMEM = {
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+uint16_t p1Crc16UpdateTable(uint16_t crc, uint8_t c)
+{
+  return (crc >> 8) ^ pgm_read_word(&p1CrcTable[(crc ^ c) & 0xFF]);
+}
+
+#ifdef P1_CRC_TABLE
+#define P1_CRC16_UPDATE p1Crc16UpdateTable
+#else
+#define P1_CRC16_UPDATE p1Crc16Update
+#endif
+
+int getHexValue(const char& c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+#ifdef P1_LAZY_VALUES
+inline char* p1RawBuffer(P1Parser& p)
+{
+  return p.raw[(p.parsed.generation.load(std::memory_order_relaxed) & 1) ^ 1];
+}
+#endif
+
+/*
+Bytes parsed in a run (not one by one), they are in the telegram copy already, see p1ParseChunk().
+*/
+inline void p1RawRun(P1Parser& p, int n)
+{
+#ifdef P1_LAZY_VALUES
+  p.rawLength += n;
+#else
+  (void)p; //Only the lazy copy counts them
+  (void)n;
+#endif
+}
+
+void p1ParseBegin(P1Parser& p)
+{
+  p.state = P1P_LINESTART;
+#ifdef P1_LAZY_VALUES
+  p.rawLength = 0;
+  p.lineStart = 0;
+#endif
+  p.item = nullptr;
+  p.lastLine = nullptr;
+  p.lineHash = 0;
+  p.crc = 0;
+  p1DiscardTelegram(p.parsed); //In case the last telegram was never finished
 }
 
 /*
-  This parse function assumes only positive value and updates isValid=false if array contains other than only digits and single dot. 
+Handles the CRC hex digits after the '!'. Returns true when the telegram is finished, the pending values
+are then made current if the CRC matches. Meters without CRC (e.g. DSMR 2.2) end the '!' line right away and are accepted.
 */
-bool isOnlyDigitsInArray(const char* array, int startIndex, int endIndex) {
-    int i = startIndex;
-    bool isValid = true;
-    for (; i <= endIndex; i++) 
+bool p1CrcByte(P1Parser& p, const char& c)
+{
+  int h = getHexValue(c);
+  if (h >= 0)
+  {
+    p.crcReceived = (p.crcReceived << 4) | h;
+    p.crcDigits++;
+    if (p.crcDigits < 4)
+    {
+      return false;
+    }
+  }
+
+  p.crcValid = p.crcDigits == 0 || (p.crcDigits == 4 && p.crcReceived == p.crc);
+  if (p.crcValid)
+  {
+    P1_TIMED_BEGIN(commit);
+    if (p.beforeCommit != nullptr)
     {
-      getInteger(array[i],isValid);
-      if (!isValid)
-        break;
+      p.beforeCommit(p);
     }
-    return isValid;
+    p1CommitTelegram(p.parsed);
+    P1_TIMED_END(commit, P1T_COMMIT);
+  }
+  else
+  {
+    p1DiscardTelegram(p.parsed);
+  }
+  p.state = P1P_DONE;
+  return true;
+}
+
+void p1BeginValue(P1Parser& p)
+{
+  p.valueLen = 0;
+  p.unitLen = 0;
+  p.star = false;
+  p.digitsOnly = true;
+  p.doubleValid = true;
+  p.dotInGroup = false;
+  p.valueInt = 0;
+  p.digits = 0;
+  p.decimals = 0;
+#ifdef P1_LAZY_VALUES
+  p.valueStart = p.rawLength;
+#endif
 }
 
-void parseItems()
+void p1ValueByte(P1Parser& p, const char& c)
 {
-  uint16_t linepos = 0; //The position within a new-line. Starting as 0 and reset when detecting \c\r
-  bool failParseLine = false;
-  int i = 0;
-  OBISItem* parsingItem = nullptr;
-  while (i<P1length) 
+#ifdef P1_LAZY_VALUES
+  p.valueLen++; //The bytes are in the telegram copy, decoded at the commit
+  return;
+#endif
+  if (p.valueLen < P1_MAXVALUE - 1)
   {
-    bool isValid = true;
-    if (!failParseLine) {
+    p.value[p.valueLen] = c;
+  }
+  p.valueLen++;
+
+  bool isValid = true;
+  int d = getInteger(c, isValid);
+  if (isValid) //Integer math only, no soft-float on the ESP
+  {
+    p.valueInt = p.valueInt * 10 + d;
+    if (p.dotInGroup)
+    {
+      p.decimals++;
+    }
+    if (++p.digits > 18) //Would not fit the 64 bit mantissa
+    {
+      p.doubleValid = false;
+    }
+    return;
+  }
 
-      //Parse DeviceID
-      if (linepos == 0 || linepos == 2) 
+  p.digitsOnly = false;
+  if (c != '.' || p.dotInGroup)
+  {
+    p.doubleValid = false;
+  }
+  if (c == '.')
+  {
+    p.dotInGroup = true;
+  }
+}
+
+/*
+A run of digits of the value at once (see p1ScanDigits), the same as p1ValueByte() for each of them.
+*/
+void p1ValueDigits(P1Parser& p, const char* s, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    p.crc = P1_CRC16_UPDATE(p.crc, s[i]);
+  }
+  p1RawRun(p, n);
+#ifdef P1_LAZY_VALUES
+  p.valueLen += n;
+  return;
+#endif
+  if (p.valueLen < P1_MAXVALUE - 1)
+  {
+    int room = P1_MAXVALUE - 1 - p.valueLen;
+    memcpy(p.value + p.valueLen, s, n < room ? n : room);
+  }
+  p.valueLen += n;
+  p.valueInt = p1DigitsValue(s, n, p.valueInt);
+  if (p.dotInGroup)
+  {
+    p.decimals += n;
+  }
+  if (p.digits + n > 18) //Would not fit the 64 bit mantissa
+  {
+    p.doubleValid = false;
+  }
+  p.digits += n;
+}
+
+/*
+Item the next line is expected to be for, the one that followed the previous line in the last telegram.
+Meters send their lines in the same order each time.
+*/
+inline OBISItem* p1ExpectedLine(P1Parser& p)
+{
+  return p.lastLine != nullptr ? p.lastLine->lineNext : p.parsed.firstLine;
+}
+
+void p1LineItem(P1Parser& p, OBISItem* item)
+{
+  if (p.lastLine != nullptr)
+  {
+    p.lastLine->lineNext = item;
+  }
+  else
+  {
+    p.parsed.firstLine = item;
+  }
+  p.lastLine = item;
+}
+
+/*
+The line (without its '\n') is the same as the one the item's current value came from, the value is kept
+without parsing the line again or looking up its code.
+*/
+void p1KeepLine(P1Parser& p, OBISItem* item, const char* line, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    p.crc = P1_CRC16_UPDATE(p.crc, line[i]);
+  }
+  uint32_t generation = p.parsed.generation.load(std::memory_order_relaxed);
+#ifdef P1_LAZY_VALUES
+  const OBISItem::ValueSlot& from = item->at(generation);
+  if (from.view.bytes != nullptr && from.view.lineOffset < 255 && p.rawLength + length <= P1_MAXBUFFER)
+  {
+    OBISItem::ValueSlot& to = item->parsing(generation); //A view on the same bytes of the new copy
+    to.view = from.view;
+    to.view.bytes = p1RawBuffer(p) + p.rawLength + from.view.lineOffset;
+    to.value = from.value;
+    to.type = from.type == OBISItem::CHARARR ? OBISItem::VIEW : from.type; //Strings are terminated in the new copy at the commit
+  }
+  else
+#endif
+  {
+    p1KeepValue(p.parsed, item, generation);
+  }
+  p1RawRun(p, length);
+  item->pendingLineHash = p.lineHash;
+  p1MarkPending(item);
+  p1LineItem(p, item);
+  p.unchangedLines++;
+}
+
+/*
+Stores the value as the type the profile gives the item, if it has one and the value can be that type
+(else it is guessed, see p1CommitValue()). Only the conditions of that type are checked, the same as the
+guess has for it, so values come out the same. INT64 and strings are rare and left to the guess.
+*/
+bool p1ProfileValue(P1Parser& p, OBISItem::ValueSlot& slot)
+{
+  int code = p.item - p.parsed.pool;
+  if (p.parsed.profile == nullptr || code >= p.parsed.profile->count)
+  {
+    return false;
+  }
+  switch (p.parsed.profile->types[code])
+  {
+    case P1PT_DOUBLE:
+      if (!p.dotInGroup || !p.doubleValid)
       {
-        int x = getInteger(P1buffer[i], isValid);        
-        if (isValid)
-        {
-          if (linepos == 0)
-          {
-            parsingobis[0] = x;
-          }
-          else
-          {
-            parsingobis[1] = x;
-          }
-        }
-        else //We only parse out actual OBIS codes, not other lines.
-        {
-          failParseLine = true;
-        }
+        return false;
       }
-      if (linepos == 1 && P1buffer[i] != '-')
+      slot.value.fixed.mantissa = p.valueInt;
+      slot.value.fixed.decimals = p.decimals;
+      slot.type = OBISItem::DOUBLE;
+      return true;
+    case P1PT_INT32:
+      if (p.dotInGroup || !p.digitsOnly || p.valueLen + (p.star ? p.unitLen + 1 : 0) >= 10)
       {
-        failParseLine = true;
+        return false;
       }
+      slot.value.i32Value = (uint32_t)p.valueInt;
+      slot.type = OBISItem::INT32;
+      return true;
+    default:
+      return false; //INT64 and strings are rare, guessed
+  }
+}
 
-      //Parse OBIS code info
-      if (linepos == 3 && P1buffer[i] == ':') //We are in the obis-coding , e.g. 1.85.5 - to parse into obis array
+/*
+Stores the value of a bracket group (value and unit) as the item's pending value, called on the closing bracket.
+Using "good enough" data type detection for scenarios in OBIS codes.
+*/
+void p1CommitValue(P1Parser& p)
+{
+  OBISItem* item = p.item;
+  if (p.valueLen == 0 && !p.star) //Empty value, e.g. 0-0:96.13.0() - nothing to store
+  {
+    return;
+  }
+
+  OBISItem::ValueSlot& slot = item->parsing(p.parsed.generation.load(std::memory_order_relaxed));
+#ifdef P1_LAZY_VALUES
+  int end = p.star ? p.valueEnd : p.rawLength - 1; //The ')' is in already
+  if (p.rawLength > P1_MAXBUFFER) //Not all in the telegram copy
+  {
+    p.parsed.allocFailures++;
+    return;
+  }
+  slot.view.bytes = p1RawBuffer(p) + p.valueStart;
+  slot.view.length = end - p.valueStart;
+  slot.view.unitLength = p.unitLen;
+  slot.view.star = p.star;
+  slot.view.unitDot = p.dotInGroup; //Only the unit sets it here, see p1ValueByte()
+  slot.view.lineOffset = p.valueStart - p.lineStart < 255 ? p.valueStart - p.lineStart : 255;
+  slot.type = OBISItem::VIEW;
+#else
+  int storedLen = p.valueLen < P1_MAXVALUE - 1 ? p.valueLen : P1_MAXVALUE - 1;
+  int groupLen = p.valueLen + (p.star ? p.unitLen + 1 : 0); //Value and unit within brackets
+  if (!p1ProfileValue(p, slot)) //Type not known, guessed
+  {
+    if (p.dotInGroup) //value with decimal point, (try)parse as double
+    {
+      if (p.doubleValid)
       {
-        int obisPos = 0; //Starting with the first obis code digits
-        parsingobis[2] = 0; //Init a zero
-        parsingobis[3] = 0; //Init a zero
-        parsingobis[4] = 0; //Init a zero
-        i++; linepos++; //Move over the ':'
-        while (P1buffer[i] != '(') //Until we are at the end of OBIS code declaration in message
-        {
-          if (obisPos > 2) { //Obis codes are only three integers. Something is not parsing correctly.
-            failParseLine = true;
-            break;
-          }
-          isValid = true;
-          int y = getInteger(P1buffer[i], isValid);
-          while (P1buffer[i] != '.' && isValid)
-          {    
-            if (isValid) 
-            {
-              parsingobis[obisPos+2] *= 10;
-              parsingobis[obisPos+2] += y;
-            } 
-            else
-            {
-              failParseLine = true;
-              break;
-            }
-            i++; linepos++;
-            y = getInteger(P1buffer[i],isValid);
-          }
-          if (P1buffer[i] == '.')
-          {
-            obisPos++; //Move to next OBIS POSITION
-            i++; linepos++; //Move over the DOT '.' position
-          }
-        }
-      } 
-      else if(linepos == 3) 
+        slot.value.fixed.mantissa = p.valueInt;
+        slot.value.fixed.decimals = p.decimals;
+        slot.type = OBISItem::DOUBLE;
+      }
+      else
       {
-        failParseLine = true;
+        parseStrArrIntoItem(p.parsed, p.value,0,storedLen-1,item); //sets the string value into item and handles memory&fragmentation
       }
-
-      if (P1buffer[i] == '(' && (parsingobis[2] + parsingobis[3] + parsingobis[4] > 0)) //Value for OBIS code parsing starts and we have a valid OBIS
+    }
+    else if (p.digitsOnly)
+    {
+      if (groupLen > 18) //We parse as string/none?
+      {
+        parseStrArrIntoItem(p.parsed, p.value,0,storedLen-1,item);
+      } 
+      else if (groupLen < 10) //We parse as int32
+      {
+        slot.value.i32Value = (uint32_t)p.valueInt;
+        slot.type = OBISItem::INT32;
+      } 
+      else //We parse as 64
       {
+        slot.value.i64Value = p.valueInt;
+        slot.type = OBISItem::INT64;
+      }
+    }
+    else
+    {
+      parseStrArrIntoItem(p.parsed, p.value,0,storedLen-1,item);
+    }
+  }
+#endif
 
-        i++; //Jump over the bracket '('
-        int le = 0;
-        int dotPos = -1;
-        int starPos = -1;
-        int endPos = -1;
+  /*
+    Unit handling for OBIS. 
+    Assumption. Unit of a given OBIS code should never change. No need to re-update (MC restart would ofc. refresh)
+  */
+  if (p.star && item->unit == nullptr && item->pendingUnit == nullptr) //Profile items have theirs
+  {
+    item->setUnitType(p.parsed, p.unit, 0, p.unitLen);
+  }
+  p1MarkPending(item);
+}
 
-        //Find parsingObis item or create;
-        parsingItem =  p1parsed->findOrCreatOBISItem(parsingobis);
+/*
+One byte through the state machine, see p1ParseByte().
+*/
+bool p1ParseStep(P1Parser& p, const char& c)
+{
+  if (p.state >= P1P_CRC)
+  {
+    return p.state == P1P_CRC && p1CrcByte(p, c);
+  }
 
+  p.crc = P1_CRC16_UPDATE(p.crc, c);
+#ifdef P1_LAZY_VALUES
+  p.rawLength++; //The byte is in the telegram copy already
+#endif
+  if (c == '!') //End of telegram, CRC follows
+  {
+    p.crcReceived = 0;
+    p.crcDigits = 0;
+    p.state = P1P_CRC;
+    return false;
+  }
 
+  if (c == '\n') //New line, get ready for parsing the next one. Unfinished values are dropped.
+  {
+    p.state = P1P_LINESTART;
+    p.lineHash = 0;
+#ifdef P1_LAZY_VALUES
+    p.lineStart = p.rawLength;
+#endif
+    return false;
+  }
+  if (c == '\r')
+  {
+    return false;
+  }
 
-        //Finding end position of value. Try detect value type.
-        char t = P1buffer[i+le];
-        while (endPos == -1 && t != '\n' && i+le<P1length)
-        {
-          if (t == '.')
-          {
-            dotPos = i+le;
-          }
-          else if (t == '*')
-          {
-            starPos = i+le;
-          }
-          le++;
-          t = P1buffer[i+le];
-          if (t == ')') 
-          {
-            endPos = i+le;
-          }
-        } //endFind
-
-        int pos = endPos - 1; //EndPosition for the value within brackets  () or before star * , eg (123.456*xyz) = 123.456 positions
-        if (starPos > 0)
+  bool isValid = true;
+  switch (p.state)
+  {
+    case P1P_LINESTART: //Parse DeviceID, e.g. 1-0
+    {
+      int x = getInteger(c, isValid);
+      p.obis[0] = x;
+      p.state = isValid ? P1P_DASH : P1P_SKIP; //We only parse out actual OBIS codes, not other lines.
+      break;
+    }
+    case P1P_DASH:
+      p.state = c == '-' ? P1P_CHANNEL : P1P_SKIP;
+      break;
+    case P1P_CHANNEL:
+    {
+      int x = getInteger(c, isValid);
+      p.obis[1] = x;
+      p.state = isValid ? P1P_COLON : P1P_SKIP;
+      break;
+    }
+    case P1P_COLON:
+      if (c == ':') //We are in the obis-coding , e.g. 1.85.5 - to parse into obis array
+      {
+        p.obis[2] = 0;
+        p.obis[3] = 0;
+        p.obis[4] = 0;
+        p.field = 0;
+        p.state = P1P_CODE;
+      }
+      else
+      {
+        p.state = P1P_SKIP;
+      }
+      break;
+    case P1P_CODE:
+    {
+      int y = getInteger(c, isValid);
+      if (isValid)
+      {
+        p.obis[p.field+2] *= 10;
+        p.obis[p.field+2] += y;
+      }
+      else if (c == '.' && p.field < 2) //Obis codes are only three integers.
+      {
+        p.field++;
+      }
+      else if (c == '(' && (p.obis[2] + p.obis[3] + p.obis[4] > 0)) //Value for OBIS code starts and we have a valid OBIS
+      {
+        OBISItem* expected = p1ExpectedLine(p);
+        p.item = expected != nullptr && expected->key == obisKey(p.obis) ? expected : p.parsed.findOrCreatOBISItem(p.obis);
+        if (p.item == nullptr) //No room for more codes
         {
-          pos = starPos -1;
+          p.state = P1P_SKIP;
+          break;
         }
-        
-        if (endPos > 0) //Start parsing values
+        p.item->pendingLineHash = p.lineHash;
+        p1LineItem(p, p.item);
+        p1BeginValue(p);
+        p.state = P1P_VALUE;
+      }
+      else
+      {
+        p.state = P1P_SKIP;
+      }
+      break;
+    }
+    case P1P_VALUE:
+      if (c == ')')
+      {
+        p1CommitValue(p);
+        p.state = P1P_GAP;
+      }
+      else if (c == '*')
+      {
+        p.star = true;
+        p.state = P1P_UNIT;
+#ifdef P1_LAZY_VALUES
+        p.valueEnd = p.rawLength - 1;
+#endif
+      }
+      else
+      {
+        p1ValueByte(p, c);
+      }
+      break;
+    case P1P_UNIT:
+      if (c == ')')
+      {
+        p1CommitValue(p);
+        p.state = P1P_GAP;
+      }
+      else
+      {
+        if (c == '.')
         {
-          isValid = true;
-          if (dotPos > 0) //value with decimal point, (try)parse as double
-          {
-            parsingItem->value.dValue = parseDoubleFromArray(P1buffer,i,pos,isValid);
-            parsingItem->type = OBISItem::DOUBLE;
-            if (!isValid)
-            {
-              parseStrArrIntoItem(P1buffer,i,pos,parsingItem); //sets the string value into item and handles memory&fragmentation
-            }
-          }
-          else 
-          {
-            if (isOnlyDigitsInArray(P1buffer,i,pos))
-            {
-              //Using "good enough" data type detection for scenarios in OBIS codes. 
-              if (endPos-i > 18) //We parse as string/none?
-              {
-                parseStrArrIntoItem(P1buffer,i,pos,parsingItem); //sets the string value into item and handles memory&fragmentation
-              } else if (endPos-i < 10) //We parse as int32
-              {
-                parsingItem->value.i32Value = parseInt32FromArray(P1buffer,i,pos,isValid);
-                parsingItem->type = OBISItem::INT32;                
-              } else //We parse as 64
-              {
-                parsingItem->value.i64Value = parseInt64FromArray(P1buffer,i,pos,isValid);
-                parsingItem->type = OBISItem::INT64;   
-              }
-            }
-            else
-            {
-              parseStrArrIntoItem(P1buffer,i,pos,parsingItem); //sets the string value into item and handles memory&fragmentation
-            }
-          }
+          p.dotInGroup = true;
         }
-        else 
+        if (p.unitLen < P1_MAXUNIT - 1)
         {
-          failParseLine = true;
+          p.unit[p.unitLen++] = c;
         }
+      }
+      break;
+    case P1P_GAP: //Between value groups, e.g. (101209112500W)(12785.123*m3) - the last group is the value kept
+      if (c == '(')
+      {
+        p1BeginValue(p);
+        p.state = P1P_VALUE;
+      }
+      break;
+    default: //P1P_SKIP
+      break;
+  }
+  return false;
+}
+
+/*
+Feeds a single byte of the telegram, starting with the '/', into the parser. Lines that are not OBIS code lines (header etc.) are skipped.
+Returns true when the telegram is finished (after the CRC), see p.crcValid.
+*/
+bool p1ParseByte(P1Parser& p, const char& c)
+{
+#ifdef P1_LAZY_VALUES
+  if (p.rawLength < P1_MAXBUFFER)
+  {
+    p1RawBuffer(p)[p.rawLength] = c;
+  }
+#endif
+  return p1ParseStep(p, c);
+}
 
-        /*
-          Unit handling for OBIS. 
-          Assumption. Unit of a given OBIS code should never change. No need to re-update (MC restart would ofc. refresh)
-        */
-        if (endPos > 0 && starPos > 0 && parsingItem->unit == nullptr)
+/*
+Returns true if the telegram was finished within the chunk, the rest of the chunk is then not used.
+Runs of digits in a value and the bytes of lines that are skipped are scanned in bulk (p1scan.h),
+the bytes that change the state go through p1ParseByte().
+A code line that is whole in the chunk and the same as last time (by its hash) is not parsed again,
+see p1KeepLine(). Most lines do not change between telegrams (identifiers, counters, zero values).
+*/
+bool p1ParseChunk(P1Parser& p, const char* array, int length)
+{
+#ifdef P1_LAZY_VALUES
+  if (p.rawLength < P1_MAXBUFFER) //Into the telegram copy in one go, bytes after the end of the telegram do no harm
+  {
+    memcpy(p1RawBuffer(p) + p.rawLength, array, length < P1_MAXBUFFER - p.rawLength ? length : P1_MAXBUFFER - p.rawLength);
+  }
+#endif
+  for (int i = 0; i < length; i++)
+  {
+    if (p.state == P1P_LINESTART && p.skipUnchanged && p1IsDigit(array[i]))
+    {
+      int n = p1ScanFind(array + i, length - i, '\n', '!', '\n');
+      if (i + n < length && array[i + n] == '\n')
+      {
+        p.lineHash = p1LineHash(array + i, n);
+        OBISItem* expected = p1ExpectedLine(p);
+        if (expected != nullptr && expected->lineHash == p.lineHash)
         {
-          parsingItem->setUnitType(P1buffer, starPos+1, endPos);
+          p1KeepLine(p, expected, array + i, n);
+          i += n;
         }
-
       }
     }
-
-    //Detecting a new line, now, find next line and reset get ready for parsing.
-    if (P1buffer[i] == '\r') 
+    else if (p.state == P1P_VALUE)
     {
-
-      if (i+1<P1length)
+      int n = p1ScanDigits(array + i, length - i);
+      if (n > 0)
       {
-        if (P1buffer[i+1] == '\n')
-         i++;
+        p1ValueDigits(p, array + i, n);
+        i += n;
       }
-
-      if (!failParseLine) //We have a parsed line successfully.
+    }
+    else if (p.state == P1P_SKIP || p.state == P1P_GAP) //Only a new line, the end or a value group matter
+    {
+      int n = p1ScanFind(array + i, length - i, '\n', '!', p.state == P1P_GAP ? '(' : '\n');
+      for (int j = i; j < i + n; j++)
       {
+        p.crc = P1_CRC16_UPDATE(p.crc, array[j]);
       }
-      failParseLine = false;
-      linepos = -1;
+      p1RawRun(p, n);
+      i += n;
+    }
+    if (i == length)
+    {
+      break;
+    }
+    if (p1ParseStep(p, array[i]))
+    {
+      return true;
     }
-
-    i++; linepos++;
   }
+  return false;
 }
 
+/*
+Parses a whole telegram already in memory, e.g. one that did not come from the serial.
+*/
+void parseItems(P1Parser& p, const char* telegram, int length)
+{
+  p1ParseBegin(p);
+  if (!p1ParseChunk(p, telegram, length) && p.state == P1P_CRC)
+  {
+    p1CrcByte(p, '\n'); //Buffer ends right after the '!' or the CRC
+  }
+  else if (p.state != P1P_DONE)
+  {
+    p1DiscardTelegram(p.parsed);
+  }
+}
 
 /*
-Handles the serial and message parsing from serial into a buffer.
+The same for the device's parser, p1main.
 */
-boolean P1_ReadFromSerial(char *b,int *l)
+void p1ParseBegin()
+{
+  p1ParseBegin(p1main);
+}
+
+bool p1ParseByte(const char& c)
+{
+  return p1ParseByte(p1main, c);
+}
+
+bool p1ParseChunk(const char* array, int length)
 {
-  char c;
-  char *buffer;
-  //char bcrc[4];
-  int t=0;
-  long timer;
-  timer = millis();
+  return p1ParseChunk(p1main, array, length);
+}
 
-  // Parsing Flags
-  boolean message_start=false; //<-- what is this
-  boolean message_end=false;
-  boolean  message_error = false;
-  P1error="";
-  // initialise counter and string buffer
-  buffer=b;
+void parseItems() //The telegram in P1buffer
+{
+  parseItems(p1main, P1buffer, P1length);
+}
 
-  Serial.flush();
-  digitalWrite(P1_REQUEST_PIN,HIGH);
 
-  while (!message_end && !message_error) // find message start
+/*
+Handles the serial and message assembly from serial into a buffer.
+Non-blocking: drains whatever bytes the Serial has available into the buffer and returns right away.
+Each line is parsed from the buffer once its end is in (so p1ParseChunk() sees it whole), the CRC after
+the '!' and bytes that no longer fit the buffer go to the parser one by one.
+State is kept between calls so one telegram is assembled over many short loop() iterations.
+Returns true only on the call that completes a telegram (the '!' and the CRC have been received).
+*/
+bool P1_ReadFromSerial(char *b,int *l)
+{
+  if (P1readState == P1_IDLE)
+  {
+    return false;
+  }
+
+  if (p1Millis() - P1ReadStartMillis > P1_READ_TIMEOUT)
   {
-    if (millis()-timer > 12000) 
-    {
-      message_error=true; 
-      P1error="Time out";
-      break;
-    } 
-    if (Serial.available()) 
-    {
-      c= Serial.read();
-      if (c == '/')  
-      { 
-        message_start=true; 
-        break;
-      }  
-    }
+    P1error = "Time out";
+    b[0] = 0; *l = 0;
+    P1valid = false;
+    P1readState = P1_IDLE;
+    p1RequestPin(false); //End Request!
+    return false;
   }
-  if(!message_error)
+
+  while (p1SerialAvailable())
   {
-    message_end=false;
-    message_error=false;
-    t=0;
-    buffer[t++]='/';
-    while (!message_end && !message_error) // find message end or error
+    char c = p1SerialRead();
+    if (P1readState == P1_WAIT_START) // find message start
     {
-      if (Serial.available()) 
+      if (c == '/')
       {
-        c=Serial.read(); 
-        buffer[t++]=c; 
-        if (t>P1_MAXBUFFER )
-        {
-          message_error=true;
-          P1error="Max buffer";
-          break;
-        } 
-        if (c == '!') 
-        { 
-          message_end=true;
-          P1valid = true;
-          buffer[t++] = '\0';  // Null-terminate the string here    
-          break;
-        } 
+        P1readTarget = 0;
+        b[P1readTarget++] = '/';
+        P1readState = P1_READING;
+        p1ParseBegin();
+        p1ParseByte(c);
+        P1lineStart = P1readTarget;
       }
-    } 
+      continue;
     }
 
-  if(message_error)
-  {
-    buffer[0]=0; *l=0;
-    P1valid=false;
-  }
-  else
-  {
-    P1error="";
-    P1valid=true;  
-    *l=t;
+    bool stored = P1readTarget < P1_MAXBUFFER - 1; //Raw copy, keep room for the terminator
+    if (stored)
+    {
+      b[P1readTarget++] = c;
+    }
+    else
+    {
+      P1error = "Max buffer"; //Raw copy is cut, the parsed values are not affected
+    }
+    if (stored && c != '\n' && c != '!' && p1main.state < P1P_CRC)
+    {
+      continue; //Rest of the line not in yet
+    }
+
+    bool done = p1ParseChunk(b + P1lineStart, P1readTarget - P1lineStart); //CRC checked at the end
+    P1lineStart = P1readTarget;
+    if (!stored && !done)
+    {
+      done = p1ParseByte(c);
+    }
+
+    if (done) // message end, after the CRC
+    {
+      b[P1readTarget] = '\0';  // Null-terminate the string here
+      *l = P1readTarget;
+      P1valid = P1crcValid;
+      if (!P1crcValid)
+      {
+        P1error = "CRC"; //Last good values are kept
+      }
+      P1readState = P1_IDLE;
+      p1RequestPin(false); //End Request!
+      return true;
+    }
   }
-  digitalWrite(P1_REQUEST_PIN,LOW); //End Request!
-  return (!message_error);  // 1 = ok, 0 = error
+  return false; //Telegram not complete yet, continue on next call
 }
 
-int getObisItemCount()
+/*
+Starts a new telegram request, the telegram is then collected by P1_ReadFromSerial() calls.
+*/
+void P1_RequestTelegram()
 {
-  int c = 0;
-  OBISItem* i = p1parsed->items;
-  while (i != nullptr)
-  {
-    c++;
-    i = i->next;
-  }
-  return c;
+  P1error = "";
+  P1readTarget = 0;
+  P1ReadStartMillis = p1Millis();
+  P1readState = P1_WAIT_START;
+  p1RequestPin(true);
 }
 
+/*
+True while a telegram is being requested/collected, P1buffer should then not be used.
+*/
+bool p1IsReading()
+{
+  return P1readState != P1_IDLE;
+}
 
-
-void p1ReadAndParseNow()
+int getObisItemCount()
 {
-     P1_ReadFromSerial(P1buffer,&P1length);       // load P1 buffer in Global Memory variable
-     parseItems();
+  return p1parsed->listedCount; //Items in the list, profile items not seen yet are not
 }
 
 
+
+/*
+Call from loop() as often as possible, it never blocks.
+Requests a new telegram every P1_READ_INTERVAL and parses it when it has been fully received.
+*/
 void p1loop() 
 {
-  if (millis() > P1NextMillis) //Should we refresh P1 data?
+  if (!p1IsReading() && p1Millis() > P1NextMillis) //Should we refresh P1 data?
   {
+     P1_RequestTelegram();
+     P1NextMillis = p1Millis() + P1_READ_INTERVAL;
+  }
 
-     P1_ReadFromSerial(P1buffer,&P1length);       // load P1 buffer in Global Memory variable
-
-     parseItems();
+  if (p1IsReading())
+  {
+    P1_TIMED_BEGIN(read);
+    bool done = P1_ReadFromSerial(P1buffer,&P1length); // Reads and parses the telegram, a chunk at a time
+    P1_TIMED_READ(read, done);
+  }
+}
 
-     P1NextMillis = millis() + P1_READ_INTERVAL;
-  }    
-}
\ No newline at end of file
+#endif // ANTONP1_H
@@ -0,0 +1,650 @@
+/*
+ Host microbenchmarks for the parser hot paths: whole telegram parse, number conversion, CRC, JSON building
+ (and the cached /api copy of it), the binary snapshot (p1wire.h) encoding and decoding, with the sizes of both outputs.
+ Reports ns/telegram (or ns/op), MB/s and heap allocations per telegram for a few telegram shapes. Fails if the
+ decoded values differ from the items or a cut or malformed wire message is accepted.
+
+   .pio/build/native/program bench
+   .pio/build/native/program scan         (the p1scan.h paths against the scalar one, and their speed)
+   .pio/build/native/program lines        (unchanged lines not parsed again, on a simulated day)
+   .pio/build/native/program lookup       (items list against the index, for telegrams of 10 to 200 codes)
+   .pio/build/native/program profile      (a compile-time meter profile, p1profile.h, against the dynamic parser)
+ */
+#ifndef P1BENCH_H
+#define P1BENCH_H
+
+#include <chrono>
+#include <string>
+#include "../antonp1.h"
+#include "../p1json.h"
+#include "../p1wire.h"
+#include "p1wiredecode.h"
+#include "p1day.h"
+
+extern long p1HostAllocations; //Counted by the operator new in p1host.cpp
+
+struct P1BenchShape
+{
+  const char* name;
+  const char* body; //Telegram up to, not including, the '!'
+  bool validCrc;
+};
+
+static const P1BenchShape p1BenchShapes[] = {
+  {"iskra-1ph",
+    "/ISk5\\2MIE5E-200\r\n\r\n"
+    "0-0:96.1.0(84035454)\r\n"
+    "0-0:96.1.1(36303834303335343534)\r\n"
+    "1-0:0.9.1(155237)\r\n"
+    "1-0:0.9.2(230510)\r\n"
+    "1-0:1.8.0(004107.331*kWh)\r\n"
+    "1-0:2.8.0(000000.000*kWh)\r\n"
+    "1-0:1.7.0(00.020*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "1-0:3.7.0(00.000*kvar)\r\n"
+    "1-0:4.7.0(00.000*kvar)\r\n"
+    "1-0:31.7.0(000*A)\r\n"
+    "1-0:32.7.0(230.9*V)\r\n", true},
+  {"dsmr5-3ph-mbus",
+    "/ISK5\\2M550T-1012\r\n\r\n"
+    "1-3:0.2.8(50)\r\n"
+    "0-0:1.0.0(230510155237S)\r\n"
+    "0-0:96.1.1(4530303434303037313331363530323137)\r\n"
+    "1-0:1.8.1(001234.567*kWh)\r\n"
+    "1-0:1.8.2(002345.678*kWh)\r\n"
+    "1-0:2.8.1(000012.345*kWh)\r\n"
+    "1-0:2.8.2(000000.000*kWh)\r\n"
+    "0-0:96.14.0(0002)\r\n"
+    "1-0:1.7.0(01.193*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "0-0:96.7.21(00012)\r\n"
+    "0-0:96.7.9(00003)\r\n"
+    "1-0:99.97.0(1)(0-0:96.7.19)(000101000001W)(0000000000*s)\r\n"
+    "1-0:32.32.0(00002)\r\n"
+    "1-0:52.32.0(00001)\r\n"
+    "1-0:72.32.0(00001)\r\n"
+    "1-0:32.36.0(00000)\r\n"
+    "0-0:96.13.0()\r\n"
+    "1-0:32.7.0(229.1*V)\r\n"
+    "1-0:52.7.0(230.2*V)\r\n"
+    "1-0:72.7.0(228.7*V)\r\n"
+    "1-0:31.7.0(002*A)\r\n"
+    "1-0:51.7.0(001*A)\r\n"
+    "1-0:71.7.0(003*A)\r\n"
+    "1-0:21.7.0(00.411*kW)\r\n"
+    "1-0:41.7.0(00.242*kW)\r\n"
+    "1-0:61.7.0(00.540*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.0(4730303339303031373030393637373137)\r\n"
+    "0-1:24.2.1(230510155000S)(01234.567*m3)\r\n"
+    "0-2:24.1.0(007)\r\n"
+    "0-2:96.1.0(3232323241424344313233343536373839)\r\n"
+    "0-2:24.2.1(230510155000S)(00056.789*m3)\r\n", true},
+  {"malformed",
+    "/XXX5\r\n\r\n"
+    "1-0:1.8.0(12x.5*kWh)\r\n"
+    "1-0:2.8.0(1.2.3*kWh)\r\n"
+    "1-0:99.2.0(1234567890123456789012)\r\n"
+    "foo bar\r\n"
+    "-0:1.2.3(4)\r\n"
+    "1-0:1.8.x(5)\r\n"
+    "1-0:32.7.0(230.9*V\r\n"
+    "1-0:31.7.0(000*A)\r\n", false},
+};
+
+static std::string p1BenchTelegram(const P1BenchShape& shape)
+{
+  std::string t = shape.body;
+  t += '!';
+  uint16_t crc = 0;
+  for (char c : t)
+  {
+    crc = p1Crc16Update(crc, c);
+  }
+  char hex[8];
+  snprintf(hex, sizeof(hex), "%04X\r\n", shape.validCrc ? crc : (uint16_t)(crc ^ 0xFFFF));
+  return t + hex;
+}
+
+/*
+Runs op until at least 200 ms have passed, prints the time per op, MB/s over bytes per op and allocations per op.
+*/
+template <typename Op>
+static void p1BenchRun(const char* shape, const char* name, size_t bytes, Op op)
+{
+  op(); //Warm-up, the first telegram creates the items
+  long allocations = p1HostAllocations;
+  long ops = 0;
+  auto start = std::chrono::steady_clock::now();
+  double ns = 0;
+  do
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      op();
+    }
+    ops += 256;
+    ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  } while (ns < 200e6);
+  printf("%-16s %-12s %10.0f ns/op %8.1f MB/s %6.2f allocs/op\n", shape, name, ns / ops,
+    bytes * ops / (ns / 1e9) / 1e6, (double)(p1HostAllocations - allocations) / ops);
+}
+
+/*
+Decodes a hand made wire message, the header (flags, schema id 7, generation 1) and then body. Returns 1 if it
+did not end with error ("" if it should decode) or allocated when it must not have.
+*/
+static int p1BenchWireDecode(P1WireDecoder& decoder, uint8_t flags, std::vector<uint8_t> body, const char* error,
+  bool mayAllocate = true)
+{
+  std::vector<uint8_t> m = {'P', '1', P1_WIRE_VERSION, flags, 7, 0, 0, 0, 1, 0, 0, 0};
+  m.insert(m.end(), body.begin(), body.end());
+  std::vector<P1WireValue> values;
+  long allocations = p1HostAllocations;
+  bool ok = decoder.decode(m.data(), m.size(), values);
+  return ok != (error[0] == '\0') || strcmp(decoder.error, error) != 0 || (!mayAllocate && p1HostAllocations != allocations);
+}
+
+/*
+Messages that are cut or malformed must fail, with counts past their end not allocated: every cut of the two
+real messages and hand made ones with huge counts and lengths. Returns the number that did not fail as they should.
+*/
+static int p1BenchWireMalformed(const uint8_t* withSchema, int schemaLength, const uint8_t* values, int length)
+{
+  int wrong = 0;
+  std::vector<P1WireValue> decoded;
+  for (int n = 0; n < schemaLength; n++)
+  {
+    P1WireDecoder decoder;
+    wrong += decoder.decode(withSchema, n, decoded);
+  }
+  P1WireDecoder decoder;
+  wrong += !decoder.decode(withSchema, schemaLength, decoded);
+  for (int n = 0; n < length; n++)
+  {
+    wrong += decoder.decode(values, n, decoded);
+  }
+  const std::vector<uint8_t> huge = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F}; //A varint of 2^56 - 1
+  std::vector<uint8_t> body = huge;
+  wrong += p1BenchWireDecode(decoder, P1_WIRE_HAS_SCHEMA, body, "truncated", false); //Units
+  body = {0};
+  body.insert(body.end(), huge.begin(), huge.end());
+  wrong += p1BenchWireDecode(decoder, P1_WIRE_HAS_SCHEMA, body, "truncated", false); //Schema items
+  body = {0, 1, 0, 0, 96, 1, 0, 0, 1, 5}; //No units, one item 0-0:96.1.0, one CHARARR value
+  body.insert(body.end(), huge.begin(), huge.end());
+  wrong += p1BenchWireDecode(decoder, P1_WIRE_HAS_SCHEMA, body, "truncated"); //Its length
+  body = {0, 1, 0, 0, 96, 1, 0, 0, 1, 5, 2, 'h', 'i'}; //The same with "hi", kept as schema 7
+  wrong += p1BenchWireDecode(decoder, P1_WIRE_HAS_SCHEMA, body, "");
+  wrong += p1BenchWireDecode(decoder, 0, huge, "truncated", false); //Values of schema 7
+  wrong += p1BenchWireDecode(decoder, 0, {1, 1, 200, 1}, "malformed"); //DOUBLE with 200 decimals
+  wrong += p1BenchWireDecode(decoder, 0, {1, 1, 3, 0x83, 0x20}, ""); //4099 with 3 decimals, still decodes
+  return wrong;
+}
+
+int p1Bench()
+{
+  int failures = 0;
+  for (const P1BenchShape& shape : p1BenchShapes)
+  {
+    std::string telegram = p1BenchTelegram(shape);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+
+    p1main.skipUnchanged = false;
+    p1BenchRun(shape.name, "parseItems", telegram.size(), []() { parseItems(); });
+    p1main.skipUnchanged = true; //The same telegram again, no line has changed
+    p1BenchRun(shape.name, "unchanged", telegram.size(), []() { parseItems(); });
+
+    p1BenchRun(shape.name, "crc", telegram.size(), [&]() {
+      volatile uint16_t crc = 0;
+      for (char c : telegram) crc = p1Crc16Update(crc, c);
+    });
+    p1BenchRun(shape.name, "crc-table", telegram.size(), [&]() {
+      volatile uint16_t crc = 0;
+      for (char c : telegram) crc = p1Crc16UpdateTable(crc, c);
+    });
+
+    static char json[1460]; //One TCP segment at a time, as in the chunked /api response
+    p1BenchRun(shape.name, "json", telegram.size(), [&]() {
+      static P1JsonStream stream;
+      p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_API);
+      while (p1JsonRead(stream, json, sizeof(json)) > 0);
+    });
+    p1BenchRun(shape.name, "json-cache", telegram.size(), [&]() { //Once per telegram
+      p1Generation += 2; //Same value slots, a new generation
+      p1JsonCacheUpdate();
+    });
+    int cached = p1JsonCache.current;
+    p1BenchRun(shape.name, "json-cached", telegram.size(), [&]() { //Per /api request
+      P1JsonCacheHold hold;
+      p1JsonCacheHold(hold);
+      for (size_t index = 0, n; (n = p1JsonCacheRead(hold, json, sizeof(json), index)) > 0; index += n);
+    });
+
+    static uint8_t wire[P1_WIRE_BUFFER];
+    uint32_t schemaId;
+    p1BenchRun(shape.name, "wire", telegram.size(), [&]() { p1WireEncode(wire, sizeof(wire), false, &schemaId, P1F_API); });
+    p1BenchRun(shape.name, "wire+schema", telegram.size(), [&]() { p1WireEncode(wire, sizeof(wire), true, &schemaId, P1F_API); });
+    P1WireDecoder decoder;
+    std::vector<P1WireValue> values;
+    int schemaLength = p1WireEncode(wire, sizeof(wire), true, &schemaId, P1F_API);
+    decoder.decode(wire, schemaLength, values);
+    int wireLength = p1WireEncode(wire, sizeof(wire), false, &schemaId, P1F_API);
+    p1BenchRun(shape.name, "wire-decode", telegram.size(), [&]() { decoder.decode(wire, wireLength, values); });
+
+    //Sizes, and the decoded values must be the ones the items have
+    P1JsonStream stream;
+    p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_API);
+    std::string streamed;
+    for (size_t n; (n = p1JsonRead(stream, json, sizeof(json))) > 0;) streamed.append(json, n);
+    size_t jsonLength = streamed.size();
+    bool cacheSame = p1JsonCache.length[cached] >= 0 && streamed == std::string(p1JsonCache.data[cached], p1JsonCache.length[cached]);
+    { //A response holding the copy gets all of it while telegrams come, its buffer is written once it is done
+      P1JsonCacheHold hold;
+      p1JsonCacheHold(hold);
+      uint32_t heldGeneration = p1JsonCache.generation[hold.buffer];
+      std::string held;
+      for (int i = 0; i < 3; i++)
+      {
+        p1Generation += 2;
+        p1JsonCacheUpdate();
+        for (size_t n = p1JsonCacheRead(hold, json, 64, held.size()); n > 0; n = 0) held.append(json, n); //A chunk per telegram
+      }
+      for (size_t n; (n = p1JsonCacheRead(hold, json, sizeof(json), held.size())) > 0;) held.append(json, n);
+      cacheSame &= held == streamed && p1JsonCache.generation[hold.buffer] == heldGeneration;
+    }
+    p1Generation += 2;
+    p1JsonCacheUpdate();
+    cacheSame &= p1JsonCache.generation[p1JsonCache.current] == p1Generation;
+    int wrong = decoder.decode(wire, wireLength, values) ? 0 : 1;
+    OBISItem* item = p1parsed->items;
+    for (size_t i = 0; i < values.size() && item != nullptr; i++, item = item->next)
+    {
+      char expected[P1_MAXVALUE + 24], got[P1_MAXVALUE + 24];
+      p1FormatValue(item->current(), expected, sizeof(expected));
+      const P1WireValue& v = values[i];
+      if (v.type == OBISItem::DOUBLE) p1FormatFixed(got, sizeof(got), v.number, v.decimals);
+      else if (v.type == OBISItem::CHARARR) snprintf(got, sizeof(got), "%s", v.text.c_str());
+      else if (v.type == OBISItem::NONE) got[0] = '\0';
+      else snprintf(got, sizeof(got), "%llu", (unsigned long long)v.number);
+      wrong += strcmp(expected, got) != 0 || v.obis[2] != item->obis[2] || v.obis[3] != item->obis[3] || v.obis[4] != item->obis[4];
+    }
+    static uint8_t withSchema[P1_WIRE_BUFFER];
+    p1WireEncode(withSchema, sizeof(withSchema), true, &schemaId, P1F_API);
+    int malformed = p1BenchWireMalformed(withSchema, schemaLength, wire, wireLength);
+    printf("%-16s sizes: telegram %zu, json %zu (cached copy %s), wire %d (+%d schema, once), decoded wrong %d, malformed accepted %d\n",
+      shape.name, telegram.size(), jsonLength, cacheSame ? "same" : "DIFFERS", wireLength, schemaLength - wireLength, wrong, malformed);
+    failures += wrong + malformed + !cacheSame;
+  }
+
+  //Number conversion of single values, as done while the bytes arrive
+  static const char* numbers[] = {"004107.331", "00.020", "230.9", "84035454", "0000000000", "4530303434303037313331363530323137"};
+  uint16_t code[5] = {1, 0, 1, 8, 0};
+  p1main.item = p1parsed->findOrCreatOBISItem(code);
+  for (const char* number : numbers)
+  {
+    size_t length = strlen(number);
+    p1BenchRun(number, "number", length, [&]() {
+      p1BeginValue(p1main);
+      for (size_t i = 0; i < length; i++) p1ValueByte(p1main, number[i]);
+      p1CommitValue(p1main);
+    });
+  }
+  p1DiscardTelegram();
+  return failures;
+}
+
+static const char* p1ScanNames[] = {"scalar", "swar"}; //By P1_SCAN_ path
+
+/*
+Items of a parser as text (code, type, value, unit) and whether the last telegram was valid, to compare parses.
+*/
+static std::string p1BenchItems(P1Parser& p)
+{
+  std::string out = p.crcValid ? "valid\n" : "invalid\n";
+  uint32_t generation = p.parsed.generation.load();
+  for (OBISItem* item = p.parsed.items; item != nullptr; item = item->next)
+  {
+    char line[P1_MAXVALUE + 64];
+    int n = snprintf(line, sizeof(line), "%d-%d:%d.%d.%d %d %s ", item->obis[0], item->obis[1], item->obis[2], item->obis[3],
+      item->obis[4], item->at(generation).type, item->unit != nullptr ? item->unit->unitstr : "");
+    p1FormatValue(item->at(generation), line + n, sizeof(line) - n);
+    out += line;
+    out += '\n';
+  }
+  return out;
+}
+
+/*
+Checks every path of p1scan.h against the scalar one, on random bytes at every offset and length and on whole
+telegrams (the benchmark shapes, a simulated day and randomly damaged copies of them) parsed in bulk against
+byte by byte. Then the time of each path per telegram. Returns the number of mismatches.
+*/
+int p1BenchScan()
+{
+  int paths = sizeof(p1ScanNames) / sizeof(p1ScanNames[0]), wrong = 0;
+  long checks = 0;
+  srand(1);
+  static const char alphabet[] = "0123456789012345678901234567890123456789.*()!\r\n:-SW\x80\xff";
+  char buffer[96];
+  for (int round = 0; round < 2000; round++)
+  {
+    for (char& c : buffer) c = alphabet[rand() % (sizeof(alphabet) - 1)];
+    for (int offset = 0; offset < 16; offset++)
+    {
+      for (int length = 0; length + offset <= (int)sizeof(buffer); length += 1 + round % 7)
+      {
+        const char* s = buffer + offset;
+        int digits = p1ScanDigitsScalar(s, length);
+        int find = p1ScanFindScalar(s, length, '\n', '!', '(');
+        p1ScanPath = P1_SCAN_SCALAR;
+        uint64_t value = p1DigitsValue(s, digits, round);
+        for (int path = 1; path < paths; path++)
+        {
+          p1ScanPath = path;
+          wrong += p1ScanDigits(s, length) != digits || p1ScanFind(s, length, '\n', '!', '(') != find
+                || p1DigitsValue(s, digits, round) != value;
+          checks++;
+        }
+      }
+    }
+  }
+
+  std::vector<std::string> telegrams;
+  for (const P1BenchShape& shape : p1BenchShapes) telegrams.push_back(p1BenchTelegram(shape));
+  double import = 1234.567, gas = 1234.567;
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 600) telegrams.push_back(p1DayTelegram(seconds, 600, import, gas));
+  for (size_t i = 0, n = telegrams.size(); i < n * 20; i++) //Damaged: bytes changed, dropped or repeated
+  {
+    std::string t = telegrams[i % n];
+    for (int k = 0; k < 1 + rand() % 4; k++)
+    {
+      size_t at = rand() % t.size();
+      int how = rand() % 3;
+      if (how == 0) t[at] = alphabet[rand() % (sizeof(alphabet) - 1)];
+      else if (how == 1) t.erase(at, 1 + rand() % 8);
+      else t.insert(at, t.substr(at, 1 + rand() % 20));
+      if (t.empty()) t = "/";
+    }
+    telegrams.push_back(t);
+  }
+  P1Parser* bytewise = new P1Parser();
+  std::vector<P1Parser*> bulk;
+  for (int path = 0; path < paths; path++) bulk.push_back(new P1Parser());
+  for (const std::string& t : telegrams)
+  {
+    p1ParseBegin(*bytewise);
+    for (char c : t) p1ParseByte(*bytewise, c);
+    for (int path = 0; path < paths; path++)
+    {
+      p1ScanPath = path;
+      p1ParseBegin(*bulk[path]);
+      for (size_t start = 0, length; start < t.size(); start += length) //In pieces, as from the serial
+      {
+        length = std::min(t.size() - start, (size_t)(1 + rand() % 64));
+        p1ParseChunk(*bulk[path], t.data() + start, length);
+      }
+    }
+    std::string expected = p1BenchItems(*bytewise);
+    for (int path = 0; path < paths; path++)
+    {
+      wrong += p1BenchItems(*bulk[path]) != expected;
+      checks++;
+    }
+  }
+  printf("scan: %ld checks (%d paths against scalar, %zu telegrams bulk against byte by byte), %d wrong\n",
+    checks, paths - 1, telegrams.size(), wrong);
+
+  for (P1Parser* p : bulk) p->skipUnchanged = false; //The same telegram each time, see p1BenchLines()
+  for (const P1BenchShape& shape : p1BenchShapes)
+  {
+    std::string telegram = p1BenchTelegram(shape);
+    p1BenchRun(shape.name, "bytewise", telegram.size(), [&]() {
+      p1ParseBegin(*bytewise);
+      for (char c : telegram) p1ParseByte(*bytewise, c);
+    });
+    for (int path = 0; path < paths; path++)
+    {
+      p1ScanPath = path;
+      p1BenchRun(shape.name, p1ScanNames[path], telegram.size(), [&]() { parseItems(*bulk[path], telegram.data(), telegram.size()); });
+    }
+  }
+  p1ScanPath = P1_SCAN_BEST;
+  delete bytewise;
+  for (P1Parser* p : bulk) delete p;
+  return wrong;
+}
+
+/*
+A day of telegrams every 10 s (with damaged ones in between) parsed with and without skipping unchanged lines:
+the values must be the same, an item not marked changed must have kept its value. A third parser is only read
+now and then, so its values are kept over several telegrams before they are read. Then the time per telegram
+and how many lines were skipped. Returns the number of mismatches.
+*/
+int p1BenchLines()
+{
+  srand(1);
+  std::vector<std::string> telegrams;
+  double import = 1234.567, gas = 1234.567;
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 10)
+  {
+    telegrams.push_back(p1DayTelegram(seconds, 10, import, gas));
+    if (rand() % 50 == 0) //Damaged copy, fails the CRC
+    {
+      std::string t = telegrams.back();
+      t[rand() % t.size()] ^= 1 << (rand() % 7);
+      telegrams.push_back(t);
+    }
+  }
+  P1Parser* full = new P1Parser();
+  P1Parser* skip = new P1Parser();
+  P1Parser* sparse = new P1Parser();
+  full->skipUnchanged = false;
+  int wrong = 0, flagged = 0, lines = 0, parsed = 0;
+  bool previous = false; //A valid telegram was parsed before
+  for (const std::string& t : telegrams)
+  {
+    parseItems(*full, t.data(), t.size());
+    parseItems(*skip, t.data(), t.size());
+    parseItems(*sparse, t.data(), t.size());
+    std::string expected = p1BenchItems(*full);
+    wrong += p1BenchItems(*skip) != expected;
+    if (++parsed % 7 == 0)
+    {
+      wrong += p1BenchItems(*sparse) != expected;
+    }
+    if (skip->crcValid && previous)
+    {
+      uint32_t generation = skip->parsed.generation.load();
+      for (OBISItem* item = skip->parsed.items; item != nullptr; item = item->next)
+      {
+        char now[P1_MAXVALUE + 24], before[P1_MAXVALUE + 24];
+        p1FormatValue(item->at(generation), now, sizeof(now));
+        p1FormatValue(item->at(generation - 1), before, sizeof(before));
+        wrong += !item->changed && strcmp(now, before) != 0;
+        flagged += item->changed;
+      }
+    }
+    previous |= skip->crcValid;
+    for (char c : t) lines += c == '\n';
+  }
+  printf("lines: %zu telegrams, %ld of %d lines not parsed again, %d items marked changed, %d wrong\n", telegrams.size(),
+    skip->unchangedLines, lines, flagged, wrong);
+
+  for (P1Parser* p : {full, skip})
+  {
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for (int round = 0; round < 5; round++)
+    {
+      for (const std::string& t : telegrams)
+      {
+        parseItems(*p, t.data(), t.size());
+        bytes += t.size();
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-16s %-12s %10.0f ns/op %8.1f MB/s\n", "day-10s", p == full ? "every line" : "skip same", ns / (5 * telegrams.size()),
+      bytes / (ns / 1e9) / 1e6);
+  }
+  delete full;
+  delete skip;
+  delete sparse;
+  return wrong;
+}
+
+/*
+Time per op of op, run until at least 200 ms have passed.
+*/
+template <typename Op>
+static double p1BenchNs(Op op)
+{
+  long ops = 0;
+  auto start = std::chrono::steady_clock::now();
+  double ns = 0;
+  do
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      op();
+    }
+    ops += 256;
+    ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  } while (ns < 200e6);
+  return ns / ops;
+}
+
+/*
+Looking up each code of a telegram of n codes, as the parser does once per line: walking the items list and
+comparing all five numbers (as before the index) or through the open-addressing index. Up to P1_MAXITEMS codes,
+build with e.g. -D P1_MAXITEMS=200 -D P1_INDEX_SIZE=256 for more. Returns the number of lookups that found the
+wrong item.
+*/
+int p1BenchLookup()
+{
+  int wrong = 0;
+  for (int n : {10, 20, 40, 80, 120, 160, 200})
+  {
+    if (n > P1_MAXITEMS)
+    {
+      int size = 1;
+      while (size <= n) size *= 2;
+      printf("%-16s %d codes need -D P1_MAXITEMS=%d -D P1_INDEX_SIZE=%d\n", "lookup", n, n, size);
+      continue;
+    }
+    ParsedOBIS* parsed = new ParsedOBIS();
+    parsed->profile = nullptr;
+    std::vector<OBISItem> lines(n); //The codes of the telegram, in its order
+    for (int i = 0; i < n; i++)
+    {
+      uint16_t code[5] = {(uint16_t)(i % 3 == 0 ? 0 : 1), (uint16_t)(i % 7 == 0), (uint16_t)(1 + i / 4), (uint16_t)(7 + i % 4), 0};
+      memcpy(lines[i].obis, code, sizeof(code));
+      wrong += parsed->findOrCreatOBISItem(code) == nullptr;
+    }
+    volatile uintptr_t sink = 0;
+    double list = p1BenchNs([&]() {
+      for (OBISItem& line : lines)
+      {
+        OBISItem* item = parsed->items;
+        while (item != nullptr && !compareObisCode(item, &line)) item = item->next;
+        sink = (uintptr_t)item;
+      }
+    });
+    double index = p1BenchNs([&]() {
+      for (OBISItem& line : lines) sink = (uintptr_t)parsed->findOrCreatOBISItem(line.obis);
+    });
+    for (OBISItem& line : lines)
+    {
+      OBISItem* item = parsed->findOrCreatOBISItem(line.obis);
+      wrong += item == nullptr || !compareObisCode(item, &line);
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "%d codes", n);
+    printf("%-16s %-12s %10.0f ns/telegram\n%-16s %-12s %10.0f ns/telegram\n", name, "list", list, name, "index", index);
+    delete parsed;
+  }
+  return wrong;
+}
+
+/*
+A day of telegrams every 10 s parsed by a dynamic parser and one with the DSMR 5 profile: the items (codes, types,
+values, units, list order) must be the same and the profile's accessors must read what findOBISItem() gives.
+Then the time per telegram with and without skipping unchanged lines, of a lookup (the index or the perfect hash)
+and of reading values (findOBISItem() and the type, or the accessors). Returns the number of mismatches.
+*/
+int p1BenchProfile()
+{
+  srand(1);
+  std::vector<std::string> telegrams;
+  double import = 1234.567, gas = 1234.567;
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 10)
+  {
+    telegrams.push_back(p1DayTelegram(seconds, 10, import, gas));
+  }
+  P1Parser* dynamic = new P1Parser();
+  P1Parser* known = new P1Parser();
+  dynamic->parsed.profile = nullptr;
+  known->parsed.profile = &P1ProfileDsmr5::table;
+  P1ProfileDsmr5 meter = {known->parsed};
+  int wrong = meter.seen(P1ProfileDsmr5::Code::activePowerImport) || meter.activePowerImport() != 0; //Nothing parsed yet
+  for (const std::string& t : telegrams)
+  {
+    parseItems(*dynamic, t.data(), t.size());
+    parseItems(*known, t.data(), t.size());
+    wrong += p1BenchItems(*known) != p1BenchItems(*dynamic);
+    uint32_t generation = dynamic->parsed.generation.load();
+    OBISItem* power = dynamic->parsed.findOBISItem(P1ProfileDsmr5::keys[P1ProfileDsmr5::Code::activePowerImport]);
+    OBISItem* current = dynamic->parsed.findOBISItem(P1ProfileDsmr5::keys[P1ProfileDsmr5::Code::currentL2]);
+    OBISItem* time = dynamic->parsed.findOBISItem(P1ProfileDsmr5::keys[P1ProfileDsmr5::Code::timestamp]);
+    wrong += power == nullptr || meter.activePowerImport() != power->at(generation).getDouble();
+    wrong += current == nullptr || meter.currentL2() != current->at(generation).value.i32Value;
+    wrong += time == nullptr || strcmp(meter.timestamp(), time->at(generation).value.stringValue) != 0;
+  }
+  printf("profile: %zu telegrams, %d of %d codes in the profile, %d items, %d wrong\n", telegrams.size(),
+    __builtin_popcountll(known->parsed.profileListed), P1ProfileDsmr5::Code::count, known->parsed.listedCount, wrong);
+
+  for (bool skip : {false, true})
+  {
+    for (P1Parser* p : {dynamic, known})
+    {
+      p->skipUnchanged = skip;
+      size_t i = 0;
+      double ns = p1BenchNs([&]() {
+        const std::string& t = telegrams[i++ % telegrams.size()];
+        parseItems(*p, t.data(), t.size());
+      });
+      printf("%-16s %-12s %10.0f ns/op\n", skip ? "day-skip-same" : "day-every-line", p == dynamic ? "dynamic" : "profile", ns);
+    }
+  }
+
+  std::vector<uint64_t> keys;
+  for (OBISItem* item = dynamic->parsed.items; item != nullptr; item = item->next)
+  {
+    keys.push_back(item->key);
+  }
+  volatile uintptr_t sink = 0;
+  double index = p1BenchNs([&]() {
+    for (uint64_t key : keys) sink = (uintptr_t)dynamic->parsed.findOBISItem(key);
+  }) / keys.size();
+  double hash = p1BenchNs([&]() {
+    for (uint64_t key : keys) sink = p1ProfileIndex(P1ProfileDsmr5::table, key);
+  }) / keys.size();
+  printf("%-16s %-12s %10.1f ns/op\n%-16s %-12s %10.1f ns/op\n", "lookup", "index", index, "lookup", "perfect-hash", hash);
+
+  volatile double value = 0;
+  double find = p1BenchNs([&]() {
+    OBISItem* item = dynamic->parsed.findOBISItem(P1ProfileDsmr5::keys[P1ProfileDsmr5::Code::activePowerImport]);
+    const OBISItem::ValueSlot& v = item->at(dynamic->parsed.generation.load(std::memory_order_acquire));
+    value = v.type == OBISItem::DOUBLE ? v.getDouble() : 0;
+  });
+  double accessor = p1BenchNs([&]() { value = meter.activePowerImport(); });
+  printf("%-16s %-12s %10.1f ns/op\n%-16s %-12s %10.1f ns/op\n", "read", "findOBISItem", find, "read", "accessor", accessor);
+  delete dynamic;
+  delete known;
+  return wrong;
+}
+
+#endif // P1BENCH_H
@@ -0,0 +1,347 @@
+/*
+ Bulk decoder for telegram archives, e.g. months of raw telegrams as uploaded by postData(). The archive
+ (telegrams one after the other, each starting with '/' at the start of a line) is split into chunks of
+ P1_BULK_CHUNK telegrams and parsed on threads, each with its own P1Parser. Every thread starts with an
+ equal range of the chunks and, when its own are done, steals from the end of the range with the most left,
+ so threads that got slow chunks (or a slow core) do not hold up the rest.
+
+ Results are columnar, in the output folder when one is given: one file per OBIS code (A-B_C.D.E.txt) with
+ a line per valid telegram in archive order, empty when that telegram did not have the code. rows.txt has
+ the archive offset of each of those telegrams and columns.txt the codes and their units.
+
+ The archive is decoded with 1, 2, 4 ... threads up to the given number (default all cores), printing
+ telegrams/s and the speedup over one thread. The results must be the same for every thread count.
+ Without an archive ("-") a month of telegrams at 60 s is made with p1DayTelegram().
+
+   .pio/build/native/program bulk <archive|-> [threads] [output folder]
+ */
+#ifndef P1BULK_H
+#define P1BULK_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "p1day.h"
+
+#ifndef P1_BULK_CHUNK
+#define P1_BULK_CHUNK 256 //Telegrams per chunk, the unit of work that can be stolen
+#endif
+
+/*
+Values of one chunk, by code. Each column has a line per row of the chunk.
+*/
+struct P1BulkChunk
+{
+  size_t begin, end; //Telegrams
+  int rows = 0;
+  int bad = 0; //CRC or cut
+  std::string offsets;
+  std::map<uint64_t, std::string> columns;
+  std::map<uint64_t, std::string> units;
+};
+
+/*
+A thread's parser and the columns of the chunk it is on, by pool index of the parser's items.
+*/
+struct P1BulkWorker : P1Parser
+{
+  std::string columns[P1_MAXITEMS];
+  int columnRows[P1_MAXITEMS];
+  P1BulkChunk* chunk;
+  size_t offset; //Of the telegram being parsed
+  std::atomic<uint64_t> range; //Chunks left, first in the low and end in the high 32 bits
+  long stolen;
+};
+
+/*
+Called with each valid telegram (P1Parser::beforeCommit), adds a row with the values it has.
+*/
+static void p1BulkRow(P1Parser& parser)
+{
+  P1BulkWorker& w = static_cast<P1BulkWorker&>(parser);
+  uint32_t generation = w.parsed.generation.load(std::memory_order_relaxed);
+  int row = w.chunk->rows++;
+  for (OBISItem* item = w.parsed.items; item != nullptr; item = item->next)
+  {
+    if (!item->isPending)
+    {
+      continue;
+    }
+    int index = item - w.parsed.pool;
+    std::string& column = w.columns[index];
+    column.append(row - w.columnRows[index], '\n'); //Rows without the code
+    char value[P1_MAXVALUE + 24];
+    int length = p1FormatValue(p1Decoded(item->parsing(generation)), value, sizeof(value));
+    column.append(value, length < (int)sizeof(value) ? length : sizeof(value) - 1);
+    column += '\n';
+    w.columnRows[index] = row + 1;
+  }
+  char offset[24];
+  w.chunk->offsets.append(offset, snprintf(offset, sizeof(offset), "%zu\n", w.offset));
+}
+
+static void p1BulkDecode(P1BulkWorker& w, P1BulkChunk& chunk, const std::string& archive, const std::vector<size_t>& starts)
+{
+  w.chunk = &chunk;
+  for (int i = 0; i < w.parsed.itemCount; i++)
+  {
+    w.columns[i].clear();
+    w.columnRows[i] = 0;
+  }
+  for (size_t t = chunk.begin; t < chunk.end; t++)
+  {
+    w.offset = starts[t];
+    uint32_t generation = w.parsed.generation.load(std::memory_order_relaxed);
+    parseItems(w, archive.data() + starts[t], starts[t + 1] - starts[t]);
+    chunk.bad += w.parsed.generation.load(std::memory_order_relaxed) == generation;
+  }
+  for (int i = 0; i < w.parsed.itemCount; i++)
+  {
+    if (w.columnRows[i] > 0)
+    {
+      OBISItem& item = w.parsed.pool[i];
+      w.columns[i].append(chunk.rows - w.columnRows[i], '\n');
+      chunk.columns[item.key].swap(w.columns[i]);
+      chunk.units[item.key] = item.unit != nullptr ? item.unit->unitstr : "";
+    }
+  }
+}
+
+/*
+Next chunk of the worker: its own from the front, else one stolen from the back of the range with the most left.
+*/
+static bool p1BulkNext(std::vector<P1BulkWorker*>& workers, P1BulkWorker& w, uint32_t& chunk)
+{
+  uint64_t range = w.range.load();
+  while ((uint32_t)range < (uint32_t)(range >> 32))
+  {
+    if (w.range.compare_exchange_weak(range, range + 1))
+    {
+      chunk = (uint32_t)range;
+      return true;
+    }
+  }
+  for (;;)
+  {
+    P1BulkWorker* victim = nullptr;
+    uint32_t most = 0;
+    for (P1BulkWorker* v : workers)
+    {
+      uint64_t r = v->range.load();
+      uint32_t left = (uint32_t)(r >> 32) - (uint32_t)r;
+      if ((uint32_t)r < (uint32_t)(r >> 32) && left > most)
+      {
+        most = left;
+        victim = v;
+      }
+    }
+    if (victim == nullptr)
+    {
+      return false;
+    }
+    uint64_t r = victim->range.load();
+    if ((uint32_t)r < (uint32_t)(r >> 32) && victim->range.compare_exchange_strong(r, r - ((uint64_t)1 << 32)))
+    {
+      chunk = (uint32_t)(r >> 32) - 1;
+      w.stolen++;
+      return true;
+    }
+  }
+}
+
+/*
+Decodes all chunks on the given number of threads, returns the seconds it took.
+*/
+static double p1BulkRun(const std::string& archive, const std::vector<size_t>& starts, std::vector<P1BulkChunk>& chunks,
+  int threads, long& stolen)
+{
+  std::vector<P1BulkWorker*> workers;
+  for (int i = 0; i < threads; i++)
+  {
+    P1BulkWorker* w = new P1BulkWorker(); //Value-initialized, starts zeroed
+    w->beforeCommit = p1BulkRow;
+    uint64_t begin = chunks.size() * i / threads, end = chunks.size() * (i + 1) / threads;
+    w->range = begin | end << 32;
+    workers.push_back(w);
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (P1BulkWorker* w : workers)
+  {
+    pool.emplace_back([&, w]() {
+      for (uint32_t c; p1BulkNext(workers, *w, c);)
+      {
+        p1BulkDecode(*w, chunks[c], archive, starts);
+      }
+    });
+  }
+  for (std::thread& t : pool)
+  {
+    t.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  stolen = 0;
+  for (P1BulkWorker* w : workers)
+  {
+    stolen += w->stolen;
+    delete w;
+  }
+  return seconds;
+}
+
+/*
+Joins the chunks' columns in archive order. Returns an FNV-1a hash of all of it, to compare runs.
+*/
+static uint64_t p1BulkMerge(const std::vector<P1BulkChunk>& chunks, std::map<uint64_t, std::string>& columns,
+  std::map<uint64_t, std::string>& units, std::string& offsets)
+{
+  columns.clear();
+  offsets.clear();
+  for (const P1BulkChunk& chunk : chunks)
+  {
+    for (auto& c : chunk.columns)
+    {
+      columns[c.first];
+      units[c.first] = chunk.units.at(c.first);
+    }
+  }
+  for (const P1BulkChunk& chunk : chunks)
+  {
+    offsets += chunk.offsets;
+    for (auto& c : columns)
+    {
+      auto found = chunk.columns.find(c.first);
+      if (found != chunk.columns.end()) c.second += found->second;
+      else c.second.append(chunk.rows, '\n');
+    }
+  }
+  uint64_t hash = 14695981039346656037ull;
+  auto add = [&](const std::string& s) { for (char ch : s) hash = (hash ^ (uint8_t)ch) * 1099511628211ull; };
+  add(offsets);
+  for (auto& c : columns)
+  {
+    hash = (hash ^ c.first) * 1099511628211ull;
+    add(c.second);
+  }
+  return hash;
+}
+
+static void p1BulkFile(const char* folder, const std::string& name, const std::string& data)
+{
+  FILE* f = fopen((std::string(folder) + "/" + name).c_str(), "wb");
+  if (f != nullptr)
+  {
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+  }
+}
+
+static void p1BulkWrite(const char* folder, const std::map<uint64_t, std::string>& columns,
+  const std::map<uint64_t, std::string>& units, const std::string& offsets)
+{
+  std::string list;
+  for (auto& c : columns)
+  {
+    char code[32];
+    snprintf(code, sizeof(code), "%d-%d_%d.%d.%d", (int)(c.first >> 56), (int)(c.first >> 48 & 0xFF),
+      (int)(c.first >> 32 & 0xFFFF), (int)(c.first >> 16 & 0xFFFF), (int)(c.first & 0xFFFF));
+    p1BulkFile(folder, std::string(code) + ".txt", c.second);
+    const std::string& unit = units.at(c.first);
+    list += std::string(code) + (unit.empty() ? "" : " " + unit) + "\n";
+  }
+  p1BulkFile(folder, "rows.txt", offsets);
+  p1BulkFile(folder, "columns.txt", list);
+}
+
+int p1Bulk(const char* path, int threads, const char* folder)
+{
+  std::string archive;
+  if (strcmp(path, "-") == 0)
+  {
+    srand(1);
+    double import = 1234.567, gas = 1234.567;
+    for (int minute = 0; minute < 30 * 24 * 60; minute++)
+    {
+      archive += p1DayTelegram(minute % (24 * 60) * 60, 60, import, gas);
+    }
+  }
+  else
+  {
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr)
+    {
+      printf("cannot read %s\n", path);
+      return 1;
+    }
+    char chunk[65536];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0;) archive.append(chunk, n);
+    fclose(f);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<size_t> starts;
+  for (const char* p = archive.data(), *end = p + archive.size(); (p = (const char*)memchr(p, '/', end - p)) != nullptr; p++)
+  {
+    if (p == archive.data() || p[-1] == '\n')
+    {
+      starts.push_back(p - archive.data());
+    }
+  }
+  size_t telegrams = starts.size();
+  starts.push_back(archive.size());
+  double splitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("archive: %zu bytes, %zu telegrams, split in %.1f ms\n", archive.size(), telegrams, splitSeconds * 1000);
+  if (telegrams == 0)
+  {
+    return 1;
+  }
+
+  threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> counts;
+  for (int n = 1; n < threads; n *= 2) counts.push_back(n);
+  counts.push_back(threads);
+
+  double oneThread = 0;
+  uint64_t firstHash = 0;
+  int different = 0;
+  std::map<uint64_t, std::string> columns, units;
+  std::string offsets;
+  for (int n : counts)
+  {
+    std::vector<P1BulkChunk> chunks;
+    for (size_t t = 0; t < telegrams; t += P1_BULK_CHUNK)
+    {
+      chunks.emplace_back();
+      chunks.back().begin = t;
+      chunks.back().end = std::min(t + P1_BULK_CHUNK, telegrams);
+    }
+    long stolen;
+    double seconds = p1BulkRun(archive, starts, chunks, n, stolen);
+    oneThread = n == 1 ? seconds : oneThread;
+    auto mergeStart = std::chrono::steady_clock::now();
+    uint64_t hash = p1BulkMerge(chunks, columns, units, offsets);
+    double mergeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mergeStart).count();
+    firstHash = n == 1 ? hash : firstHash;
+    different += hash != firstHash;
+    int rows = 0, bad = 0;
+    for (const P1BulkChunk& chunk : chunks)
+    {
+      rows += chunk.rows;
+      bad += chunk.bad;
+    }
+    printf("%2d threads: %8.0f telegrams/s (%.2fx), %zu chunks, %ld stolen, %d rows, %d bad, %zu columns, merged in %.0f ms, %s\n",
+      n, telegrams / seconds, oneThread / seconds, chunks.size(), stolen, rows, bad, columns.size(), mergeSeconds * 1000,
+      hash == firstHash ? "same result" : "DIFFERENT RESULT");
+  }
+  printf("cores: %u\n", std::thread::hardware_concurrency());
+  if (folder != nullptr)
+  {
+    p1BulkWrite(folder, columns, units, offsets);
+  }
+  return different;
+}
+
+#endif // P1BULK_H
@@ -0,0 +1,578 @@
+/*
+ Upload size over a simulated day: one DSMR5 three phase telegram per 120 s upload (720 a day) with a
+ daily load curve, noisy voltages and growing registers. Each one is uploaded both as the raw telegram
+ and as a delta (p1delta.h) to a stand-in receiver, which applies keyframes and deltas like the server
+ would and checks its values stay within the deadbands of the meter's values.
+ The history test reads a telegram every 10 s of the day into p1history.h and checks the rollups.
+ The log test has uploads failing from 04:00 to 20:00 and a restart at 12:00, the snapshots go to the
+ log (p1log.h, files in the given folder) and are replayed after 20:00. Then a snapshot too large for an
+ upload queue goes through the log, the replay and the queue, it must wait for the queue to empty, then be
+ dropped and the next one arrive.
+ The events test pushes a telegram every 10 s as changed frames (p1events.h) to a subscriber that keeps
+ the items, with nobody subscribed from 06:00 to 07:00, and checks it always matches a frame of all items.
+ The derived test reads a telegram every 10 s with p1derived.h on and checks each derived item against
+ the same value worked out here in doubles from the parsed ones, the average power also across clock changes,
+ then that the delta after a keyframe has them.
+
+   .pio/build/native/program day
+   .pio/build/native/program history
+   .pio/build/native/program log /tmp
+   .pio/build/native/program events
+   .pio/build/native/program derived
+ */
+#ifndef P1DAY_H
+#define P1DAY_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <math.h>
+#include "../antonp1.h"
+#include "../p1delta.h"
+#include "../p1history.h"
+#include "../p1log.h"
+#include "../p1events.h"
+#include "../p1derived.h"
+
+/*
+Stand-in for the upload server, keeps the last value of each OBIS code (A-B:C.D.E).
+*/
+struct P1DayReceiver
+{
+  std::map<std::string, std::string> values;
+  size_t bytes = 0;
+  int uploads = 0;
+
+  void receive(const char* body, int length)
+  {
+    bytes += length;
+    uploads++;
+    const char* end = body + length;
+    for (const char* line = body; line < end;)
+    {
+      const char* eol = (const char*)memchr(line, '\n', end - line);
+      eol = eol != nullptr ? eol : end;
+      const char* open = (const char*)memchr(line, '(', eol - line);
+      const char* last = open;
+      for (const char* p = open; p != nullptr && p < eol; p++)
+      {
+        if (*p == '(') last = p; //Value is in the last brackets, as in the parser
+      }
+      const char* close = last != nullptr ? (const char*)memchr(last, ')', eol - last) : nullptr;
+      if (close != nullptr)
+      {
+        std::string value(last + 1, close);
+        size_t star = value.find('*');
+        values[std::string(line, open)] = star == std::string::npos ? value : value.substr(0, star);
+      }
+      line = eol + 1;
+    }
+  }
+
+  /*
+  Returns the number of items the receiver does not have within the deadband.
+  */
+  int check()
+  {
+    int wrong = 0;
+    for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+    {
+      const OBISItem::ValueSlot& v = item->current();
+      double band = p1DeltaBand(item);
+      if (v.type == OBISItem::NONE || band < 0)
+      {
+        continue;
+      }
+      char code[32], value[P1_MAXVALUE + 24];
+      snprintf(code, sizeof(code), "%d-%d:%s", item->obis[0], item->obis[1], item->getObisCode());
+      p1FormatValue(v, value, sizeof(value));
+      auto got = values.find(code);
+      bool ok = got != values.end() && (v.type == OBISItem::CHARARR ? got->second == value :
+        fabs(strtod(got->second.c_str(), nullptr) - strtod(value, nullptr)) <= band + 1e-9);
+      if (!ok)
+      {
+        printf("  %s: receiver has %s, meter %s\n", code, got != values.end() ? got->second.c_str() : "nothing", value);
+        wrong++;
+      }
+    }
+    return wrong;
+  }
+};
+
+/*
+Telegram at the given second of the day, registers grow by interval seconds of the power.
+*/
+static std::string p1DayTelegram(int seconds, int interval, double& import, double& gas)
+{
+  double hour = seconds / 3600.0;
+  double base = 0.25 + 0.9 * exp(-pow(hour - 19, 2) / 4) + 0.5 * exp(-pow(hour - 7.5, 2) / 2); //Evening and morning peaks
+  double power = base + ((rand() % 100) < 15 ? (rand() % 2000) / 1000.0 : 0); //Kettle, oven...
+  import += power * interval / 3600;
+  if (seconds % 300 < interval) //Gas meter reports every 5 min
+  {
+    gas += (hour > 6 && hour < 23) ? 0.05 + (rand() % 50) / 1000.0 : 0;
+  }
+  double phase[3] = {power * 0.45, power * 0.25, power * 0.30};
+  double volt[3];
+  for (int i = 0; i < 3; i++)
+  {
+    volt[i] = 230 + 3 * sin(hour / 24 * 6.28 + i) + (rand() % 300) / 100.0 - 1.5;
+  }
+
+  char t[1400];
+  int h = seconds / 3600, m = seconds / 60 % 60, s = seconds % 60;
+  int len = snprintf(t, sizeof(t),
+    "/ISK5\\2M550T-1012\r\n\r\n"
+    "1-3:0.2.8(50)\r\n"
+    "0-0:1.0.0(230511%02d%02d%02dS)\r\n"
+    "0-0:96.1.1(4530303434303037313331363530323137)\r\n"
+    "1-0:1.8.1(%010.3f*kWh)\r\n"
+    "1-0:1.8.2(002345.678*kWh)\r\n"
+    "1-0:2.8.1(000012.345*kWh)\r\n"
+    "1-0:2.8.2(000000.000*kWh)\r\n"
+    "0-0:96.14.0(0001)\r\n"
+    "1-0:1.7.0(%06.3f*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "0-0:96.7.21(00012)\r\n"
+    "0-0:96.7.9(00003)\r\n"
+    "1-0:99.97.0(1)(0-0:96.7.19)(000101000001W)(0000000000*s)\r\n"
+    "1-0:32.32.0(00002)\r\n"
+    "1-0:52.32.0(00001)\r\n"
+    "1-0:72.32.0(00001)\r\n"
+    "1-0:32.36.0(00000)\r\n"
+    "0-0:96.13.0()\r\n"
+    "1-0:32.7.0(%05.1f*V)\r\n"
+    "1-0:52.7.0(%05.1f*V)\r\n"
+    "1-0:72.7.0(%05.1f*V)\r\n"
+    "1-0:31.7.0(%03d*A)\r\n"
+    "1-0:51.7.0(%03d*A)\r\n"
+    "1-0:71.7.0(%03d*A)\r\n"
+    "1-0:21.7.0(%06.3f*kW)\r\n"
+    "1-0:41.7.0(%06.3f*kW)\r\n"
+    "1-0:61.7.0(%06.3f*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.0(4730303339303031373030393637373137)\r\n"
+    "0-1:24.2.1(230511%02d%02d00S)(%09.3f*m3)\r\n"
+    "!",
+    h, m, s, import, power, volt[0], volt[1], volt[2],
+    (int)(phase[0] * 1000 / volt[0]), (int)(phase[1] * 1000 / volt[1]), (int)(phase[2] * 1000 / volt[2]),
+    phase[0], phase[1], phase[2], h, m / 5 * 5, gas);
+  uint16_t crc = 0;
+  for (int i = 0; i < len; i++)
+  {
+    crc = p1Crc16Update(crc, t[i]);
+  }
+  snprintf(t + len, sizeof(t) - len, "%04X\r\n", crc);
+  return t;
+}
+
+int p1Day()
+{
+  srand(1);
+  double import = 1234.567, gas = 1234.567;
+  P1DayReceiver raw, delta;
+  static char body[P1_DELTA_BUFFER];
+  int keyframes = 0, skipped = 0, wrong = 0;
+  for (int step = 0; step < 720; step++)
+  {
+    std::string telegram = p1DayTelegram(step * 120, 120, import, gas);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+    P1buffer[P1length] = '\0';
+    parseItems();
+
+    raw.receive(P1buffer, P1length);
+
+    int len = p1DeltaKeyframeDue() ? -1 : p1DeltaBuild(body, sizeof(body));
+    if (len < 0)
+    {
+      delta.receive(P1buffer, P1length);
+      keyframes++;
+    }
+    else if (len > 0)
+    {
+      delta.receive(body, len);
+    }
+    else
+    {
+      skipped++;
+    }
+    if (len != 0)
+    {
+      p1DeltaAccept(len < 0);
+    }
+    wrong += delta.check();
+  }
+
+  printf("raw:   %d uploads, %zu bytes, %zu bytes/upload\n", raw.uploads, raw.bytes, raw.bytes / raw.uploads);
+  printf("delta: %d uploads (%d keyframes, %d not needed), %zu bytes, %zu bytes/upload, %.1f%% of raw\n", delta.uploads,
+    keyframes, skipped, delta.bytes, delta.bytes / delta.uploads, 100.0 * delta.bytes / raw.bytes);
+  printf("receiver outside deadband: %d\n", wrong);
+  return wrong;
+}
+
+/*
+A day of telegrams every 10 s into the history, then every record left in the rings is checked against
+min/avg/max computed here from the same samples. Prints the ring use and the 15 min document of 1.7.0.
+*/
+int p1DayHistory()
+{
+  srand(1);
+  double import = 1234.567, gas = 1234.567;
+  std::map<uint32_t, P1HistoryBucket> expected[P1_HISTORY_SERIES][2];
+  p1HistorySetup();
+  const uint32_t day = 1683763200; //2023-05-11 00:00 UTC
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 10)
+  {
+    std::string telegram = p1DayTelegram(seconds, 10, import, gas);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+    parseItems();
+    p1HistoryAdd(day + seconds);
+
+    for (int i = 0; i < P1_HISTORY_SERIES; i++)
+    {
+      const OBISItem::ValueSlot& v = p1History[i].item->current();
+      int64_t value = v.value.fixed.mantissa;
+      p1HistoryBucketAdd(expected[i][0][(day + seconds) / 60 * 60], (day + seconds) / 60 * 60, value, value, value, 1);
+      p1HistoryBucketAdd(expected[i][1][(day + seconds) / 900 * 900], (day + seconds) / 900 * 900, value, value, value, 1);
+    }
+  }
+
+  int wrong = 0;
+  for (int i = 0; i < P1_HISTORY_SERIES; i++)
+  {
+    P1HistorySeries& s = p1History[i];
+    P1HistoryRing* rings[] = {&s.raw, &s.minute, &s.quarter};
+    for (int r = 0; r < 3; r++)
+    {
+      P1HistoryRing& ring = *rings[r];
+      P1HistoryRecord record = {ring.baseTime, ring.baseValue, ring.baseValue, ring.baseValue};
+      uint16_t pos = ring.tail;
+      for (int n = 0; n < ring.count; n++)
+      {
+        p1HistoryDecode(ring, pos, record);
+        if (r == 0)
+        {
+          continue;
+        }
+        P1HistoryBucket& b = expected[i][r - 1][record.time];
+        int64_t avg = (b.sum + b.count / 2) / (int64_t)b.count;
+        if (b.count == 0 || record.value != avg || record.min != b.min || record.max != b.max)
+        {
+          wrong++;
+        }
+      }
+      printf("%s %-7s %4d records, %3d bytes, %.2f bytes/record, from %+6d s\n", p1HistoryCodes[i],
+        r == 0 ? "samples" : r == 1 ? "1 min" : "15 min", ring.count, ring.used, (double)ring.used / ring.count,
+        (int)(ring.baseTime - (day + 24 * 3600)));
+    }
+  }
+
+  P1HistoryStream stream;
+  std::string json;
+  char chunk[61];
+  p1HistoryBegin(stream, "1.7.0", 900);
+  for (size_t n; (n = p1HistoryRead(stream, chunk, sizeof(chunk))) > 0;)
+  {
+    json.append(chunk, n);
+  }
+  printf("%zu bytes: %.160s...\n", json.size(), json.c_str());
+  printf("rollups not matching the samples: %d\n", wrong);
+  return wrong;
+}
+
+/*
+Value of 1-0:1.7.0 in a telegram or snapshot body, empty if not there.
+*/
+static std::string p1DayPower(const char* body)
+{
+  const char* p = strstr(body, "1-0:1.7.0(");
+  return p != nullptr ? std::string(p + 10, strcspn(p + 10, "*)")) : std::string();
+}
+
+int p1DayLog(const char* root)
+{
+  srand(1);
+  p1HostFsRoot = root;
+  for (int i = 0; i < P1_LOG_SEGMENTS; i++) //Start from an empty log
+  {
+    char path[24];
+    p1LogPath(path, sizeof(path), i);
+    p1FsRemove(path);
+  }
+  p1LogSetup();
+
+  double import = 1234.567, gas = 1234.567;
+  const uint32_t day = 1683763200;
+  std::map<uint32_t, std::string> logged; //Time of each logged snapshot and its power
+  int replayed = 0, wrong = 0, lostAtRestart = 0;
+  uint32_t lastReplayed = 0;
+  static char body[P1_UPLOAD_BUFFER];
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 120)
+  {
+    std::string telegram = p1DayTelegram(seconds, 120, import, gas);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+    P1buffer[P1length] = '\0';
+    parseItems();
+
+    if (seconds == 12 * 3600) //Restart, the block in RAM is lost
+    {
+      for (int pos = 4; pos < p1LogBlockUsed; pos += p1LogBlock[pos] | p1LogBlock[pos + 1] << 8)
+      {
+        uint32_t time;
+        memcpy(&time, p1LogBlock + pos + 2, 4);
+        logged.erase(time);
+        lostAtRestart++;
+      }
+      p1LogSetup();
+    }
+
+    if (seconds >= 4 * 3600 && seconds < 20 * 3600) //Upload failed
+    {
+      p1LogAppend(day + seconds);
+      logged[day + seconds] = p1DayPower(P1buffer);
+      continue;
+    }
+    wrong += p1LogReplay(body, 64) > 0; //A snapshot that does not fit fails (-1), it is not cut
+    for (int len; (len = p1LogReplay(body, sizeof(body))) > 0; p1LogReplayDone())
+    {
+      uint32_t time = strtoul(body + 10, nullptr, 10);
+      auto found = logged.find(time);
+      if (found == logged.end() || time <= lastReplayed || strtod(found->second.c_str(), nullptr) != strtod(p1DayPower(body).c_str(), nullptr))
+      {
+        printf("  replayed %lu not as logged\n", (unsigned long)time);
+        wrong++;
+      }
+      lastReplayed = time;
+      replayed++;
+    }
+  }
+
+  int expected = (int)logged.size() - (int)p1LogDropped;
+  printf("logged %zu snapshots, %ld flash writes of %d bytes (%.1f bytes/snapshot), %ld dropped (log full), %d lost at restart\n",
+    logged.size() + lostAtRestart, p1HostFsWrites, P1_LOG_BLOCK, (double)p1HostFsBytes / (logged.size() + lostAtRestart), p1LogDropped, lostAtRestart);
+  printf("replayed %d of %d, not as logged: %d\n", replayed, expected, wrong);
+
+  //A snapshot too large for an upload body, then a normal one: through the log, the replay and the upload queue
+  //as on the device, the large one is dropped and the next still arrives
+  std::string large = "/ISK5\\2M550T-1012\r\n\r\n";
+  for (int i = 0; i < 60; i++)
+  {
+    large += "1-0:150.150." + std::to_string(100 + i) + "(123456789.123456789*kWh)\r\n";
+  }
+  large += "!\r\n";
+  parseItems(p1main, large.data(), large.size());
+  long dropped = p1LogDropped;
+  p1LogAppend(day + 24 * 3600);
+  p1SetFilter(P1F_UPLOAD, "!1-0:150.150.*");
+  p1LogAppend(day + 24 * 3600 + 1);
+  p1SetFilter(P1F_UPLOAD, P1_FILTER_UPLOAD);
+  p1UploadDone = [](const char* format, uint32_t, bool ok) { if (ok && strcmp(format, "snapshot") == 0) p1LogReplayDone(); };
+  static char keyframe[P1_MAXBUFFER];
+  p1UploadQueue(keyframe, sizeof(keyframe), "telegram", 0); //Still in the queue, the large one waits for it
+  int arrived = 0;
+  bool waited = false;
+  for (int pass = 0; pass < 10; pass++) //loop() passes
+  {
+    bool queued = p1LogReplayQueue();
+    waited |= pass == 0 && !queued && p1LogDropped == dropped;
+    if (queued)
+    {
+      P1UploadSlot& slot = p1UploadSlots[0]; //Written in place, the queue was empty
+      wrong += strtoul(slot.body + 10, nullptr, 10) != day + 24 * 3600 + 1 || slot.body != p1UploadData;
+      arrived++;
+    }
+    if (p1UploadCount > 0)
+    {
+      p1UploadFinish(true, 0); //Arrived
+    }
+  }
+  wrong += !waited || arrived != 1 || p1LogDropped != dropped + 1 || p1LogPending;
+  printf("large snapshot waited for the queue: %s, dropped %ld, the one after it arrived %d\n", waited ? "yes" : "no",
+    p1LogDropped - dropped, arrived);
+
+  return wrong + (replayed != expected);
+}
+
+/*
+Items of an events frame by code, each the whole {...} of the item.
+*/
+static void p1DayFrameItems(const char* frame, std::map<std::string, std::string>& items)
+{
+  for (const char* p = strstr(frame, "{\"Code\":\""); p != nullptr; p = strstr(p + 1, "{\"Code\":\""))
+  {
+    const char* code = p + 9;
+    items[std::string(code, strchr(code, '"') - code)] = std::string(p, strchr(p, '}') + 1 - p);
+  }
+}
+
+int p1DayEvents()
+{
+  srand(1);
+  double import = 1234.567, gas = 1234.567;
+  static char frame[P1_EVENTS_BUFFER], full[P1_EVENTS_BUFFER];
+  std::map<std::string, std::string> subscriber;
+  bool subscribed = false;
+  long frames = 0, frameBytes = 0, fullBytes = 0, wrong = 0;
+  double buildNs = 0;
+  const int steps = 24 * 360;
+  for (int step = 0; step < steps; step++)
+  {
+    std::string telegram = p1DayTelegram(step * 10, 10, import, gas);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+    P1buffer[P1length] = '\0';
+    parseItems();
+
+    bool away = step >= 6 * 360 && step < 7 * 360;
+    if (away)
+    {
+      subscribed = false;
+      p1EventsReset();
+      continue;
+    }
+    if (!subscribed) //Connects, gets all items
+    {
+      subscriber.clear();
+      p1EventsBuild(full, sizeof(full), true);
+      p1DayFrameItems(full, subscriber);
+      subscribed = true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int len = p1EventsBuild(frame, sizeof(frame), false);
+    buildNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (len > 0)
+    {
+      p1DayFrameItems(frame, subscriber);
+      frames++;
+      frameBytes += len;
+    }
+    int fullLength = p1EventsBuild(full, sizeof(full), true);
+    fullBytes += fullLength;
+    std::map<std::string, std::string> now;
+    p1DayFrameItems(full, now);
+    wrong += subscriber != now;
+  }
+  int pushed = steps - 360;
+  printf("events: %d telegrams pushed in %ld frames, avg %ld bytes (all items %ld bytes), %.0f ns to build\n",
+    pushed, frames, frameBytes / frames, fullBytes / pushed, buildNs / pushed);
+  printf("subscriber not matching all items: %ld\n", wrong);
+  return wrong;
+}
+
+static double p1DayValue(uint64_t key)
+{
+  OBISItem* item = p1parsed->findOBISItem(key);
+  return item != nullptr && item->current().type == OBISItem::DOUBLE ? item->current().getDouble() : NAN;
+}
+
+static double p1DerivedNs = 0;
+
+int p1DayDerived()
+{
+  srand(1);
+  p1DerivedSetup();
+  p1main.beforeCommit = [](P1Parser&) { //Timed
+    auto start = std::chrono::steady_clock::now();
+    p1DerivedUpdate();
+    p1DerivedNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  };
+  double import = 1234.567, gas = 1234.567, lastImport = NAN, window[P1_DERIVED_WINDOW];
+  int wrong = 0, checked = 0;
+  const int steps = 24 * 360;
+  std::string telegram;
+  for (int step = 0; step < steps; step++)
+  {
+    telegram = p1DayTelegram(step * 10, 10, import, gas);
+    memcpy(P1buffer, telegram.data(), telegram.size());
+    P1length = telegram.size();
+    P1buffer[P1length] = '\0';
+    p1HostMillis += 7000; //Reading time is not used, the telegrams have theirs
+    parseItems();
+
+    double imported = p1DayValue(P1_DERIVED_KEY(1, 8, 1)) + p1DayValue(P1_DERIVED_KEY(1, 8, 2));
+    double power = p1DayValue(P1_DERIVED_KEY(1, 7, 0));
+    window[step % P1_DERIVED_WINDOW] = power;
+    double average = 0;
+    int n = std::min(step + 1, P1_DERIVED_WINDOW);
+    for (int i = 0; i < n; i++) average += window[i] / n;
+    struct { uint64_t key; double expected; double tolerance; } checks[] = {
+      {P1_DERIVED_KEY(128, 7, 0), power - p1DayValue(P1_DERIVED_KEY(2, 7, 0)), 0},
+      {P1_DERIVED_KEY(129, 7, 0), 0, 0},
+      {P1_DERIVED_KEY(130, 7, 0), p1DayValue(P1_DERIVED_KEY(21, 7, 0)) + p1DayValue(P1_DERIVED_KEY(41, 7, 0)) + p1DayValue(P1_DERIVED_KEY(61, 7, 0)), 0},
+      {P1_DERIVED_KEY(131, 7, 0), 0, 0},
+      {P1_DERIVED_KEY(128, 8, 0), step > 0 ? imported - lastImport : NAN, 0},
+      {P1_DERIVED_KEY(132, 7, 0), step > 0 ? (imported - lastImport) * 360 : NAN, 0.001}, //10 s
+      {P1_DERIVED_KEY(133, 7, 0), average, 0.0005}, //Rounded to 3 decimals
+    };
+    for (auto& c : checks)
+    {
+      double got = p1DayValue(c.key);
+      if (!(isnan(got) && isnan(c.expected)) && !(fabs(got - c.expected) <= c.tolerance + 1e-9))
+      {
+        if (wrong++ < 5) printf("  step %d, %llx: %.4f, expected %.4f\n", step, (unsigned long long)c.key, got, c.expected);
+      }
+      checked++;
+    }
+    lastImport = imported;
+  }
+
+  //Clock changes, without a CRC: 10 s from the last summer time telegram to the first winter time one and back,
+  //the average power from the registers must still be over 10 s
+  static const char* clockChanges[][2] = {{"231029025950S", "231029020000W"}, {"240331015950W", "240331030000S"}};
+  for (auto& change : clockChanges)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      import += 0.010; //A kettle, so the 10 s add up to more than the last decimal
+      telegram = p1DayTelegram(steps * 10, 10, import, gas);
+      telegram = telegram.substr(0, telegram.find('!') + 1);
+      telegram.replace(telegram.find("0-0:1.0.0(") + 10, 13, change[i]);
+      memcpy(P1buffer, telegram.data(), telegram.size());
+      P1length = telegram.size();
+      parseItems();
+      double imported = p1DayValue(P1_DERIVED_KEY(1, 8, 1)) + p1DayValue(P1_DERIVED_KEY(1, 8, 2));
+      double average = p1DayValue(P1_DERIVED_KEY(132, 7, 0));
+      if (i == 1 && !(fabs(average - (imported - lastImport) * 360) <= 0.001 + 1e-9))
+      {
+        printf("  %s to %s: average %.4f, expected %.4f\n", change[0], change[1], average, (imported - lastImport) * 360);
+        wrong++;
+      }
+      lastImport = imported;
+    }
+  }
+
+  //Exporting, without a CRC: net import is 0 and net export the difference
+  telegram = telegram.substr(0, telegram.find('!') + 1);
+  telegram.replace(telegram.find("1-0:2.7.0(00.000"), 16, "1-0:2.7.0(01.700");
+  memcpy(P1buffer, telegram.data(), telegram.size());
+  P1length = telegram.size();
+  parseItems();
+  double net = p1DayValue(P1_DERIVED_KEY(1, 7, 0)) - 1.7;
+  wrong += p1DayValue(P1_DERIVED_KEY(128, 7, 0)) != 0 || fabs(p1DayValue(P1_DERIVED_KEY(129, 7, 0)) + net) > 1e-9;
+
+  //A keyframe is the raw telegram, the derived values follow in the next delta
+  static char delta[P1_DELTA_BUFFER];
+  p1DeltaLost();
+  p1DeltaAccept(true);
+  delta[std::max(p1DeltaBuild(delta, sizeof(delta)), 0)] = '\0';
+  bool inDelta = strstr(delta, "1-0:128.7.0(") != nullptr && strstr(delta, "1-0:133.7.0(") != nullptr;
+
+  static P1JsonStream stream;
+  static char json[P1_JSON_CACHE];
+  p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_API);
+  json[p1JsonRead(stream, json, sizeof(json) - 1)] = '\0';
+  bool inJson = strstr(json, "\"Code\":\"128.7.0\"") != nullptr && strstr(json, "\"Code\":\"133.7.0\"") != nullptr;
+
+  printf("derived: %d values checked over %d telegrams, %d wrong, %.0f ns per telegram\n", checked, steps, wrong, p1DerivedNs / (steps + 1));
+  printf("net export when exporting: %s, derived items in /api: %s (%d bytes)\n", p1DayValue(P1_DERIVED_KEY(129, 7, 0)) > 0 ? "yes" : "no", inJson ? "yes" : "no", (int)strlen(json));
+  printf("derived items in the delta after a keyframe: %s\n", inDelta ? "yes" : "no");
+  return wrong + !inJson + !inDelta;
+}
+
+#endif // P1DAY_H
@@ -0,0 +1,560 @@
+/*
+ Host (env:native) runner for the P1 reader and parser, no ESP board needed.
+
+ Recorded telegrams are put on the simulated serial in random sized chunks and read and parsed with the
+ same code as on the device (p1loop). Prints the parsed OBIS items, the CRC result and how long each
+ p1loop() call took. Exit code is the number of telegrams that failed.
+
+   pio run -e native
+   .pio/build/native/program telegrams/
+   .pio/build/native/program reader telegrams/ (p1loop() never waits for bytes, a cut telegram times out)
+   .pio/build/native/program crc telegrams/    (CRC16 variants, damaged telegrams rejected)
+   .pio/build/native/program fixed        (decimal values against strtod, 1M random ones)
+   .pio/build/native/program stress       (snapshots read on a thread while telegrams are committed)
+   .pio/build/native/program alloc        (no heap allocations over 100k telegrams once the items exist)
+   .pio/build/native/program bench        (see p1bench.h)
+   .pio/build/native/program scan         (bulk scanning paths checked and timed, see p1bench.h)
+   .pio/build/native/program lines        (unchanged lines skipped, checked and timed on a simulated day)
+   .pio/build/native/program lookup       (items list against the index, see p1bench.h)
+   .pio/build/native/program profile      (a compile-time meter profile against the dynamic parser, see p1bench.h)
+   .pio/build/native/program day          (upload bytes over a day, see p1day.h)
+   .pio/build/native/program history      (rollups over a day, see p1day.h)
+   .pio/build/native/program log <folder> (upload log over a day with an outage, see p1day.h)
+   .pio/build/native/program events       (changed frames pushed to a subscriber, see p1day.h)
+   .pio/build/native/program derived      (derived values over a day, see p1day.h and p1derived.h)
+   .pio/build/native/program mqtt         (publish queue against a broker stub, see p1mqttstub.h)
+   .pio/build/native/program upload       (uploads against a slow local server, see p1uploadstub.h)
+   .pio/build/native/program bulk <archive|-> [threads] [folder] (archive decoded on threads, see p1bulk.h)
+ */
+#define P1_SCAN_SELECTABLE //The scan paths are switched at run time, see p1scan.h
+#include <dirent.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#include "../antonp1.h"
+#include "p1bench.h"
+#include "p1day.h"
+#include "p1mqttstub.h"
+#include "p1uploadstub.h"
+#include "p1bulk.h"
+
+/*
+Counts heap allocations, the parser should not make any after the first telegram.
+*/
+long p1HostAllocations = 0;
+
+void* operator new(size_t size)
+{
+  p1HostAllocations++;
+  void* p = malloc(size);
+  if (p == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+static bool readFile(const std::string& path, std::string& out)
+{
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+  {
+    return false;
+  }
+  char chunk[1024];
+  size_t n;
+  out.clear();
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+  {
+    out.append(chunk, n);
+  }
+  fclose(f);
+  return true;
+}
+
+static void listTelegrams(const char* path, std::vector<std::string>& files)
+{
+  DIR* dir = opendir(path);
+  if (dir == nullptr)
+  {
+    files.push_back(path);
+    return;
+  }
+  std::vector<std::string> found;
+  while (dirent* entry = readdir(dir))
+  {
+    if (entry->d_name[0] != '.')
+    {
+      found.push_back(std::string(path) + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+}
+
+static void printItems()
+{
+  for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+  {
+    char value[P1_MAXVALUE + 24];
+    const OBISItem::ValueSlot& v = item->current();
+    p1FormatValue(v, value, sizeof(value));
+    printf("  %d-%d:%s %s", item->obis[0], item->obis[1], item->getObisCode(), v.type == OBISItem::NONE ? "-" : value);
+    printf(" %s\n", item->unit != nullptr ? item->unit->unitstr : "");
+  }
+}
+
+/*
+Reads one telegram through p1loop(), the way it arrives on the device. Returns false if no telegram was finished.
+*/
+static bool readTelegram(const std::string& telegram, double& maxCallUs, double& totalCallUs, int& calls)
+{
+  p1HostMillis = P1NextMillis + 1; //Time for the next request
+  size_t pos = 0;
+  do
+  {
+    if (pos < telegram.size())
+    {
+      int chunk = 1 + rand() % 64;
+      pos += p1HostSerialWrite(telegram.data() + pos, std::min((size_t)chunk, telegram.size() - pos));
+    }
+    auto start = std::chrono::steady_clock::now();
+    p1loop();
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    maxCallUs = std::max(maxCallUs, us);
+    totalCallUs += us;
+    calls++;
+    p1HostMillis += 5; //Bytes keep arriving while loop() runs
+  } while (p1IsReading() && (pos < telegram.size() || p1SerialAvailable()));
+
+  if (p1IsReading()) //Ended without a complete telegram, let it time out
+  {
+    p1HostMillis += P1_READ_TIMEOUT + 1;
+    p1loop();
+    return false;
+  }
+  return true;
+}
+
+/*
+The reader never waits for bytes: telegrams given one byte per p1loop() call must be taken whole by each call
+and finish on the last byte, and a telegram that stops half way must leave p1loop() returning at once until
+P1_READ_TIMEOUT ends it, with the last good values kept. Returns the number of failures.
+*/
+static int readerTest(const std::vector<std::string>& files)
+{
+  int failed = 0;
+  for (const std::string& file : files)
+  {
+    std::string telegram;
+    if (!readFile(file, telegram))
+    {
+      failed++;
+      continue;
+    }
+    p1HostMillis = P1NextMillis + 1;
+    int calls = 0, waited = 0;
+    for (char c : telegram)
+    {
+      p1HostSerialWrite(&c, 1);
+      p1loop();
+      calls++;
+      waited += p1IsReading() && p1SerialAvailable() != 0; //Left a byte it had while reading
+    }
+    bool whole = !p1IsReading() && P1valid;
+    uint32_t generation = p1SnapshotGeneration();
+
+    p1HostMillis = P1NextMillis + 1; //The same telegram again, cut half way
+    p1HostSerialWrite(telegram.data(), telegram.size() / 2);
+    p1loop();
+    bool pending = p1IsReading() && p1SerialAvailable() == 0; //All it had in one call
+    for (int i = 0; i < 1000; i++)
+    {
+      p1loop(); //Nothing more arrives, each call returns at once
+    }
+    pending &= p1IsReading();
+    p1HostMillis += P1_READ_TIMEOUT + 1;
+    p1loop();
+    bool timedOut = !p1IsReading() && !P1valid && strcmp(P1error, "Time out") == 0 && p1SnapshotGeneration() == generation;
+    bool ok = whole && waited == 0 && pending && timedOut;
+    printf("reader: %s: %d bytes in %d p1loop() calls, %s, %s cut, %s\n", file.c_str(), (int)telegram.size(), calls,
+      whole ? "finished" : "NOT FINISHED", pending ? "waited for the rest of the" : "DID NOT WAIT FOR THE REST OF THE",
+      timedOut ? "timed out keeping the last values" : "NO TIME OUT");
+    failed += !ok;
+  }
+  return failed;
+}
+
+/*
+No heap allocations once the items exist: 100k telegrams of a simulated day (every 10th one damaged, so it
+fails the CRC) read through p1loop() from the serial, as on the device. Returns 1 if there was any.
+*/
+static int allocTest()
+{
+  srand(1);
+  std::vector<std::string> telegrams;
+  double import = 1234.567, gas = 1234.567;
+  for (int seconds = 0; seconds < 24 * 3600; seconds += 10)
+  {
+    telegrams.push_back(p1DayTelegram(seconds, 10, import, gas));
+    if (telegrams.size() % 10 == 0)
+    {
+      telegrams.back()[telegrams.back().size() / 2] ^= 1;
+    }
+  }
+  p1setup();
+  double maxCallUs = 0, totalCallUs = 0;
+  int calls = 0, valid = 0;
+  for (int i = 0; i < 10; i++) //The first telegrams create the items
+  {
+    readTelegram(telegrams[i], maxCallUs, totalCallUs, calls);
+  }
+  long allocations = p1HostAllocations;
+  const int count = 100000;
+  for (int i = 0; i < count; i++)
+  {
+    readTelegram(telegrams[i % telegrams.size()], maxCallUs, totalCallUs, calls);
+    valid += P1valid;
+  }
+  long made = p1HostAllocations - allocations;
+  printf("alloc: %d telegrams (%d valid), %ld heap allocations, %d items, %d string arena bytes, %d pool failures\n", count,
+    valid, made, getObisItemCount(), stringArenaUsed, p1AllocFailures);
+  return made != 0 || valid == 0;
+}
+
+/*
+DSMR CRC16: the bitwise and the table variant against the CRC-16/ARC check value and each other on random
+bytes, then the recorded telegrams: accepted as they are and, if they carry a CRC, rejected (last good values
+kept) with any single bit flipped between the '/' and the '!', framing bytes left alone. Returns the number of failures.
+*/
+static int crcTest(const std::vector<std::string>& files)
+{
+  int failed = 0;
+  uint16_t check = 0, checkTable = 0;
+  for (const char* c = "123456789"; *c; c++)
+  {
+    check = p1Crc16Update(check, *c);
+    checkTable = p1Crc16UpdateTable(checkTable, *c);
+  }
+  failed += check != 0xBB3D || checkTable != 0xBB3D;
+  srand(1);
+  for (int i = 0; i < 100000; i++)
+  {
+    uint16_t crc = rand(), crcTable = crc;
+    uint8_t c = rand();
+    failed += p1Crc16Update(crc, c) != p1Crc16UpdateTable(crcTable, c);
+  }
+  P1Parser* p = new P1Parser();
+  int flips = 0, accepted = 0;
+  for (const std::string& file : files)
+  {
+    std::string telegram;
+    if (!readFile(file, telegram))
+    {
+      failed++;
+      continue;
+    }
+    parseItems(*p, telegram.data(), telegram.size());
+    failed += !p->crcValid;
+    size_t end = telegram.find('!');
+    if (end == std::string::npos || end + 4 >= telegram.size() || !isxdigit((uint8_t)telegram[end + 1]))
+    {
+      continue; //Sent without a CRC, as older meters do, nothing to check
+    }
+    for (size_t pos = 1; pos < end; pos++)
+    {
+      for (int bit = 0; bit < 7; bit++)
+      {
+        std::string damaged = telegram;
+        damaged[pos] ^= 1 << bit;
+        if (strchr("/!\n", telegram[pos]) != nullptr || strchr("/!\n", damaged[pos]) != nullptr)
+        {
+          continue;
+        }
+        uint32_t generation = p->parsed.generation.load();
+        parseItems(*p, damaged.data(), damaged.size());
+        flips++;
+        accepted += p->crcValid || p->parsed.generation.load() != generation;
+      }
+    }
+  }
+  failed += accepted;
+  printf("crc: check value %04X/%04X (BB3D), %d single bit flips, %d accepted, %d failures\n", check, checkTable, flips,
+    accepted, failed);
+  delete p;
+  return failed;
+}
+
+/*
+Decimal values against strtod(): random values of 1 to 18 digits with a dot somewhere (leading and trailing zeros
+included) are parsed from a telegram line. getDouble() must give the same double as strtod() up to 15 digits,
+p1FormatFixed() text must read back (strtod) as the same value and have no leading or trailing zeros.
+Returns the number of mismatches.
+*/
+static int fixedTest(int count)
+{
+  srand(1);
+  P1Parser* p = new P1Parser();
+  p->skipUnchanged = false;
+  int wrong = 0, exact = 0;
+  for (int i = 0; i < count; i++)
+  {
+    char number[24];
+    int digits = 1 + rand() % 18;
+    int dot = rand() % (digits + 1); //Digits before the dot
+    int n = 0;
+    for (int d = 0; d < digits; d++)
+    {
+      if (d == dot && d > 0)
+      {
+        number[n++] = '.';
+      }
+      number[n++] = '0' + (rand() % 4 == 0 ? 0 : rand() % 10);
+    }
+    number[n] = '\0';
+    char telegram[96];
+    int length = snprintf(telegram, sizeof(telegram), "/ISK5\\2M550T-1012\r\n\r\n1-0:1.8.0(%s*kWh)\r\n!\r\n", number);
+    parseItems(*p, telegram, length);
+    const OBISItem::ValueSlot& v = p->parsed.items->at(p->parsed.generation.load());
+    double expected = strtod(number, nullptr);
+    bool hasDot = strchr(number, '.') != nullptr;
+    if (!hasDot) //Digits only are integers, see p1CommitValue()
+    {
+      wrong += v.type == OBISItem::DOUBLE;
+      continue;
+    }
+    if (v.type != OBISItem::DOUBLE)
+    {
+      wrong++;
+      continue;
+    }
+    if (digits <= 15)
+    {
+      wrong += v.getDouble() != expected;
+      exact++;
+    }
+    char text[32];
+    int len = p1FormatFixed(text, sizeof(text), v.value.fixed.mantissa, v.value.fixed.decimals);
+    bool tidy = len > 0 && !(text[0] == '0' && len > 1 && text[1] != '.') && text[len - 1] != '.'
+             && !(strchr(text, '.') != nullptr && text[len - 1] == '0');
+    wrong += strtod(text, nullptr) != expected || !tidy;
+  }
+  printf("fixed: %d values (%d checked exact against strtod), %d wrong\n", count, exact, wrong);
+  delete p;
+  return wrong;
+}
+
+/*
+Telegram number k of the stress test: every value carries k, the 3.7.0 line is only in even ones (so odd ones
+keep it, see p1KeepValue()) and the meter id never changes (its line is skipped as unchanged).
+*/
+static int stressTelegram(char* out, int size, uint32_t k)
+{
+  int n = snprintf(out, size, "/ISK5\\2M550T-1012\r\n\r\n0-0:96.1.1(4530303434303037313331363530383134)\r\n"
+    "1-0:1.8.0(%u.125*kWh)\r\n1-0:2.8.0(%u.5*kWh)\r\n1-0:1.7.0(%u.250*kW)\r\n1-0:32.7.0(%u*V)\r\n0-0:96.13.0(T%u)\r\n",
+    k, k, k, k, k);
+  if (k % 2 == 0)
+  {
+    n += snprintf(out + n, size - n, "1-0:3.7.0(%u*kvar)\r\n", k);
+  }
+  return n + snprintf(out + n, size - n, "!\r\n");
+}
+
+/*
+Snapshot reads while telegrams are committed: one thread parses count telegrams into p1main, another reads
+all its items at p1SnapshotGeneration() and, if p1SnapshotStable() says the read holds, checks they all come
+from the same telegram (the number in each value). Returns 1 if any read was torn.
+*/
+static int stressTest(int count)
+{
+  p1setup();
+  char telegram[512];
+  parseItems(p1main, telegram, stressTelegram(telegram, sizeof(telegram), 0)); //Creates the items
+  std::atomic<bool> done{false};
+  long reads = 0, retries = 0, torn = 0;
+  std::thread reader([&]()
+  {
+    while (!done.load(std::memory_order_relaxed))
+    {
+      uint32_t generation = p1SnapshotGeneration();
+      char texts[8][P1_MAXVALUE];
+      OBISItem* items[8];
+      int n = 0;
+      for (OBISItem* item = p1main.parsed.items; item != nullptr && n < 8; item = item->next, n++)
+      {
+        items[n] = item;
+        p1FormatValue(item->at(generation), texts[n], sizeof(texts[n]));
+      }
+      if (!p1SnapshotStable(generation))
+      {
+        retries++;
+        continue;
+      }
+      reads++;
+      unsigned long k = generation - 1; //The first telegram made generation 1 current
+      bool same = true;
+      for (int i = 0; i < n; i++)
+      {
+        if (items[i]->obis[2] == 96 && items[i]->obis[3] == 1) //The meter id
+        {
+          same = same && strcmp(texts[i], "4530303434303037313331363530383134") == 0;
+          continue;
+        }
+        const char* text = texts[i] + (texts[i][0] == 'T'); //The text message
+        same = same && strtoul(text, nullptr, 10) == (items[i]->obis[2] == 3 ? k & ~1ul : k);
+      }
+      torn += !same;
+    }
+  });
+  for (uint32_t k = 1; k <= (uint32_t)count; k++)
+  {
+    parseItems(p1main, telegram, stressTelegram(telegram, sizeof(telegram), k));
+  }
+  done = true;
+  reader.join();
+  printf("stress: %d telegrams, generation %u, %ld stable reads (%ld retried), %ld torn\n", count,
+    p1SnapshotGeneration(), reads, retries, torn);
+  return torn != 0 || reads == 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <telegram file or folder>... | reader <files> | crc <files> | fixed [count] | stress [count] | alloc | bench | scan | lines | lookup | profile | day | history | log <folder> | events | derived | mqtt | upload | bulk <archive|-> [threads] [folder]\n", argv[0]);
+    return 1;
+  }
+  if (strcmp(argv[1], "reader") == 0 && argc > 2)
+  {
+    std::vector<std::string> files;
+    for (int a = 2; a < argc; a++)
+    {
+      listTelegrams(argv[a], files);
+    }
+    p1setup();
+    return readerTest(files);
+  }
+  if (strcmp(argv[1], "crc") == 0 && argc > 2)
+  {
+    std::vector<std::string> files;
+    for (int a = 2; a < argc; a++)
+    {
+      listTelegrams(argv[a], files);
+    }
+    return crcTest(files);
+  }
+  if (strcmp(argv[1], "stress") == 0)
+  {
+    return stressTest(argc > 2 ? atoi(argv[2]) : 200000);
+  }
+  if (strcmp(argv[1], "fixed") == 0)
+  {
+    return fixedTest(argc > 2 ? atoi(argv[2]) : 1000000);
+  }
+  if (strcmp(argv[1], "alloc") == 0)
+  {
+    return allocTest();
+  }
+  if (strcmp(argv[1], "bench") == 0)
+  {
+    return p1Bench();
+  }
+  if (strcmp(argv[1], "scan") == 0)
+  {
+    return p1BenchScan();
+  }
+  if (strcmp(argv[1], "lines") == 0)
+  {
+    return p1BenchLines();
+  }
+  if (strcmp(argv[1], "lookup") == 0)
+  {
+    return p1BenchLookup();
+  }
+  if (strcmp(argv[1], "profile") == 0)
+  {
+    return p1BenchProfile();
+  }
+  if (strcmp(argv[1], "day") == 0)
+  {
+    return p1Day();
+  }
+  if (strcmp(argv[1], "history") == 0)
+  {
+    return p1DayHistory();
+  }
+  if (strcmp(argv[1], "log") == 0)
+  {
+    return p1DayLog(argc > 2 ? argv[2] : ".");
+  }
+  if (strcmp(argv[1], "events") == 0)
+  {
+    return p1DayEvents();
+  }
+  if (strcmp(argv[1], "derived") == 0)
+  {
+    return p1DayDerived();
+  }
+  if (strcmp(argv[1], "mqtt") == 0)
+  {
+    return p1MqttTest();
+  }
+  if (strcmp(argv[1], "upload") == 0)
+  {
+    return p1UploadTest();
+  }
+  if (strcmp(argv[1], "bulk") == 0 && argc > 2)
+  {
+    return p1Bulk(argv[2], argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? argv[4] : nullptr);
+  }
+  srand(1);
+
+  std::vector<std::string> files;
+  for (int a = 1; a < argc; a++)
+  {
+    listTelegrams(argv[a], files);
+  }
+
+  p1setup();
+  int failed = 0;
+  for (const std::string& file : files)
+  {
+    std::string telegram;
+    if (!readFile(file, telegram))
+    {
+      printf("%s: cannot read\n", file.c_str());
+      failed++;
+      continue;
+    }
+
+    double maxCallUs = 0, totalCallUs = 0;
+    int calls = 0;
+    bool done = readTelegram(telegram, maxCallUs, totalCallUs, calls);
+    bool ok = done && P1valid;
+    printf("%s: %s, %d items, %d p1loop() calls, avg %.2f us, max %.2f us\n", file.c_str(),
+      ok ? "ok" : (*P1error ? P1error : "incomplete"), getObisItemCount(), calls, totalCallUs / calls, maxCallUs);
+    printItems();
+    if (!ok)
+    {
+      failed++;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,120 @@
+/*
+ In-process MQTT broker stub for p1mqtt.h: the "client" takes a limited number of bytes per loop() (its TCP
+ send buffer), QoS 1 acks come back a few loops later, and the connection drops now and then (acks in
+ flight are lost). Two simulated hours of telegrams every 10 s, queued every 10 s as a QoS 1 snapshot.
+ Checks every snapshot reaches the broker in order unless it was dropped (a dropped one may have been
+ sent already, without its ack), and how long p1MqttDrain() takes, it must never wait for the broker.
+
+   .pio/build/native/program mqtt
+ */
+#ifndef P1MQTTSTUB_H
+#define P1MQTTSTUB_H
+
+#include <chrono>
+#include <deque>
+#include <set>
+#include <string>
+#include "../p1mqtt.h"
+#include "p1day.h"
+
+struct P1MqttStub
+{
+  bool up = true;
+  int budget = 0; //Bytes the client takes this loop
+  uint16_t nextId = 1;
+  std::deque<std::pair<int, uint16_t>> acks; //Loop when the ack arrives, packet id
+  std::vector<std::string> received; //Times of the snapshots, in arrival order
+  long bytes = 0;
+};
+
+static P1MqttStub p1Stub;
+
+static std::string p1StubTime(const char* payload, int length)
+{
+  std::string s(payload, length);
+  size_t p = s.find("\"Code\":\"1.0.0\",\"SValue\":\"");
+  return p == std::string::npos ? "" : s.substr(p + 25, 13);
+}
+
+int p1MqttTest()
+{
+  srand(1);
+  p1MqttTransport.connected = []() { return p1Stub.up; };
+  p1MqttTransport.publish = [](const char* topic, uint8_t qos, bool retain, const char* payload, int length) -> uint16_t {
+    int size = strlen(topic) + length + 8;
+    if (!p1Stub.up || size > p1Stub.budget)
+    {
+      return 0;
+    }
+    p1Stub.budget -= size;
+    p1Stub.bytes += size;
+    p1Stub.received.push_back(p1StubTime(payload, length));
+    uint16_t id = qos > 0 ? p1Stub.nextId++ : 1;
+    if (p1Stub.nextId == 0) p1Stub.nextId = 1;
+    return id;
+  };
+
+  double import = 1234.567, gas = 1234.567;
+  std::vector<std::string> queued;
+  double maxDrainUs = 0;
+  int loops = 0;
+  for (int seconds = 0; seconds < 2 * 3600; seconds++, loops++)
+  {
+    if (seconds % 10 == 0)
+    {
+      std::string telegram = p1DayTelegram(seconds, 10, import, gas);
+      memcpy(P1buffer, telegram.data(), telegram.size());
+      P1length = telegram.size();
+      parseItems();
+      p1MqttSnapshot("p1/test", 1, false);
+      queued.push_back(p1StubTime(p1MqttScratch, strlen(p1MqttScratch)));
+    }
+    if (seconds % 1800 == 600) p1Stub.up = false; //Broker away for 5 min every half hour
+    if (seconds % 1800 == 900)
+    {
+      p1Stub.up = true;
+      p1Stub.acks.clear(); //Acks of the old connection never come
+    }
+    p1Stub.budget = rand() % 3000; //TCP send buffer room this loop
+
+    while (p1Stub.up && !p1Stub.acks.empty() && p1Stub.acks.front().first <= loops)
+    {
+      p1MqttAckReceived(p1Stub.acks.front().second);
+      p1Stub.acks.pop_front();
+    }
+    uint16_t firstId = p1Stub.nextId;
+    auto start = std::chrono::steady_clock::now();
+    p1MqttDrain();
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    maxDrainUs = us > maxDrainUs ? us : maxDrainUs;
+    for (uint16_t id = firstId; id != p1Stub.nextId; id = id == 0xFFFF ? 1 : id + 1)
+    {
+      p1Stub.acks.push_back({loops + 1 + rand() % 4, id});
+    }
+  }
+
+  //In order (a snapshot sent again after a reconnect may repeat), nothing missing that was not dropped
+  int wrong = 0;
+  size_t next = 0;
+  std::set<std::string> got;
+  for (const std::string& t : p1Stub.received)
+  {
+    size_t at = next;
+    while (at < queued.size() && queued[at] != t) at++;
+    if (at == queued.size())
+    {
+      bool repeat = got.count(t) > 0;
+      wrong += !repeat;
+      continue;
+    }
+    next = at + 1;
+    got.insert(t);
+  }
+  long missing = (long)queued.size() - (long)got.size() - p1MqttCount;
+  printf("queued %zu snapshots, broker got %zu (%zu distinct, %ld bytes), acked %ld, dropped %ld, still queued %d\n",
+    queued.size(), p1Stub.received.size(), got.size(), p1Stub.bytes, p1MqttPublished, p1MqttDropped, p1MqttCount);
+  printf("missing %ld (may not exceed dropped), out of order: %d, p1MqttDrain() max %.1f us\n", missing, wrong, maxDrainUs);
+  return wrong + (missing > p1MqttDropped);
+}
+
+#endif // P1MQTTSTUB_H
@@ -0,0 +1,291 @@
+/*
+ Local HTTP stand-in for p1upload.h: a slow server on 127.0.0.1 in its own thread (200 ms per response,
+ 1200 ms every 4th, some 503s and a few connections closed without a response) and a non-blocking socket
+ as the client. The reader runs as on the device meanwhile, p1loop() and p1UploadPoll() every 1 ms with
+ the clock in real time, and an upload is queued every 500 ms, faster than the server takes them.
+
+ Prints how long each loop took and how late telegrams were parsed, against how long a blocking POST
+ (the old postData) would have held loop().
+
+   .pio/build/native/program upload
+ */
+#ifndef P1UPLOADSTUB_H
+#define P1UPLOADSTUB_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "../p1upload.h"
+#include "p1day.h"
+
+struct P1UploadServer
+{
+  int listener = -1;
+  uint16_t port = 0;
+  std::atomic<bool> stop{false};
+  std::atomic<int> requests{0};
+  std::atomic<int> connections{0};
+  std::atomic<int> bad{0}; //Body not as announced
+  std::atomic<int> answered{0}; //With 2xx
+};
+
+static P1UploadServer p1Server;
+
+static void p1ServerConnection(int fd)
+{
+  std::string in;
+  char chunk[2048];
+  while (!p1Server.stop)
+  {
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+      pollfd p = {fd, POLLIN, 0};
+      if (poll(&p, 1, 50) <= 0) continue;
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) break;
+      in.append(chunk, n);
+      continue;
+    }
+    const char* length = strcasestr(in.c_str(), "Content-Length:");
+    size_t bodyLength = length != nullptr && length < in.c_str() + end ? atol(length + 15) : 0;
+    while (in.size() < end + 4 + bodyLength)
+    {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) break;
+      in.append(chunk, n);
+    }
+    if (in.size() < end + 4 + bodyLength || in[end + 4] != '/')
+    {
+      p1Server.bad++;
+      break;
+    }
+    in.erase(0, end + 4 + bodyLength);
+
+    int n = ++p1Server.requests;
+    if (n % 9 == 5) break; //Gone without a response
+    std::this_thread::sleep_for(std::chrono::milliseconds(n % 4 == 0 ? 1200 : 200));
+    const char* response = n % 7 == 3 ? "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 4\r\n\r\nbusy"
+                                      : "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    p1Server.answered += n % 7 != 3;
+    send(fd, response, strlen(response), MSG_NOSIGNAL);
+  }
+  close(fd);
+}
+
+static void p1ServerRun()
+{
+  while (!p1Server.stop)
+  {
+    pollfd p = {p1Server.listener, POLLIN, 0};
+    if (poll(&p, 1, 50) <= 0) continue;
+    int fd = accept(p1Server.listener, nullptr, nullptr);
+    if (fd < 0) continue;
+    p1Server.connections++;
+    p1ServerConnection(fd);
+  }
+}
+
+static bool p1ServerStart()
+{
+  p1Server.listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t size = sizeof(addr);
+  if (p1Server.listener < 0 || bind(p1Server.listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(p1Server.listener, 4) != 0 || getsockname(p1Server.listener, (sockaddr*)&addr, &size) != 0)
+  {
+    return false;
+  }
+  p1Server.port = ntohs(addr.sin_port);
+  return true;
+}
+
+/*
+Client side, a non-blocking socket standing in for AsyncClient.
+*/
+static int p1StubSocket = -1;
+static bool p1StubConnecting = false;
+
+static void p1StubClose()
+{
+  if (p1StubSocket >= 0) close(p1StubSocket);
+  p1StubSocket = -1;
+  p1StubConnecting = false;
+}
+
+static bool p1StubConnected()
+{
+  if (p1StubSocket >= 0 && p1StubConnecting)
+  {
+    pollfd p = {p1StubSocket, POLLOUT, 0};
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (poll(&p, 1, 0) > 0)
+    {
+      getsockopt(p1StubSocket, SOL_SOCKET, SO_ERROR, &error, &size);
+      if (error != 0) p1StubClose();
+      else p1StubConnecting = false;
+    }
+  }
+  return p1StubSocket >= 0 && !p1StubConnecting;
+}
+
+static void p1StubConnect(const char* host, uint16_t port)
+{
+  p1StubClose();
+  p1StubSocket = socket(AF_INET, SOCK_STREAM, 0);
+  fcntl(p1StubSocket, F_SETFL, O_NONBLOCK);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, host, &addr.sin_addr);
+  p1StubConnecting = true;
+  if (connect(p1StubSocket, (sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) p1StubClose();
+}
+
+static int p1StubWrite(const char* data, int length)
+{
+  ssize_t n = send(p1StubSocket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  return n > 0 ? n : 0;
+}
+
+/*
+What the client's callbacks do on the device, between two loop() calls.
+*/
+static void p1StubReceive()
+{
+  char chunk[512];
+  while (p1StubSocket >= 0 && !p1StubConnecting)
+  {
+    ssize_t n = recv(p1StubSocket, chunk, sizeof(chunk), MSG_DONTWAIT);
+    if (n > 0)
+    {
+      p1UploadReceived(chunk, n);
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      p1StubClose();
+      p1UploadClosed();
+    }
+    break;
+  }
+}
+
+/*
+One POST the old way, waiting for the response. Returns how long it took in ms.
+*/
+static double p1StubBlockingPost(const std::string& body)
+{
+  auto start = std::chrono::steady_clock::now();
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(p1Server.port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+  {
+    std::string request = "POST /p1 HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    char chunk[256];
+    recv(fd, chunk, sizeof(chunk), 0);
+  }
+  close(fd);
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int p1StubOk = 0, p1StubFailed = 0;
+
+int p1UploadTest()
+{
+  if (!p1ServerStart())
+  {
+    printf("cannot listen on 127.0.0.1\n");
+    return 1;
+  }
+  std::thread server(p1ServerRun);
+  p1UploadTransport = {p1StubConnected, p1StubConnect, []() { return 4096; }, p1StubWrite, p1StubClose, []() { return -60; }};
+  p1UploadDone = [](const char* format, uint32_t tag, bool ok) { ok ? p1StubOk++ : p1StubFailed++; };
+  p1UploadSetup("127.0.0.1", p1Server.port, "/p1", "p1control-wifimac: 00:00:00:00:00:00\r\np1control-wifiip: 127.0.0.1\r\n");
+  p1setup();
+
+  double import = 1234.567, gas = 1234.567;
+  std::string telegram;
+  size_t telegramPos = 0;
+  unsigned long telegramWritten = 0; //When its last byte was put on the serial
+  uint32_t generation = p1Generation;
+  int telegrams = 0, queued = 0, full = 0;
+  double maxLoopMs = 0, totalLoopMs = 0, maxDelayMs = 0;
+  long loops = 0;
+  auto start = std::chrono::steady_clock::now();
+  unsigned long nextQueue = 500;
+  while ((p1HostMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()) < 12000)
+  {
+    if (p1HostRequestPin && telegramPos == 0 && telegram.empty()) //Meter answers the request
+    {
+      telegram = p1DayTelegram(p1HostMillis / 1000, 2, import, gas);
+    }
+    if (!telegram.empty())
+    {
+      telegramPos += p1HostSerialWrite(telegram.data() + telegramPos, std::min((size_t)128, telegram.size() - telegramPos));
+      if (telegramPos == telegram.size())
+      {
+        telegram.clear();
+        telegramPos = 0;
+        telegramWritten = p1HostMillis;
+      }
+    }
+
+    auto loopStart = std::chrono::steady_clock::now();
+    p1StubReceive();
+    p1loop();
+    if (p1Generation != generation)
+    {
+      generation = p1Generation;
+      telegrams++;
+      maxDelayMs = std::max(maxDelayMs, (double)(p1HostMillis - telegramWritten));
+    }
+    if (p1HostMillis >= nextQueue && !p1IsReading() && P1length > 0)
+    {
+      queued++;
+      full += !p1UploadQueue(P1buffer, P1length, "telegram", 0);
+      nextQueue += 500;
+    }
+    p1UploadPoll();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loopStart).count();
+    maxLoopMs = std::max(maxLoopMs, ms);
+    totalLoopMs += ms;
+    loops++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  p1StubClose(); //The server takes one connection at a time
+  double blockingMs = 0;
+  for (int i = 0; i < 4; i++) //Same server, one request of each kind of delay
+  {
+    blockingMs = std::max(blockingMs, p1StubBlockingPost(std::string(P1buffer, P1length)));
+  }
+  p1Server.stop = true;
+  server.join();
+  close(p1Server.listener);
+
+  printf("%d telegrams parsed, at most %.1f ms after their last byte\n", telegrams, maxDelayMs);
+  printf("loop(): %ld calls, avg %.3f ms, max %.3f ms (a blocking POST held it up to %.0f ms)\n",
+    loops, totalLoopMs / loops, maxLoopMs, blockingMs);
+  printf("queued %d uploads (%d more found the queue full): %d ok, %d given up, %ld retries, %d still queued\n",
+    queued - full, full, p1StubOk, p1StubFailed, p1UploadRetried, p1UploadCount);
+  printf("server: %d requests on %d connections, %d answered 2xx, %d with a bad body\n",
+    p1Server.requests.load(), p1Server.connections.load(), p1Server.answered.load(), p1Server.bad.load());
+  return p1Server.bad + (p1StubOk == 0) + (maxDelayMs > 100) + (queued - full != p1StubOk + p1StubFailed + p1UploadCount);
+}
+
+#endif // P1UPLOADSTUB_H
@@ -0,0 +1,180 @@
+/*
+ Decoder for the binary snapshots of p1wire.h, for the receiving side (host, C++17, no Arduino needed).
+ Keeps the schemas it has seen by id, so messages without the schema can be decoded after one with it.
+
+   P1WireDecoder decoder;
+   std::vector<P1WireValue> values;
+   if (!decoder.decode(data, length, values)) puts(decoder.error);   //"schema" means: ask for it (/api.bin?schema=1)
+
+ Messages are not trusted: counts and lengths are checked against the bytes left before anything is allocated,
+ a message that is cut or has counts past its end fails with "truncated".
+ */
+#ifndef P1WIREDECODE_H
+#define P1WIREDECODE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+struct P1WireValue
+{
+  uint16_t obis[5];
+  std::string unit;
+  uint8_t type; //OBISItem::ValueType
+  uint64_t number; //Mantissa of DOUBLE, value of INT32 and INT64
+  uint8_t decimals;
+  std::string text; //CHARARR
+
+  double toDouble() const
+  {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+    return (double)number / pow10[decimals]; //Up to 18, see decode()
+  }
+};
+
+struct P1WireDecoder
+{
+  std::map<uint32_t, std::vector<P1WireValue>> schemas;
+  const char* error = "";
+  uint32_t generation = 0; //Of the last decoded message
+
+  bool decode(const uint8_t* data, int length, std::vector<P1WireValue>& values)
+  {
+    const uint8_t* end = data + length;
+    if (length < 12 || data[0] != 'P' || data[1] != '1')
+    {
+      error = "not a snapshot";
+      return false;
+    }
+    if (data[2] != 1)
+    {
+      error = "version";
+      return false;
+    }
+    uint8_t flags = data[3];
+    uint32_t id = u32(data + 4);
+    generation = u32(data + 8);
+    const uint8_t* p = data + 12;
+    bool ok = true;
+
+    if (flags & 0x01)
+    {
+      uint64_t count = varint(p, end, ok);
+      ok &= count <= (uint64_t)(end - p); //A byte each at least
+      std::vector<std::string> units(ok ? count : 0);
+      for (std::string& unit : units)
+      {
+        int n = p < end ? *p++ : 0;
+        ok &= n <= end - p;
+        if (!ok) break;
+        unit.assign((const char*)p, n);
+        p += n;
+      }
+      count = ok ? varint(p, end, ok) : 0;
+      ok &= count <= (uint64_t)(end - p);
+      std::vector<P1WireValue> schema(ok ? count : 0);
+      for (P1WireValue& v : schema)
+      {
+        ok &= p + 2 <= end;
+        if (!ok) break;
+        v.obis[0] = *p++;
+        v.obis[1] = *p++;
+        v.obis[2] = varint(p, end, ok);
+        v.obis[3] = varint(p, end, ok);
+        v.obis[4] = varint(p, end, ok);
+        uint64_t unit = varint(p, end, ok);
+        ok &= unit <= units.size();
+        if (ok && unit > 0) v.unit = units[unit - 1];
+      }
+      if (!ok)
+      {
+        error = "truncated";
+        return false;
+      }
+      schemas[id] = schema;
+    }
+
+    auto schema = schemas.find(id);
+    if (schema == schemas.end())
+    {
+      error = "schema";
+      return false;
+    }
+    if (varint(p, end, ok) != schema->second.size() || !ok) //Checked before the values are made
+    {
+      error = "truncated";
+      return false;
+    }
+    values = schema->second;
+    for (P1WireValue& v : values)
+    {
+      ok &= p < end;
+      if (!ok) break;
+      v.type = *p++;
+      switch (v.type)
+      {
+        case 1: //DOUBLE
+          ok &= p < end;
+          v.decimals = ok ? *p++ : 0;
+          v.number = varint(p, end, ok);
+          if (v.decimals > 18) //Not a value the parser makes
+          {
+            error = "malformed";
+            return false;
+          }
+          break;
+        case 2: //INT32
+        case 3: //INT64
+          v.number = varint(p, end, ok);
+          break;
+        case 5: //CHARARR
+        {
+          uint64_t n = varint(p, end, ok);
+          ok &= n <= (uint64_t)(end - p);
+          if (ok) v.text.assign((const char*)p, n);
+          p += ok ? n : 0;
+          break;
+        }
+        default:
+          break;
+      }
+    }
+    if (!ok)
+    {
+      error = "truncated";
+      return false;
+    }
+    error = "";
+    return true;
+  }
+
+  static uint32_t u32(const uint8_t* p)
+  {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  }
+
+  static uint64_t varint(const uint8_t*& p, const uint8_t* end, bool& ok)
+  {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (p >= end)
+      {
+        ok = false;
+        return 0;
+      }
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (b < 0x80)
+      {
+        return v;
+      }
+    }
+    ok = false;
+    return 0;
+  }
+};
+
+#endif // P1WIREDECODE_H
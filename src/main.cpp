@@ -41,16 +41,39 @@
 #endif
 #endif // ESP
 #include "antonp1.h"
+#include "p1json.h"
+#include "p1delta.h"
+#include "p1history.h"
+#include "p1log.h"
+#include "p1wire.h"
+#include "p1upload.h"
+#include "p1events.h"
+#include "p1derived.h"
 #include "wifisecrets.h"
-#include <ArduinoJson.h>
-#include <ESP8266HTTPClient.h>
+#include <memory>
+#include <ESPAsyncTCP.h>
+
+#ifdef MQTT_HOST //Broker to publish to, e.g. #define MQTT_HOST "192.168.1.10" in wifisecrets.h (see p1mqtt.h)
+#include <AsyncMqttClient.h>
+#include "p1mqtt.h"
+#ifndef MQTT_PORT
+#define MQTT_PORT 1883
+#endif
+#ifndef MQTT_TOPIC
+#define MQTT_TOPIC "p1/" HOST_NAME
+#endif
+#ifndef MQTT_QOS
+#define MQTT_QOS 1
+#endif
+#ifndef MQTT_PER_CODE
+#define MQTT_PER_CODE false //One retained topic per code instead of one JSON document on MQTT_TOPIC/snapshot
+#endif
+#endif
 
 
 // Predefined static config
 #define MAX_MISSED_DATA 2000          // MAX data missed from Client/Web HTTP reply before time-out (accept short messages only)
 #define MAXBUFFER   1500              // MAX buffer size of P1 Telegram
-const size_t JSON_BUFFER_SIZE = 1024; // ToDO: ADJUST based on JSON payload size to be created
-char jsonPayload[JSON_BUFFER_SIZE];
 
 #define NTP_SERVERS "pool.ntp.org", "time.nist.gov"
 
@@ -58,8 +81,11 @@ static const char* ssid = WIFI_SSID_NAME;
 static const char* password = WIFI_PASSWORD;
 
 AsyncWebServer server(80);
-long lastMillis = 0;
+AsyncEventSource events("/events");
 long lastPostMillis = 0;
+bool uploadsWork = true; //Last upload worked, see p1log.h
+unsigned long nextReplayMillis = 0;
+uint32_t bootId = 0; //Random, taken at setup, so an /api ETag from before a restart never matches
 
 // Memory allocated for the sample's variables and structures.
 static WiFiClientSecure wifi_client;
@@ -92,33 +118,76 @@ static void initializeTime()
 
 }
 
-const char* proxyUrl = "http://ns.ant.is/p1";
-
-bool postData(const char* data) {
-    WiFiClient client;
-    HTTPClient http;
+#define UPLOAD_HOST "ns.ant.is"
+#define UPLOAD_PORT 80
+#define UPLOAD_PATH "/p1"
 
-    // Get WiFi details
-    String macAddress = WiFi.macAddress();
-    String localIP = WiFi.localIP().toString();
-    int32_t rssi = WiFi.RSSI();
-    char* isvalid = "Yes";
-    if (P1valid == false)
-      isvalid = "No";
-
-    http.begin(client, proxyUrl);
+AsyncClient uploadClient;
+bool replayQueued = false;
+#ifdef P1_POST_WIRE
+uint32_t postedSchemaId = 0;
+#endif
 
-    // Add headers
-    http.addHeader("Content-Type", "text/plain");  // Or any other content type you need
-    http.addHeader("p1control-wifimac", macAddress);
-    http.addHeader("p1control-isvalid", isvalid);
-    http.addHeader("p1control-wifiip", localIP);
-    http.addHeader("p1control-wifisignal", String(rssi));
+/*
+Result of an upload (p1upload.h). A live upload that never arrived is logged (the values of now, not the
+lost ones) and the next delta becomes a keyframe, a replayed snapshot stays in the log until it arrives.
+*/
+void uploadDone(const char* format, uint32_t tag, bool ok)
+{
+  uploadsWork = ok;
+  if (strcmp(format, "snapshot") == 0)
+  {
+    if (ok)
+    {
+      p1LogReplayDone();
+    }
+    replayQueued = false;
+    return;
+  }
+  if (!ok)
+  {
+    p1LogAppend(time(NULL));
+    p1DeltaLost();
+  }
+#ifdef P1_POST_WIRE
+  else
+  {
+    postedSchemaId = tag;
+  }
+#endif
+}
 
-    int httpResponseCode = http.POST(data);
+/*
+Uploads go through p1upload.h on one kept-alive connection, the headers that do not change are built here once.
+*/
+void uploadSetup()
+{
+  char headers[128];
+  snprintf(headers, sizeof(headers), "p1control-wifimac: %s\r\np1control-wifiip: %s\r\n",
+    WiFi.macAddress().c_str(), WiFi.localIP().toString().c_str());
+  p1UploadSetup(UPLOAD_HOST, UPLOAD_PORT, UPLOAD_PATH, headers);
+  uploadClient.onData([](void*, AsyncClient*, void* data, size_t len) { p1UploadReceived((const char*)data, len); });
+  uploadClient.onDisconnect([](void*, AsyncClient*) { p1UploadClosed(); });
+  p1UploadTransport.connected = []() { return uploadClient.connected(); };
+  p1UploadTransport.connect = [](const char* host, uint16_t port) { uploadClient.connect(host, port); };
+  p1UploadTransport.space = []() { return (int)uploadClient.space(); };
+  p1UploadTransport.write = [](const char* data, int length) { return (int)uploadClient.write(data, length); };
+  p1UploadTransport.close = []() { uploadClient.close(true); };
+  p1UploadTransport.signal = []() { return (int)WiFi.RSSI(); };
+  p1UploadDone = uploadDone;
+}
 
-    http.end();
-    return httpResponseCode > 0;
+/*
+Queues an upload, kept in the log (p1log.h) if the queue is full. False then.
+*/
+bool postData(const char* data, int length, const char* format, uint32_t tag)
+{
+  if (p1UploadQueue(data, length, format, tag))
+  {
+    return true;
+  }
+  p1LogAppend(time(NULL));
+  return false;
 }
 
 static char* getCurrentLocalTimeString()
@@ -181,56 +250,22 @@ char* printNetworkInfo() {
 
 
 
-char* buildJSONPayload() {
-  StaticJsonDocument<JSON_BUFFER_SIZE> doc;
-
-  // Populate the Device section
-  JsonObject device = doc.createNestedObject("Device");
-  device["Uptime"] = millis();
-  device["HFB"] = ESP.getFreeHeap();
-  device["HFPct"] = ESP.getHeapFragmentation();
-  device["Version"] = "1.0.0";
-  device["Name"] = HOST_NAME;
-
-  // Populate the OBIS array
-  JsonArray obisArray = doc.createNestedArray("OBIS");
-
-  OBISItem* item = p1parsed->items;
-
-  //TODO: Probably we should have some logic to allow filters and grouping by devices (in case of subdevices)
-  while (item != nullptr)
-  {
-    JsonObject obj = obisArray.createNestedObject(); 
-    
-    obj["Code"] = item->getObisCode();
-    if (item->type == OBISItem::DOUBLE) 
-    {
-      obj["DValue"] = item->value.dValue;
-    } 
-    else if (item->type == OBISItem::INT32) 
-    {
-      obj["IValue"] = item->value.i32Value;
-    }
-    else if (item->type == OBISItem::CHARARR) 
-    {
-      obj["SValue"] = item->value.stringValue;
-    }    
-    if (item->unit != nullptr) 
-    {
-      obj["Unit"] = item->unit->unitstr;
-    }
-    item = item->next;
-  }
-  // Serialize the JSON document into the buffer
-  serializeJson(doc, jsonPayload, sizeof(jsonPayload));
-
-  return jsonPayload;
+/*
+Device stats for /device, e.g. {"Uptime":52798,"HFB":20000,...} - kept out of /api so it can be cached.
+*/
+void buildDeviceJSON(char* out, size_t size)
+{
+  snprintf(out, size,
+    "{\"Uptime\":%lu,\"HFB\":%lu,\"HFPct\":%u,\"Items\":%d,\"Units\":%d,\"StrBytes\":%d,\"AllocFail\":%d,"
+    "\"Version\":\"1.0.0\",\"Name\":\"" HOST_NAME "\"}",
+    millis(), (unsigned long)ESP.getFreeHeap(), (unsigned)ESP.getHeapFragmentation(),
+    p1parsed->itemCount, unitCount, stringArenaUsed, p1AllocFailures); //Pool high-water marks, see P1_MAXITEMS etc.
 }
 
 void webserverSetup()
 {
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-      request->send(200, "text/html", "Hello, welcome to P1 Module.<br /><a href='/api'>API Payload</a>");
+      request->send(200, "text/html", "Hello, welcome to P1 Module.<br /><a href='/api'>API Payload</a><br /><a href='/device'>Device</a><br /><a href='/events'>Live events</a><br /><a href='/history?code=1.7.0&res=60'>History</a>");
   });
 
     //Send OBIS payload as JSON
@@ -238,15 +273,154 @@ void webserverSetup()
       request->send(200, "application/json", printNetworkInfo());
   });
 
-  //Send OBIS payload as JSON
+  //Send OBIS payload as JSON, the copy cached for the current telegram (p1JsonCache) tagged with the boot and its
+  //generation, 304 if the poller has it already. The response holds the copy until it is sent, so it is never cut.
+  //Streamed from the items if it did not fit the cache.
   server.on("/api", HTTP_GET, [](AsyncWebServerRequest *request){
-      request->send(200, "application/json", buildJSONPayload());
+      std::shared_ptr<P1JsonCacheHold> hold = std::make_shared<P1JsonCacheHold>();
+      AsyncWebServerResponse *response;
+      if (p1JsonCacheHold(*hold))
+      {
+          uint32_t generation = p1JsonCache.generation[hold->buffer].load();
+          char etag[24];
+          snprintf(etag, sizeof(etag), "\"%lu-%lu\"", (unsigned long)bootId, (unsigned long)generation);
+          if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag)
+          {
+              response = request->beginResponse(304);
+          }
+          else
+          {
+              response = request->beginChunkedResponse("application/json", [hold](uint8_t *out, size_t maxLen, size_t index) -> size_t {
+                  return p1JsonCacheRead(*hold, (char*)out, maxLen, index);
+              });
+          }
+          response->addHeader("ETag", etag);
+          response->addHeader("Cache-Control", "no-cache");
+      }
+      else
+      {
+          std::shared_ptr<P1JsonStream> stream = std::make_shared<P1JsonStream>();
+          p1JsonBegin(*stream, "{\"OBIS\":[", "}", P1F_API);
+          response = request->beginChunkedResponse("application/json", [stream](uint8_t *out, size_t maxLen, size_t index) -> size_t {
+              return p1JsonRead(*stream, (char*)out, maxLen);
+          });
+      }
+      request->send(response);
+  });
+
+  server.on("/device", HTTP_GET, [](AsyncWebServerRequest *request){
+      char device[256];
+      buildDeviceJSON(device, sizeof(device));
+      request->send(200, "application/json", device);
+  });
+
+  //Binary snapshot (p1wire.h), /api.bin?schema=1 includes the codes and units
+  server.on("/api.bin", HTTP_GET, [](AsyncWebServerRequest *request){
+      static uint8_t wire[P1_WIRE_BUFFER];
+      uint32_t schemaId;
+      int len = p1WireEncode(wire, sizeof(wire), request->hasParam("schema"), &schemaId, P1F_API);
+      if (len < 0)
+      {
+          request->send(500, "text/plain", "Snapshot too large");
+          return;
+      }
+      AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+      response->write(wire, len);
+      request->send(response);
+  });
+
+  //History of a code as JSON, e.g. /history?code=1.7.0&res=60 (res 60 or 900 for min/avg/max rollups, else the samples)
+  server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request){
+      String code = request->hasParam("code") ? request->getParam("code")->value() : String("1.7.0");
+      int res = request->hasParam("res") ? request->getParam("res")->value().toInt() : 0;
+      std::shared_ptr<P1HistoryStream> stream = std::make_shared<P1HistoryStream>();
+      if (!p1HistoryBegin(*stream, code.c_str(), res))
+      {
+          request->send(404, "application/json", "{\"error\":\"No history for this code\"}");
+          return;
+      }
+      request->send(request->beginChunkedResponse("application/json", [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          return p1HistoryRead(*stream, (char*)buffer, maxLen);
+      }));
   });
 
+  //Live values (p1events.h), all items on connect and then the changed ones after each telegram
+  events.onConnect([](AsyncEventSourceClient *client){
+      static char frame[P1_EVENTS_BUFFER];
+      int len = p1EventsBuild(frame, sizeof(frame), true);
+      if (len > 0)
+      {
+          client->send(frame, "snapshot", p1SnapshotGeneration());
+      }
+  });
+  server.addHandler(&events);
+
   AsyncElegantOTA.begin(&server,"admin","p1anton"); //access to update / change firmware on ESP
   server.begin();
 }
 
+#ifdef MQTT_HOST
+AsyncMqttClient mqttClient;
+unsigned long mqttConnectMillis = 0;
+unsigned long mqttSnapshotMillis = 0;
+
+void mqttSetup()
+{
+  mqttClient.setServer(MQTT_HOST, MQTT_PORT);
+  mqttClient.setClientId(HOST_NAME);
+#ifdef MQTT_USER
+  mqttClient.setCredentials(MQTT_USER, MQTT_PASSWORD);
+#endif
+  mqttClient.onPublish([](uint16_t packetId) { p1MqttAckReceived(packetId); });
+  p1MqttTransport.connected = []() { return mqttClient.connected(); };
+  p1MqttTransport.publish = [](const char* topic, uint8_t qos, bool retain, const char* payload, int length) -> uint16_t {
+    return mqttClient.publish(topic, qos, retain, payload, length);
+  };
+}
+
+/*
+Connects in the background (retried every 5 s), queues a snapshot every P1_MQTT_INTERVAL and drains the queue.
+*/
+void mqttLoop()
+{
+  if (!mqttClient.connected() && millis() > mqttConnectMillis)
+  {
+    mqttClient.connect();
+    mqttConnectMillis = millis() + 5000;
+  }
+  if (millis() > mqttSnapshotMillis && P1valid && !p1IsReading())
+  {
+    p1MqttSnapshot(MQTT_TOPIC, MQTT_QOS, MQTT_PER_CODE);
+    mqttSnapshotMillis = millis() + P1_MQTT_INTERVAL;
+  }
+  p1MqttDrain();
+}
+#endif
+
+#ifdef P1_TIMING
+/*
+Timing report over telnet (port 23), printed after each telegram. Build with -D P1_TIMING.
+*/
+WiFiServer telnetServer(23);
+WiFiClient telnetClient;
+uint32_t telnetReportedTelegrams = 0;
+
+void telnetTimingLoop()
+{
+  if (telnetServer.hasClient())
+  {
+    telnetClient = telnetServer.available();
+  }
+  if (telnetClient && telnetClient.connected() && p1Timers[P1T_TELEGRAM].calls != telnetReportedTelegrams)
+  {
+    static char report[256];
+    int len = p1TimingReport(report, sizeof(report));
+    telnetClient.write((const uint8_t*)report, len);
+    telnetReportedTelegrams = p1Timers[P1T_TELEGRAM].calls;
+  }
+}
+#endif
+
 void setup()
 {
   connectToWiFi();
@@ -263,25 +437,91 @@ void setup()
     MDNS.addService("telnet", "tcp", 23);
 #endif
 
+  bootId = random(0x7FFFFFFF); //Hardware random number generator on ESP8266 and ESP32
 
   webserverSetup();
 
   p1setup(); //Setup P1 DMRS reader
+  p1DerivedSetup(); //Net power, phase sums, interval energy, see p1derived.h
+  p1HistorySetup();
+  p1LogSetup();
+  uploadSetup();
+#ifdef MQTT_HOST
+  mqttSetup();
+#endif
+#ifdef P1_TIMING
+  telnetServer.begin();
+#endif
 }
 
-
 void loop()
 {
-  if (millis() > lastMillis + 5000) //Update parsing every 5s
+  p1loop(); //Reads the telegram in chunks, never blocks
+  p1JsonCacheUpdate(); //The /api document of the newest telegram, once no response holds the buffer it goes to
+  static uint32_t historyGeneration = 0;
+  if (p1Generation != historyGeneration) //New valid telegram
   {
-    p1ReadAndParseNow();
-    lastMillis = millis();
+    p1HistoryAdd(time(NULL));
+    historyGeneration = p1Generation;
+    if (events.count() > 0)
+    {
+      static char frame[P1_EVENTS_BUFFER];
+      int len = p1EventsBuild(frame, sizeof(frame), false);
+      if (len > 0)
+      {
+        events.send(frame, "changes", historyGeneration); //Formatted once, the same bytes go to every subscriber
+      }
+    }
+    else
+    {
+      p1EventsReset();
+    }
   }
+#ifdef P1_TIMING
+  telnetTimingLoop();
+#endif
+#ifdef MQTT_HOST
+  mqttLoop();
+#endif
 
-  if (millis() > lastPostMillis + 120000)
+  if (millis() > lastPostMillis + 120000 && !p1IsReading()) //Only post a complete telegram
   {  
-    postData(P1buffer);
+#ifdef P1_POST_WIRE
+    //Binary snapshot (p1wire.h), with the schema until the receiver has taken one with it
+    static uint8_t wireBody[P1_WIRE_BUFFER];
+    uint32_t schemaId;
+    int len = p1WireEncode(wireBody, sizeof(wireBody), false, &schemaId, P1F_UPLOAD);
+    if (schemaId != postedSchemaId)
+    {
+      len = p1WireEncode(wireBody, sizeof(wireBody), true, &schemaId, P1F_UPLOAD);
+    }
+    if (len > 0)
+    {
+      postData((const char*)wireBody, len, "wire", schemaId); //postedSchemaId is set when it arrives
+    }
+#else
+    //Only the values that changed since the last upload, the whole telegram now and then (see p1delta.h)
+    static char deltaBody[P1_DELTA_BUFFER];
+    int len = p1DeltaKeyframeDue() ? -1 : p1DeltaBuild(deltaBody, sizeof(deltaBody));
+    bool keyframe = len < 0;
+    if (keyframe && !(P1valid && P1length > 0))
+    {
+      len = 0; //No valid telegram to send as the keyframe yet
+    }
+    if (len != 0 && postData(keyframe ? P1buffer : deltaBody, keyframe ? P1length : len, keyframe ? "telegram" : "delta", 0))
+    {
+      p1DeltaAccept(keyframe); //Now, while the values are the ones in the upload, p1DeltaLost() if it never arrives
+    }
+#endif
     lastPostMillis = millis();
   }
+
+  //Replay of logged snapshots, one at a time while uploads work
+  if (uploadsWork && !replayQueued && millis() > nextReplayMillis && !p1IsReading())
+  {
+    replayQueued = p1LogReplayQueue();
+    nextReplayMillis = millis() + 1000;
+  }
+  p1UploadPoll();
   delay(10);
 }
@@ -0,0 +1,212 @@
+/*
+ Change-only uploads. Instead of posting the raw telegram every time, only the OBIS values that changed more
+ than their deadband since the last accepted upload are posted, with the whole telegram (keyframe) every
+ P1_DELTA_KEYFRAME uploads and whenever the receiver has not acknowledged one yet. A keyframe is the telegram as
+ the meter sent it, so the derived values (C from 128) follow in the next delta.
+
+ A delta uses the telegram's own line format, so the receiver can parse both the same way:
+   /delta\r\n
+   0-0:1.0.0(230510155237S)\r\n
+   1-0:1.7.0(1.193*kW)\r\n
+   !\r\n
+
+   int len = p1DeltaKeyframeDue() ? -1 : p1DeltaBuild(body, sizeof(body));
+   if (len != 0 && post(len < 0 ? P1buffer : body)) p1DeltaAccept(len < 0);   //p1DeltaLost() if it fails later
+ */
+#ifndef P1DELTA_H
+#define P1DELTA_H
+
+#include "antonp1.h"
+
+#ifndef P1_DELTA_KEYFRAME
+#define P1_DELTA_KEYFRAME 30 //Uploads between keyframes, one hour at the 120 s upload interval
+#endif
+
+#ifndef P1_DELTA_BUFFER
+#define P1_DELTA_BUFFER 512 //Largest delta, a keyframe is sent instead when the changes do not fit
+#endif
+
+/*
+Deadband for OBIS codes C.D (any E). A value is sent when it differs more than the band from the last sent value,
+0 sends any change and a negative band never triggers an upload but is sent along with other changes (e.g. the time).
+Codes not listed use 0.
+*/
+struct P1DeltaBand
+{
+  uint8_t c;
+  uint8_t d;
+  double band;
+};
+
+static const P1DeltaBand p1DeltaBands[] = {
+  {0, 1, -1},     //0-0:1.0.0 Time of the telegram
+  {1, 7, 0.050},  //Power, kW
+  {2, 7, 0.050},
+  {3, 7, 0.050},  //Reactive power, kvar
+  {4, 7, 0.050},
+  {21, 7, 0.050}, //Power per phase
+  {41, 7, 0.050},
+  {61, 7, 0.050},
+  {22, 7, 0.050},
+  {42, 7, 0.050},
+  {62, 7, 0.050},
+  {32, 7, 2.0},   //Voltage per phase, V
+  {52, 7, 2.0},
+  {72, 7, 2.0},
+  {128, 7, 0.050}, //Derived power, see p1derived.h
+  {129, 7, 0.050},
+  {130, 7, 0.050},
+  {131, 7, 0.050},
+  {132, 7, 0.050},
+  {133, 7, 0.050},
+  {128, 8, -1},    //Energy since the last telegram, only along with other changes
+  {129, 8, -1},
+};
+
+double p1DeltaBand(OBISItem* item)
+{
+  for (const P1DeltaBand& b : p1DeltaBands)
+  {
+    if (b.c == item->obis[2] && b.d == item->obis[3])
+    {
+      return b.band;
+    }
+  }
+  return 0;
+}
+
+/*
+Last value the receiver has, per item of the pool.
+*/
+struct P1DeltaSent
+{
+  bool sent;
+  uint8_t type;
+  double number; //DOUBLE and integer values
+  uint32_t hash; //String values
+};
+
+P1DeltaSent p1DeltaSent[P1_MAXITEMS];
+uint16_t p1DeltaUploads = 0; //Deltas accepted since the last keyframe
+bool p1DeltaHasKeyframe = false;
+
+uint32_t p1DeltaHash(const char* str)
+{
+  uint32_t hash = 2166136261u; //FNV-1a
+  for (; *str != '\0'; str++)
+  {
+    hash = (hash ^ (uint8_t)*str) * 16777619u;
+  }
+  return hash;
+}
+
+double p1DeltaNumber(const OBISItem::ValueSlot& v)
+{
+  switch (v.type)
+  {
+    case OBISItem::DOUBLE:
+      return v.getDouble();
+    case OBISItem::INT32:
+      return v.value.i32Value;
+    case OBISItem::INT64:
+      return (double)v.value.i64Value;
+    default:
+      return 0;
+  }
+}
+
+/*
+True if the item's current value is outside its deadband from what was last sent.
+Negative bands are reported through p1DeltaBuild only along with other changes.
+*/
+bool p1DeltaChanged(OBISItem* item, double band)
+{
+  const OBISItem::ValueSlot& v = item->current();
+  P1DeltaSent& s = p1DeltaSent[item - p1parsed->pool];
+  if (v.type == OBISItem::NONE)
+  {
+    return false;
+  }
+  if (!s.sent || s.type != v.type)
+  {
+    return true;
+  }
+  if (v.type == OBISItem::CHARARR)
+  {
+    return s.hash != p1DeltaHash(v.value.stringValue);
+  }
+  double diff = p1DeltaNumber(v) - s.number;
+  return diff > band || -diff > band;
+}
+
+bool p1DeltaKeyframeDue()
+{
+  return !p1DeltaHasKeyframe || p1DeltaUploads >= P1_DELTA_KEYFRAME;
+}
+
+/*
+Writes the delta into out. Returns its length, 0 if nothing changed (no upload needed)
+or -1 if it does not fit, then a keyframe should be sent instead.
+*/
+int p1DeltaBuild(char* out, int size)
+{
+  int len = snprintf(out, size, "/delta\r\n");
+  bool changed = false;
+  for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+  {
+    double band = p1DeltaBand(item);
+    if (!(item->outputs & (1 << P1F_UPLOAD)) || !p1DeltaChanged(item, band < 0 ? 0 : band))
+    {
+      continue;
+    }
+    changed |= band >= 0;
+    char value[P1_MAXVALUE + 24];
+    p1FormatValue(item->current(), value, sizeof(value));
+    len += snprintf(out + len, size > len ? size - len : 0, "%d-%d:%s(%s%s%s)\r\n", item->obis[0], item->obis[1], item->getObisCode(),
+      value, item->unit != nullptr ? "*" : "", item->unit != nullptr ? item->unit->unitstr : "");
+  }
+  if (!changed)
+  {
+    return 0;
+  }
+  len += snprintf(out + len, size > len ? size - len : 0, "!\r\n");
+  return len < size ? len : -1;
+}
+
+/*
+The receiver got the upload, remember what it has. Must be called before the next telegram is parsed,
+so the values are the ones p1DeltaBuild saw.
+*/
+void p1DeltaAccept(bool keyframe)
+{
+  for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+  {
+    double band = p1DeltaBand(item);
+    if (!(item->outputs & (1 << P1F_UPLOAD)) || (!keyframe && !p1DeltaChanged(item, band < 0 ? 0 : band)))
+    {
+      continue;
+    }
+    if (keyframe && item->obis[2] >= 128)
+    {
+      continue; //Derived values (p1derived.h) are not in the raw telegram, the next delta sends them
+    }
+    const OBISItem::ValueSlot& v = item->current();
+    P1DeltaSent& s = p1DeltaSent[item - p1parsed->pool];
+    s.sent = v.type != OBISItem::NONE;
+    s.type = v.type;
+    s.number = p1DeltaNumber(v);
+    s.hash = v.type == OBISItem::CHARARR ? p1DeltaHash(v.value.stringValue) : 0;
+  }
+  p1DeltaUploads = keyframe ? 0 : p1DeltaUploads + 1;
+  p1DeltaHasKeyframe |= keyframe;
+}
+
+/*
+An accepted upload never arrived, the next one is a keyframe so the receiver has every value again.
+*/
+void p1DeltaLost()
+{
+  p1DeltaHasKeyframe = false;
+}
+
+#endif // P1DELTA_H
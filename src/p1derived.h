@@ -0,0 +1,304 @@
+/*
+ Derived values computed on the device from each valid telegram, so the receiver does not have to turn
+ registers into power or add up phases. They are virtual items of the meter (1-0, C from 128, the
+ manufacturer specific range) in the same item pool as the parsed ones, so every output (/api, /events,
+ MQTT, uploads, the wire format and the filters) has them next to the raw codes. The exception is the upload
+ keyframe, which is the telegram as the meter sent it (see p1delta.h):
+
+   1-0:128.7.0  Net import power, 1.7.0 - 2.7.0 (0 when exporting)        kW
+   1-0:129.7.0  Net export power, 2.7.0 - 1.7.0 (0 when importing)        kW
+   1-0:130.7.0  Import power of the phases, 21.7.0 + 41.7.0 + 61.7.0       kW
+   1-0:131.7.0  Export power of the phases, 22.7.0 + 42.7.0 + 62.7.0       kW
+   1-0:128.8.0  Energy imported since the last telegram (1.8.1 + 1.8.2)   kWh
+   1-0:129.8.0  Energy exported since the last telegram (2.8.1 + 2.8.2)   kWh
+   1-0:132.7.0  Average import power since the last telegram, from the registers   kW
+   1-0:133.7.0  Rolling average of 1.7.0 over the last P1_DERIVED_WINDOW telegrams   kW
+
+ Each rule reads up to three items, found once by their key and kept as pointers, looked for again only when
+ the pool has new items. Updating all rules is a fixed amount of work per telegram, the rolling average keeps
+ a running sum. Values are fixed point with P1_DERIVED_DECIMALS decimals, the mantissa has no sign so the net
+ values are split into an import and an export code. Time between telegrams is from their 0-0:1.0.0 time
+ when the meter sends it (summer time S taken back to winter time W), else from when they were read.
+
+   p1DerivedSetup();   //After p1setup(), the rules then run with every valid telegram
+ */
+#ifndef P1DERIVED_H
+#define P1DERIVED_H
+
+#include "antonp1.h"
+
+#ifndef P1_DERIVED_WINDOW
+#define P1_DERIVED_WINDOW 30 //Telegrams in the rolling average, 5 min at 10 s
+#endif
+
+#ifndef P1_DERIVED_DECIMALS
+#define P1_DERIVED_DECIMALS 3
+#endif
+
+#ifndef P1_DERIVED_AVERAGES
+#define P1_DERIVED_AVERAGES 1 //Rules with a rolling average, each keeps P1_DERIVED_WINDOW values
+#endif
+
+#define P1_DERIVED_KEY(c, d, e) (((uint64_t)1 << 56) | ((uint64_t)(c) << 32) | ((uint64_t)(d) << 16) | (uint64_t)(e)) //1-0:C.D.E
+
+enum P1DerivedOp
+{
+  P1D_SUM, //Of the inputs there are
+  P1D_DIFF, //First input minus the second, 0 if below
+  P1D_DELTA, //Increase of the sum since the last telegram
+  P1D_RATE, //Increase of the sum (kWh) per hour (kW)
+  P1D_AVERAGE //Of the first input over the last P1_DERIVED_WINDOW telegrams
+};
+
+struct P1DerivedRule
+{
+  uint16_t code[3]; //C.D.E of the derived item
+  P1DerivedOp op;
+  uint64_t inputs[3]; //Keys, 0 for none
+  uint64_t fallback; //Read instead when the meter has none of the inputs (e.g. 1.8.0 without tariffs)
+  const char* unit;
+};
+
+static const P1DerivedRule p1DerivedRules[] = {
+  {{128, 7, 0}, P1D_DIFF, {P1_DERIVED_KEY(1, 7, 0), P1_DERIVED_KEY(2, 7, 0)}, 0, "kW"},
+  {{129, 7, 0}, P1D_DIFF, {P1_DERIVED_KEY(2, 7, 0), P1_DERIVED_KEY(1, 7, 0)}, 0, "kW"},
+  {{130, 7, 0}, P1D_SUM, {P1_DERIVED_KEY(21, 7, 0), P1_DERIVED_KEY(41, 7, 0), P1_DERIVED_KEY(61, 7, 0)}, 0, "kW"},
+  {{131, 7, 0}, P1D_SUM, {P1_DERIVED_KEY(22, 7, 0), P1_DERIVED_KEY(42, 7, 0), P1_DERIVED_KEY(62, 7, 0)}, 0, "kW"},
+  {{128, 8, 0}, P1D_DELTA, {P1_DERIVED_KEY(1, 8, 1), P1_DERIVED_KEY(1, 8, 2)}, P1_DERIVED_KEY(1, 8, 0), "kWh"},
+  {{129, 8, 0}, P1D_DELTA, {P1_DERIVED_KEY(2, 8, 1), P1_DERIVED_KEY(2, 8, 2)}, P1_DERIVED_KEY(2, 8, 0), "kWh"},
+  {{132, 7, 0}, P1D_RATE, {P1_DERIVED_KEY(1, 8, 1), P1_DERIVED_KEY(1, 8, 2)}, P1_DERIVED_KEY(1, 8, 0), "kW"},
+  {{133, 7, 0}, P1D_AVERAGE, {P1_DERIVED_KEY(1, 7, 0)}, 0, "kW"},
+};
+
+#define P1_DERIVED_RULES (int)(sizeof(p1DerivedRules) / sizeof(p1DerivedRules[0]))
+
+/*
+A rule compiled against the item pool, and what it keeps between telegrams.
+*/
+struct P1DerivedState
+{
+  OBISItem* inputs[3];
+  OBISItem* output; //Created once one of the inputs is there
+  bool fallback; //Inputs[0] is the fallback item
+  bool hasLast;
+  uint64_t last; //Sum at the last telegram, for DELTA and RATE
+  unsigned long lastMillis;
+  int8_t window; //Index in p1DerivedWindows for AVERAGE, -1 if there was none left
+};
+
+struct P1DerivedWindow
+{
+  uint32_t values[P1_DERIVED_WINDOW];
+  uint64_t sum;
+  uint16_t count;
+  uint16_t pos;
+};
+
+P1DerivedState p1DerivedStates[P1_DERIVED_RULES];
+P1DerivedWindow p1DerivedWindows[P1_DERIVED_AVERAGES];
+int p1DerivedItemCount = -1; //Items listed when the rules were compiled, see ParsedOBIS::listedCount
+
+/*
+Finds the items of the rules, only the ones still missing. Runs again only when the pool has grown.
+*/
+void p1DerivedCompile()
+{
+  int windows = 0;
+  for (int r = 0; r < P1_DERIVED_RULES; r++)
+  {
+    const P1DerivedRule& rule = p1DerivedRules[r];
+    P1DerivedState& state = p1DerivedStates[r];
+    if (rule.op == P1D_AVERAGE && p1DerivedItemCount < 0)
+    {
+      state.window = windows < P1_DERIVED_AVERAGES ? windows++ : -1;
+    }
+    bool any = false;
+    for (int i = 0; i < 3; i++)
+    {
+      if (state.fallback)
+      {
+        break;
+      }
+      if (rule.inputs[i] != 0 && state.inputs[i] == nullptr)
+      {
+        state.inputs[i] = p1parsed->findOBISItem(rule.inputs[i]);
+      }
+      any |= state.inputs[i] != nullptr;
+    }
+    if (!any && rule.fallback != 0)
+    {
+      state.inputs[0] = p1parsed->findOBISItem(rule.fallback);
+      state.fallback = state.inputs[0] != nullptr;
+      any = state.fallback;
+    }
+    if (any && state.output == nullptr && (rule.op != P1D_AVERAGE || state.window >= 0))
+    {
+      uint16_t obis[5] = {1, 0, rule.code[0], rule.code[1], rule.code[2]};
+      state.output = p1parsed->findOrCreatOBISItem(obis);
+      if (state.output != nullptr)
+      {
+        state.output->setUnitType(*p1parsed, rule.unit, 0, strlen(rule.unit));
+      }
+    }
+  }
+  p1DerivedItemCount = p1parsed->listedCount;
+}
+
+/*
+Value of an input in the telegram being committed (or its last one if it was not in it), with
+P1_DERIVED_DECIMALS decimals. False if there is none.
+*/
+bool p1DerivedInput(OBISItem* item, uint64_t& value)
+{
+  if (item == nullptr)
+  {
+    return false;
+  }
+  const OBISItem::ValueSlot& v = item->isPending ? p1Decoded(item->parsing()) : item->current();
+  uint64_t mantissa;
+  int decimals;
+  switch (v.type)
+  {
+    case OBISItem::DOUBLE:
+      mantissa = v.value.fixed.mantissa;
+      decimals = v.value.fixed.decimals;
+      break;
+    case OBISItem::INT32:
+      mantissa = v.value.i32Value;
+      decimals = 0;
+      break;
+    case OBISItem::INT64:
+      mantissa = v.value.i64Value;
+      decimals = 0;
+      break;
+    default:
+      return false;
+  }
+  for (; decimals < P1_DERIVED_DECIMALS; decimals++) mantissa *= 10;
+  for (; decimals > P1_DERIVED_DECIMALS; decimals--) mantissa /= 10;
+  value = mantissa;
+  return true;
+}
+
+/*
+Time of the telegram in ms from its 0-0:1.0.0 (YYMMDDhhmmssX), counted from 2000, or p1Millis() without it.
+Summer time (X is S) is taken back one hour to winter time, so the intervals stay right when the clock changes.
+*/
+unsigned long p1DerivedMillis()
+{
+  static OBISItem* time = nullptr;
+  if (time == nullptr)
+  {
+    time = p1parsed->findOBISItem(0x0000000100000000ull); //0-0:1.0.0
+  }
+  if (time == nullptr || !time->isPending || p1Decoded(time->parsing()).type != OBISItem::CHARARR)
+  {
+    return p1Millis();
+  }
+  const char* s = time->parsing().value.stringValue;
+  int n[6];
+  for (int i = 0; i < 6; i++)
+  {
+    if (s[2 * i] < '0' || s[2 * i] > '9' || s[2 * i + 1] < '0' || s[2 * i + 1] > '9')
+    {
+      return p1Millis();
+    }
+    n[i] = (s[2 * i] - '0') * 10 + s[2 * i + 1] - '0';
+  }
+  static const uint16_t monthDays[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  int month = n[1] >= 1 && n[1] <= 12 ? n[1] - 1 : 0;
+  long days = n[0] * 365L + (n[0] + 3) / 4 + monthDays[month] + n[2] - 1 + (month > 1 && n[0] % 4 == 0);
+  long seconds = ((days * 24 + n[3]) * 60 + n[4]) * 60 + n[5] - (s[12] == 'S' ? 3600 : 0);
+  return (unsigned long)seconds * 1000;
+}
+
+/*
+Runs the rules on the telegram being committed, see P1Parser::beforeCommit.
+*/
+void p1DerivedUpdate()
+{
+  if (p1parsed->listedCount != p1DerivedItemCount)
+  {
+    p1DerivedCompile();
+  }
+  unsigned long now = p1DerivedMillis();
+  for (int r = 0; r < P1_DERIVED_RULES; r++)
+  {
+    const P1DerivedRule& rule = p1DerivedRules[r];
+    P1DerivedState& state = p1DerivedStates[r];
+    if (state.output == nullptr)
+    {
+      continue;
+    }
+    uint64_t values[3] = {}, sum = 0;
+    bool has[3], any = false;
+    for (int i = 0; i < 3; i++)
+    {
+      has[i] = p1DerivedInput(state.inputs[i], values[i]);
+      sum += has[i] ? values[i] : 0;
+      any |= has[i];
+    }
+    if (!any)
+    {
+      continue;
+    }
+    uint64_t result;
+    switch (rule.op)
+    {
+      case P1D_SUM:
+        result = sum;
+        break;
+      case P1D_DIFF:
+        result = values[0] > values[1] ? values[0] - values[1] : 0;
+        break;
+      case P1D_DELTA:
+      case P1D_RATE:
+      {
+        bool first = !state.hasLast;
+        uint64_t delta = sum >= state.last ? sum - state.last : 0; //Registers reset (new meter), start again
+        long elapsed = now - state.lastMillis;
+        state.hasLast = true;
+        state.last = sum;
+        state.lastMillis = now;
+        if (first || (rule.op == P1D_RATE && elapsed <= 0))
+        {
+          continue; //Nothing to compare with yet
+        }
+        result = rule.op == P1D_DELTA ? delta : delta * 3600000 / elapsed; //kWh per ms to kW, same decimals
+        break;
+      }
+      case P1D_AVERAGE:
+      {
+        P1DerivedWindow& w = p1DerivedWindows[state.window];
+        uint32_t value = values[0] < 0xFFFFFFFF ? values[0] : 0xFFFFFFFF;
+        if (w.count == P1_DERIVED_WINDOW)
+        {
+          w.sum -= w.values[w.pos];
+        }
+        else
+        {
+          w.count++;
+        }
+        w.values[w.pos] = value;
+        w.sum += value;
+        w.pos = (w.pos + 1) % P1_DERIVED_WINDOW;
+        result = (w.sum + w.count / 2) / w.count;
+        break;
+      }
+      default:
+        continue;
+    }
+    OBISItem::ValueSlot& slot = state.output->parsing();
+    slot.type = OBISItem::DOUBLE;
+    slot.value.fixed.mantissa = result;
+    slot.value.fixed.decimals = P1_DERIVED_DECIMALS;
+    p1MarkPending(state.output);
+  }
+}
+
+void p1DerivedSetup()
+{
+  p1main.beforeCommit = [](P1Parser&) { p1DerivedUpdate(); };
+}
+
+#endif // P1DERIVED_H
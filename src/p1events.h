@@ -0,0 +1,125 @@
+/*
+ Live push of new telegrams to dashboards (Server-Sent Events at /events), instead of polling /api.
+
+ After each telegram loop() builds one frame with only the items whose value changed since the last frame
+ and sends it to every subscriber, so the cost is one serialization per telegram whatever the number of
+ viewers. A new subscriber first gets a frame with all items. With no subscribers nothing is built, the
+ next changed frame then has all items again. Frames are JSON in the /api format (see p1json.h):
+   {"Generation":1234,"OBIS":[{"Code":"1.7.0","DValue":1.193,"Unit":"kW"}],"Channels":{"0-1":[...]}}
+ When the last frame was of the telegram before, items the parser did not mark changed are not compared.
+ */
+#ifndef P1EVENTS_H
+#define P1EVENTS_H
+
+#include "antonp1.h"
+#include "p1json.h"
+
+#ifndef P1_EVENTS_BUFFER
+#define P1_EVENTS_BUFFER 2048 //Largest frame, all items of a big telegram
+#endif
+
+uint32_t p1EventsHashes[P1_MAXITEMS]; //Of each value in the last frame, per pool index
+bool p1EventsSent[P1_MAXITEMS];
+uint32_t p1EventsGeneration = 0; //Of the last changed frame
+
+/*
+Forgets what was sent, the next changed frame has all items.
+*/
+void p1EventsReset()
+{
+  memset(p1EventsSent, 0, sizeof(p1EventsSent));
+}
+
+uint32_t p1EventsHash(const OBISItem::ValueSlot& v)
+{
+  uint32_t hash = (2166136261u ^ v.type) * 16777619u; //FNV-1a
+  uint64_t number = 0;
+  switch (v.type)
+  {
+    case OBISItem::DOUBLE:
+      number = v.value.fixed.mantissa;
+      hash = (hash ^ v.value.fixed.decimals) * 16777619u;
+      break;
+    case OBISItem::INT32:
+      number = v.value.i32Value;
+      break;
+    case OBISItem::INT64:
+      number = v.value.i64Value;
+      break;
+    case OBISItem::CHARARR:
+      for (const char* c = v.value.stringValue; *c != '\0'; c++)
+      {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+      }
+      return hash;
+    default:
+      return hash;
+  }
+  for (int i = 0; i < 8; i++)
+  {
+    hash = (hash ^ (uint8_t)(number >> (8 * i))) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+Writes a frame into out: all items (for a new subscriber, may run in the web server's context) or the ones
+that changed since the last changed frame (from loop()). Returns its length, 0 if nothing changed or -1 if
+it does not fit.
+*/
+int p1EventsBuild(char* out, int size, bool all)
+{
+  uint32_t generation = p1SnapshotGeneration();
+  bool previous = generation == p1EventsGeneration + 1; //Last frame was of the telegram before, see OBISItem::changed
+  int len = snprintf(out, size, "{\"Generation\":%lu,\"OBIS\":[", (unsigned long)generation);
+  bool first = true, none = true, channels = false;
+  uint16_t channel = 0;
+  for (OBISItem* item = p1NextGrouped(nullptr, 1 << P1F_API); item != nullptr && len < size; item = p1NextGrouped(item, 1 << P1F_API))
+  {
+    if (!all)
+    {
+      int index = item - p1parsed->pool;
+      if (previous && p1EventsSent[index] && !item->changed)
+      {
+        continue;
+      }
+      uint32_t hash = p1EventsHash(item->current());
+      if (p1EventsSent[index] && p1EventsHashes[index] == hash)
+      {
+        continue;
+      }
+      p1EventsSent[index] = true;
+      p1EventsHashes[index] = hash;
+    }
+    if (p1Channel(item) > 0xFF && (!channels || p1Channel(item) != channel)) //Sub-device, see p1JsonChannel()
+    {
+      len += p1JsonChannel(item, !channels, out + len, size - len);
+      channels = true;
+      channel = p1Channel(item);
+      first = true;
+    }
+    len += len < size ? p1JsonItem(item, first, out + len, size - len) : 0;
+    first = false;
+    none = false;
+  }
+  if (!all)
+  {
+    p1EventsGeneration = generation;
+  }
+  if (none && !all)
+  {
+    return 0;
+  }
+  len += snprintf(out + len, size > len ? size - len : 0, channels ? "]}}" : "]}");
+  if (len >= size)
+  {
+    if (!all)
+    {
+      p1EventsReset(); //Changes were left out, start again from all items
+    }
+    return -1;
+  }
+  return len;
+}
+
+#endif // P1EVENTS_H
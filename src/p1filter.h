@@ -0,0 +1,207 @@
+/*
+ OBIS filters per output, e.g. which codes /api shows and which are uploaded. A spec is a comma separated list
+ of patterns, A-B:C.D.E where each number may be * (any) or N* (any number starting with the digits N), the
+ A-B: part may be left out (any channel) and so may trailing fields (any). A pattern starting with ! excludes:
+
+   1-0:1.7.0,1-0:2*.7.0,0-1:*       only these
+   !0-0:96.1.*                     all but the meter identifiers
+   (empty)                         all
+
+ A spec is compiled once (p1FilterCompile) and each item is matched once, when it is created or the spec
+ changes, into its outputs bitmask (see p1SetFilter). Outputs skip an item with one bit test, no strings.
+ */
+#ifndef P1FILTER_H
+#define P1FILTER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum P1FilterOutput
+{
+  P1F_API = 0, //JSON (/api, /events) and /api.bin
+  P1F_UPLOAD = 1, //Deltas, wire snapshots and the upload log, keyframes are the raw telegram
+  P1F_MQTT = 2,
+  P1F_OUTPUTS = 3
+};
+
+#define P1F_ALL ((1 << P1F_OUTPUTS) - 1)
+
+#ifndef P1_FILTER_PATTERNS
+#define P1_FILTER_PATTERNS 12 //Patterns per output
+#endif
+
+#ifndef P1_FILTER_API
+#define P1_FILTER_API ""
+#endif
+
+#ifndef P1_FILTER_UPLOAD
+#define P1_FILTER_UPLOAD ""
+#endif
+
+#ifndef P1_FILTER_MQTT
+#define P1_FILTER_MQTT ""
+#endif
+
+/*
+Exact fields are compared on the packed key (see obisKey) with one mask, N* fields number by number.
+*/
+struct P1FilterPattern
+{
+  uint64_t mask;
+  uint64_t value;
+  uint16_t prefix[5]; //N of an N* field
+  uint8_t prefixFields; //Bit per field that is N*
+  bool exclude;
+};
+
+struct P1Filter
+{
+  P1FilterPattern patterns[P1_FILTER_PATTERNS];
+  uint8_t count;
+  bool includes; //Has patterns without !, then an item must match one of them
+};
+
+P1Filter p1Filters[P1F_OUTPUTS];
+
+static const uint8_t p1FilterShift[5] = {56, 48, 32, 16, 0};
+static const uint64_t p1FilterFieldMask[5] = {0xFF, 0xFF, 0xFFFF, 0xFFFF, 0xFFFF};
+
+/*
+Compiles spec into filter. Returns false (filter left as it was) if a pattern cannot be read or there are too many.
+*/
+bool p1FilterCompile(P1Filter& filter, const char* spec)
+{
+  P1Filter compiled = {};
+  const char* p = spec;
+  while (*p != '\0')
+  {
+    while (*p == ',' || *p == ' ') p++;
+    if (*p == '\0')
+    {
+      break;
+    }
+    if (compiled.count == P1_FILTER_PATTERNS)
+    {
+      return false;
+    }
+    P1FilterPattern& pattern = compiled.patterns[compiled.count++];
+    pattern.exclude = *p == '!';
+    p += pattern.exclude;
+    compiled.includes |= !pattern.exclude;
+
+    const char* end = p + strcspn(p, ",");
+    const char* colon = (const char*)memchr(p, ':', end - p);
+    int field = colon != nullptr ? 0 : 2;
+    while (p < end && field < 5)
+    {
+      if (*p == '*')
+      {
+        p++; //Any
+      }
+      else if (*p >= '0' && *p <= '9')
+      {
+        char* after;
+        unsigned long n = strtoul(p, &after, 10);
+        if (n > p1FilterFieldMask[field])
+        {
+          return false;
+        }
+        p = after;
+        if (*p == '*')
+        {
+          pattern.prefix[field] = n;
+          pattern.prefixFields |= 1 << field;
+          p++;
+        }
+        else
+        {
+          pattern.mask |= p1FilterFieldMask[field] << p1FilterShift[field];
+          pattern.value |= (uint64_t)n << p1FilterShift[field];
+        }
+      }
+      else
+      {
+        return false;
+      }
+      char separator = field == 0 ? '-' : field == 1 ? ':' : '.';
+      field++;
+      if (p < end && *p == separator)
+      {
+        p++;
+      }
+      else if (p < end || (colon != nullptr && field < 2))
+      {
+        return false;
+      }
+      else
+      {
+        break; //Fields left out match any
+      }
+    }
+    if (p != end)
+    {
+      return false;
+    }
+  }
+  filter = compiled;
+  return true;
+}
+
+bool p1FilterPrefix(uint16_t value, uint16_t prefix)
+{
+  if (prefix == 0)
+  {
+    return value == 0;
+  }
+  while (value > prefix)
+  {
+    value /= 10;
+  }
+  return value == prefix;
+}
+
+bool p1FilterMatch(const P1FilterPattern& pattern, const uint16_t (&obis)[5], uint64_t key)
+{
+  if ((key & pattern.mask) != pattern.value)
+  {
+    return false;
+  }
+  for (int field = 0; pattern.prefixFields != 0 && field < 5; field++)
+  {
+    if ((pattern.prefixFields & (1 << field)) && !p1FilterPrefix(obis[field], pattern.prefix[field]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+Bitmask of the outputs (1 << P1FilterOutput) that include the code.
+*/
+uint8_t p1FilterOutputs(const uint16_t (&obis)[5], uint64_t key)
+{
+  uint8_t outputs = 0;
+  for (int output = 0; output < P1F_OUTPUTS; output++)
+  {
+    const P1Filter& filter = p1Filters[output];
+    bool included = !filter.includes;
+    for (int i = 0; i < filter.count; i++)
+    {
+      const P1FilterPattern& pattern = filter.patterns[i];
+      if ((pattern.exclude || !included) && p1FilterMatch(pattern, obis, key))
+      {
+        included = !pattern.exclude;
+        if (pattern.exclude)
+        {
+          break;
+        }
+      }
+    }
+    outputs |= included << output;
+  }
+  return outputs;
+}
+
+#endif // P1FILTER_H
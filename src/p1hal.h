@@ -0,0 +1,229 @@
+/*
+ Hardware access used by the P1 reader: serial input, clock, the request pin and files (LittleFS).
+
+ On the ESP (ARDUINO) these are thin shims over the Arduino API. On the host (env:native) the serial is a
+ byte queue filled with p1HostSerialWrite(), the clock is simulated (p1HostMillis) and files are plain files
+ in the folder p1HostFsRoot, so the same reading and parsing code can run on Linux against recorded telegrams.
+ */
+#ifndef P1HAL_H
+#define P1HAL_H
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#define P1_REQUEST_PIN D5
+
+inline void p1HalSetup()
+{
+  pinMode(P1_REQUEST_PIN, OUTPUT); //Request pin!
+  pinMode(D7,INPUT); //Using the "other Serial HW pins"
+  Serial.begin(9600,SERIAL_7N1,SERIAL_RX_ONLY);
+  Serial.swap();
+  Serial.flush();
+}
+
+inline int p1SerialAvailable()
+{
+  return Serial.available();
+}
+
+inline int p1SerialRead()
+{
+  return Serial.read();
+}
+
+inline unsigned long p1Millis()
+{
+  return millis();
+}
+
+inline void p1RequestPin(bool on)
+{
+  digitalWrite(P1_REQUEST_PIN, on ? HIGH : LOW);
+}
+
+inline bool p1FsBegin()
+{
+  return LittleFS.begin();
+}
+
+/*
+Size of the file, -1 if it does not exist.
+*/
+inline long p1FsSize(const char* path)
+{
+  File f = LittleFS.open(path, "r");
+  if (!f)
+  {
+    return -1;
+  }
+  long size = f.size();
+  f.close();
+  return size;
+}
+
+inline bool p1FsAppend(const char* path, const uint8_t* data, int length)
+{
+  File f = LittleFS.open(path, "a");
+  if (!f)
+  {
+    return false;
+  }
+  int written = f.write(data, length);
+  f.close();
+  return written == length;
+}
+
+inline int p1FsRead(const char* path, long offset, uint8_t* data, int length)
+{
+  File f = LittleFS.open(path, "r");
+  if (!f || !f.seek(offset))
+  {
+    return 0;
+  }
+  int n = f.read(data, length);
+  f.close();
+  return n;
+}
+
+inline void p1FsRemove(const char* path)
+{
+  LittleFS.remove(path);
+}
+
+#else // Host
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+
+#ifndef P1_HOST_SERIAL_BUFFER
+#define P1_HOST_SERIAL_BUFFER 4096
+#endif
+
+static char p1HostSerialBuffer[P1_HOST_SERIAL_BUFFER];
+static int p1HostSerialHead = 0; //Next byte to read
+static int p1HostSerialTail = 0; //Next byte to write
+unsigned long p1HostMillis = 0; //Simulated clock, moved forward by the host program
+bool p1HostRequestPin = false;
+
+/*
+Puts bytes on the simulated serial, as if they arrived from the meter. Returns how many fitted.
+*/
+inline int p1HostSerialWrite(const char* data, int length)
+{
+  if (p1HostSerialHead == p1HostSerialTail)
+  {
+    p1HostSerialHead = p1HostSerialTail = 0;
+  }
+  if (length > P1_HOST_SERIAL_BUFFER - p1HostSerialTail)
+  {
+    length = P1_HOST_SERIAL_BUFFER - p1HostSerialTail;
+  }
+  memcpy(&p1HostSerialBuffer[p1HostSerialTail], data, length);
+  p1HostSerialTail += length;
+  return length;
+}
+
+inline void p1HalSetup()
+{
+  p1HostSerialHead = p1HostSerialTail = 0;
+}
+
+inline int p1SerialAvailable()
+{
+  return p1HostSerialTail - p1HostSerialHead;
+}
+
+inline int p1SerialRead()
+{
+  if (p1HostSerialHead >= p1HostSerialTail)
+  {
+    return -1;
+  }
+  return (uint8_t)p1HostSerialBuffer[p1HostSerialHead++];
+}
+
+inline unsigned long p1Millis()
+{
+  return p1HostMillis;
+}
+
+inline void p1RequestPin(bool on)
+{
+  p1HostRequestPin = on;
+}
+
+const char* p1HostFsRoot = "."; //Folder standing in for the LittleFS root
+long p1HostFsWrites = 0; //Appends and bytes written, to see the flash wear
+long p1HostFsBytes = 0;
+
+inline void p1HostFsPath(char* out, int size, const char* path)
+{
+  snprintf(out, size, "%s%s", p1HostFsRoot, path);
+}
+
+inline bool p1FsBegin()
+{
+  return true;
+}
+
+inline long p1FsSize(const char* path)
+{
+  char name[256];
+  p1HostFsPath(name, sizeof(name), path);
+  FILE* f = fopen(name, "rb");
+  if (f == nullptr)
+  {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+inline bool p1FsAppend(const char* path, const uint8_t* data, int length)
+{
+  char name[256];
+  p1HostFsPath(name, sizeof(name), path);
+  FILE* f = fopen(name, "ab");
+  if (f == nullptr)
+  {
+    return false;
+  }
+  int written = fwrite(data, 1, length, f);
+  fclose(f);
+  p1HostFsWrites++;
+  p1HostFsBytes += written;
+  return written == length;
+}
+
+inline int p1FsRead(const char* path, long offset, uint8_t* data, int length)
+{
+  char name[256];
+  p1HostFsPath(name, sizeof(name), path);
+  FILE* f = fopen(name, "rb");
+  if (f == nullptr)
+  {
+    return 0;
+  }
+  int n = fseek(f, offset, SEEK_SET) == 0 ? fread(data, 1, length, f) : 0;
+  fclose(f);
+  return n;
+}
+
+inline void p1FsRemove(const char* path)
+{
+  char name[256];
+  p1HostFsPath(name, sizeof(name), path);
+  remove(name);
+}
+
+#endif // ARDUINO
+
+#endif // P1HAL_H
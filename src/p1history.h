@@ -0,0 +1,362 @@
+/*
+ On-device history of a few numeric OBIS codes (p1HistoryCodes), in a fixed RAM budget:
+ every sample, 1 minute and 15 minute rollups (min/avg/max), each in a ring of P1_HISTORY_RING bytes.
+
+ Records are varint encoded deltas of the time and the fixed-point value from the previous record, e.g. a power
+ sample takes 2-4 bytes, so a ring keeps the newest records that fit and drops the oldest. Times are whatever
+ the caller passes to p1HistoryAdd() (epoch seconds on the device, a simulated clock on the host).
+
+   p1HistoryAdd(now);                              //After each new telegram
+   P1HistoryStream s;
+   if (p1HistoryBegin(s, "1.7.0", 60)) while ((n = p1HistoryRead(s, buffer, size)) > 0) send(buffer, n);
+ */
+#ifndef P1HISTORY_H
+#define P1HISTORY_H
+
+#include "antonp1.h"
+
+#ifndef P1_HISTORY_RING
+#define P1_HISTORY_RING 512 //Bytes per ring, three rings per code
+#endif
+
+/*
+Codes with history: the full code (A-B:C.D.E, packed as obisKey()) and its C.D.E name in the API.
+*/
+static const char* p1HistoryCodes[] = {"1.7.0", "2.7.0"};
+static const uint64_t p1HistoryKeys[] = {p1ProfileKey(1, 0, 1, 7, 0), p1ProfileKey(1, 0, 2, 7, 0)};
+#define P1_HISTORY_SERIES (int)(sizeof(p1HistoryCodes) / sizeof(p1HistoryCodes[0]))
+static_assert(sizeof(p1HistoryKeys) / sizeof(p1HistoryKeys[0]) == P1_HISTORY_SERIES, "A key per history code");
+
+struct P1HistoryRing
+{
+  uint8_t data[P1_HISTORY_RING];
+  uint16_t head; //Next byte to write
+  uint16_t tail; //Oldest record
+  uint16_t used;
+  uint16_t count; //Records
+  bool rollup; //Records have min and max
+  uint32_t baseTime; //Time and value the oldest record is relative to
+  int64_t baseValue;
+  uint32_t lastTime; //Newest record, the next one is relative to it
+  int64_t lastValue;
+};
+
+struct P1HistoryBucket
+{
+  uint32_t start;
+  int64_t min;
+  int64_t max;
+  int64_t sum;
+  uint32_t count;
+};
+
+struct P1HistorySeries
+{
+  OBISItem* item;
+  int8_t decimals; //Of all values in the rings, -1 until the first sample
+  P1HistoryRing raw;
+  P1HistoryRing minute;
+  P1HistoryRing quarter;
+  P1HistoryBucket minuteBucket; //Being filled
+  P1HistoryBucket quarterBucket;
+};
+
+P1HistorySeries p1History[P1_HISTORY_SERIES];
+std::atomic<uint32_t> p1HistoryVersion(0); //Increased by each p1HistoryAdd(), see p1HistoryBegin()
+
+struct P1HistoryRecord
+{
+  uint32_t time;
+  int64_t value; //Average for rollups
+  int64_t min;
+  int64_t max;
+};
+
+uint64_t p1VarintGet(const P1HistoryRing& ring, uint16_t& pos)
+{
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    uint8_t b = ring.data[pos];
+    pos = (pos + 1) % P1_HISTORY_RING;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (b < 0x80)
+    {
+      break;
+    }
+  }
+  return v;
+}
+
+/*
+Decodes the record at pos, relative to the time and value in r, and moves pos to the next one.
+*/
+void p1HistoryDecode(const P1HistoryRing& ring, uint16_t& pos, P1HistoryRecord& r)
+{
+  r.time += (uint32_t)p1VarintGet(ring, pos);
+  r.value += p1Unzigzag(p1VarintGet(ring, pos));
+  r.min = r.max = r.value;
+  if (ring.rollup)
+  {
+    r.min = r.value - (int64_t)p1VarintGet(ring, pos);
+    r.max = r.value + (int64_t)p1VarintGet(ring, pos);
+  }
+}
+
+void p1HistoryPush(P1HistoryRing& ring, const P1HistoryRecord& r)
+{
+  if (ring.count == 0)
+  {
+    ring.baseTime = ring.lastTime = r.time;
+    ring.baseValue = ring.lastValue = r.value;
+  }
+  uint8_t bytes[40];
+  int len = p1VarintPut(bytes, r.time - ring.lastTime);
+  len += p1VarintPut(bytes + len, p1Zigzag(r.value - ring.lastValue));
+  if (ring.rollup)
+  {
+    len += p1VarintPut(bytes + len, r.value - r.min);
+    len += p1VarintPut(bytes + len, r.max - r.value);
+  }
+
+  while (ring.used + len > P1_HISTORY_RING) //Drop the oldest records
+  {
+    P1HistoryRecord oldest = {ring.baseTime, ring.baseValue, ring.baseValue, ring.baseValue};
+    uint16_t pos = ring.tail;
+    p1HistoryDecode(ring, pos, oldest);
+    ring.used -= (pos - ring.tail + P1_HISTORY_RING) % P1_HISTORY_RING;
+    ring.tail = pos;
+    ring.baseTime = oldest.time;
+    ring.baseValue = oldest.value;
+    ring.count--;
+  }
+
+  for (int i = 0; i < len; i++)
+  {
+    ring.data[ring.head] = bytes[i];
+    ring.head = (ring.head + 1) % P1_HISTORY_RING;
+  }
+  ring.used += len;
+  ring.count++;
+  ring.lastTime = r.time;
+  ring.lastValue = r.value;
+}
+
+void p1HistoryBucketAdd(P1HistoryBucket& b, uint32_t start, int64_t min, int64_t max, int64_t sum, uint32_t count)
+{
+  if (b.count == 0)
+  {
+    b.start = start;
+    b.min = min;
+    b.max = max;
+    b.sum = 0;
+  }
+  b.min = min < b.min ? min : b.min;
+  b.max = max > b.max ? max : b.max;
+  b.sum += sum;
+  b.count += count;
+}
+
+void p1HistoryFlush(P1HistoryRing& ring, P1HistoryBucket& b)
+{
+  int64_t half = b.sum < 0 ? -(int64_t)(b.count / 2) : b.count / 2;
+  P1HistoryRecord r = {b.start, (b.sum + half) / (int64_t)b.count, b.min, b.max};
+  p1HistoryPush(ring, r);
+  b.count = 0;
+}
+
+void p1HistorySetup()
+{
+  for (P1HistorySeries& s : p1History)
+  {
+    s.decimals = -1;
+    s.minute.rollup = true;
+    s.quarter.rollup = true;
+  }
+}
+
+/*
+Adds the current value of each history code, call once per new telegram with the time of it in seconds.
+*/
+void p1HistoryAdd(uint32_t now)
+{
+  for (int i = 0; i < P1_HISTORY_SERIES; i++)
+  {
+    P1HistorySeries& s = p1History[i];
+    for (OBISItem* item = p1parsed->items; s.item == nullptr && item != nullptr; item = item->next)
+    {
+      if (item->key == p1HistoryKeys[i])
+      {
+        s.item = item;
+      }
+    }
+    if (s.item == nullptr)
+    {
+      continue;
+    }
+
+    const OBISItem::ValueSlot& v = s.item->current();
+    int64_t value;
+    int decimals = 0;
+    switch (v.type)
+    {
+      case OBISItem::DOUBLE:
+        value = v.value.fixed.mantissa;
+        decimals = v.value.fixed.decimals;
+        break;
+      case OBISItem::INT32:
+        value = v.value.i32Value;
+        break;
+      case OBISItem::INT64:
+        value = v.value.i64Value;
+        break;
+      default:
+        continue;
+    }
+    if (s.decimals < 0)
+    {
+      s.decimals = decimals;
+    }
+    for (; decimals < s.decimals; decimals++) value *= 10; //Meters keep the decimals, but in case one does not
+    for (; decimals > s.decimals; decimals--) value /= 10;
+
+    P1HistoryRecord r = {now, value, value, value};
+    p1HistoryPush(s.raw, r);
+
+    if (s.minuteBucket.count > 0 && s.minuteBucket.start / 60 != now / 60)
+    {
+      P1HistoryBucket& m = s.minuteBucket;
+      if (s.quarterBucket.count > 0 && s.quarterBucket.start / 900 != m.start / 900)
+      {
+        p1HistoryFlush(s.quarter, s.quarterBucket);
+      }
+      p1HistoryBucketAdd(s.quarterBucket, m.start / 900 * 900, m.min, m.max, m.sum, m.count);
+      p1HistoryFlush(s.minute, m);
+    }
+    p1HistoryBucketAdd(s.minuteBucket, now / 60 * 60, value, value, value, 1);
+  }
+  p1HistoryVersion.fetch_add(1, std::memory_order_release);
+}
+
+/*
+Streaming JSON of one ring, e.g. {"Code":"1.7.0","Res":60,"Unit":"kW","Data":[[time,avg,min,max],...]}
+(raw samples are [time,value]). Only completed minutes and quarters are in the rollups.
+*/
+struct P1HistoryStream
+{
+  P1HistoryRing ring; //Copy, so the stream does not change while it is sent
+  const char* code;
+  OBISItem* item;
+  int res;
+  int8_t decimals;
+  uint16_t pos;
+  uint16_t left; //Records
+  P1HistoryRecord record;
+  bool first;
+  bool done;
+  char pending[128];
+  uint16_t pendingLength;
+  uint16_t pendingPos;
+};
+
+/*
+Starts a document for code at res seconds (60, 900, anything else gives the samples). False if the code has no history.
+*/
+bool p1HistoryBegin(P1HistoryStream& st, const char* code, int res)
+{
+  for (int i = 0; i < P1_HISTORY_SERIES; i++)
+  {
+    P1HistorySeries& s = p1History[i];
+    if (strcmp(p1HistoryCodes[i], code) != 0 || s.item == nullptr)
+    {
+      continue;
+    }
+    const P1HistoryRing& ring = res == 900 ? s.quarter : res == 60 ? s.minute : s.raw;
+    uint32_t version;
+    do //Lock free copy, taken again if a sample was added meanwhile
+    {
+      version = p1HistoryVersion.load(std::memory_order_acquire);
+      memcpy(&st.ring, &ring, sizeof(ring));
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while (version != p1HistoryVersion.load(std::memory_order_relaxed));
+
+    st.code = p1HistoryCodes[i];
+    st.item = s.item;
+    st.res = res == 900 || res == 60 ? res : 0;
+    st.decimals = s.decimals < 0 ? 0 : s.decimals;
+    st.pos = st.ring.tail;
+    st.left = st.ring.count;
+    st.record.time = st.ring.baseTime;
+    st.record.value = st.ring.baseValue;
+    st.first = true;
+    st.done = false;
+    st.pendingLength = snprintf(st.pending, sizeof(st.pending), "{\"Code\":\"%s\",\"Res\":%d,\"Unit\":\"%s\",\"Data\":[",
+      st.code, st.res, st.item->unit != nullptr ? st.item->unit->unitstr : "");
+    st.pendingPos = 0;
+    return true;
+  }
+  return false;
+}
+
+int p1HistoryValue(char* out, int size, int64_t v, int decimals)
+{
+  int len = 0;
+  if (v < 0)
+  {
+    len = snprintf(out, size, "-");
+    v = -v;
+  }
+  return len + p1FormatFixed(out + len, size - len, (uint64_t)v, decimals);
+}
+
+/*
+Writes the next part of the document into buffer, returns the bytes written, 0 when the document is done.
+*/
+size_t p1HistoryRead(P1HistoryStream& st, char* buffer, size_t size)
+{
+  size_t written = 0;
+  while (written < size)
+  {
+    if (st.pendingPos < st.pendingLength)
+    {
+      size_t n = st.pendingLength - st.pendingPos;
+      if (n > size - written)
+      {
+        n = size - written;
+      }
+      memcpy(buffer + written, st.pending + st.pendingPos, n);
+      st.pendingPos += n;
+      written += n;
+      continue;
+    }
+    if (st.done)
+    {
+      break;
+    }
+
+    st.pendingPos = 0;
+    if (st.left == 0)
+    {
+      st.pendingLength = snprintf(st.pending, sizeof(st.pending), "]}");
+      st.done = true;
+      continue;
+    }
+    p1HistoryDecode(st.ring, st.pos, st.record);
+    st.left--;
+    int len = snprintf(st.pending, sizeof(st.pending), "%s[%lu,", st.first ? "" : ",", (unsigned long)st.record.time);
+    len += p1HistoryValue(st.pending + len, sizeof(st.pending) - len, st.record.value, st.decimals);
+    if (st.ring.rollup)
+    {
+      len += snprintf(st.pending + len, sizeof(st.pending) - len, ",");
+      len += p1HistoryValue(st.pending + len, sizeof(st.pending) - len, st.record.min, st.decimals);
+      len += snprintf(st.pending + len, sizeof(st.pending) - len, ",");
+      len += p1HistoryValue(st.pending + len, sizeof(st.pending) - len, st.record.max, st.decimals);
+    }
+    len += snprintf(st.pending + len, sizeof(st.pending) - len, "]");
+    st.pendingLength = len;
+    st.first = false;
+  }
+  return written;
+}
+
+#endif // P1HISTORY_H
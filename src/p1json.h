@@ -0,0 +1,314 @@
+/*
+ Streaming JSON output of the parsed OBIS items, used by /api (chunked response) and by the host benchmark.
+
+ The document is written a piece at a time into whatever buffer the caller has (e.g. the TCP send buffer
+ of a chunked AsyncWebServer response), so there is no fixed size limit for the payload and no heap use.
+ Each piece (head, one item, tail) is rendered into the stream's small pending buffer and copied out
+ over as many calls as needed.
+
+   P1JsonStream stream;
+   p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_API);
+   while ((n = p1JsonRead(stream, buffer, sizeof(buffer))) > 0) send(buffer, n);
+
+ Only the items of the output (see p1filter.h) are written. The meter's own items are in the OBIS array, the
+ ones of sub-devices (0-1, 0-2... e.g. M-Bus gas meters) each in an array of their channel, so codes of two
+ sub-devices do not mix:
+   {"OBIS":[{"Code":"1.8.0",...},...],"Channels":{"0-1":[{"Code":"24.2.1",...}],"0-2":[...]}}
+ /api serves a cached copy of the document (p1JsonCache), built once per telegram by p1JsonCacheUpdate().
+ */
+#ifndef P1JSON_H
+#define P1JSON_H
+
+#include "antonp1.h"
+
+#ifndef P1_JSON_PIECE
+#define P1_JSON_PIECE (2 * P1_MAXVALUE + 64) //Largest single piece, an item with an escaped string value
+#endif
+
+enum P1JsonPart {P1J_HEAD=0, P1J_ITEMS=1, P1J_TAIL=2, P1J_DONE=3};
+
+struct P1JsonStream
+{
+  P1JsonPart part;
+  OBISItem* item; //Next item to write
+  uint8_t outputs; //Bit of the output, see p1filter.h
+  uint16_t channel; //Of the sub-device array being written, see p1Channel()
+  bool channels; //The Channels object has been started
+  bool first;
+  const char* tail;
+  char pending[P1_JSON_PIECE]; //Piece being copied out
+  uint16_t pendingLength;
+  uint16_t pendingPos;
+};
+
+/*
+Starts a document of the output's items, head (ending with the opening of the item array) is written before
+the items and tail after the closed item arrays. Head is copied, tail must stay valid.
+*/
+void p1JsonBegin(P1JsonStream& s, const char* head, const char* tail, P1FilterOutput output)
+{
+  s.part = P1J_HEAD;
+  s.outputs = 1 << output;
+  s.item = p1NextGrouped(nullptr, s.outputs);
+  s.channels = false;
+  s.first = true;
+  s.tail = tail;
+  s.pendingLength = snprintf(s.pending, sizeof(s.pending), "%s", head);
+  if (s.pendingLength >= sizeof(s.pending))
+  {
+    s.pendingLength = sizeof(s.pending) - 1;
+  }
+  s.pendingPos = 0;
+}
+
+/*
+Appends a JSON string (quoted and escaped) to the piece, returns the new length.
+*/
+int p1JsonString(char* out, int len, int size, const char* str)
+{
+  if (len < size - 1) out[len++] = '"';
+  for (; *str != '\0' && len < size - 2; str++)
+  {
+    char c = *str;
+    if (c == '"' || c == '\\')
+    {
+      out[len++] = '\\';
+      out[len++] = c;
+    }
+    else if ((uint8_t)c >= 0x20)
+    {
+      out[len++] = c;
+    }
+  }
+  if (len < size - 1) out[len++] = '"';
+  out[len] = '\0';
+  return len;
+}
+
+/*
+Closes the item array before the first item of a sub-device channel and opens the channel's, e.g. ],"0-1":[
+*/
+int p1JsonChannel(OBISItem* item, bool firstChannel, char* out, int size)
+{
+  int len = snprintf(out, size, "]%s\"%d-%d\":[", firstChannel ? ",\"Channels\":{" : ",", item->obis[0], item->obis[1]);
+  return len < size ? len : size - 1;
+}
+
+/*
+Renders one item, e.g. ,{"Code":"1.8.0","DValue":4107.331,"Unit":"kWh"} - returns the length.
+The value is read from a snapshot and rendered again if a new telegram was made current meanwhile
+(this may run in the web server's context while loop() parses), so an item is never half old, half new.
+Items of one long chunked document can still come from different telegrams.
+*/
+int p1JsonItem(OBISItem* item, bool first, char* out, int size)
+{
+  int len;
+  uint32_t generation;
+  do
+  {
+    generation = p1SnapshotGeneration();
+    const OBISItem::ValueSlot& v = item->at(generation);
+    len = snprintf(out, size, "%s{\"Code\":\"%s\"", first ? "" : ",", item->getObisCode());
+    switch (v.type)
+    {
+      case OBISItem::DOUBLE:
+        len += snprintf(out + len, size - len, ",\"DValue\":");
+        len += p1FormatValue(v, out + len, size - len);
+        break;
+      case OBISItem::INT32:
+      case OBISItem::INT64:
+        len += snprintf(out + len, size - len, ",\"IValue\":");
+        len += p1FormatValue(v, out + len, size - len);
+        break;
+      case OBISItem::CHARARR:
+        len += snprintf(out + len, size - len, ",\"SValue\":");
+        len = p1JsonString(out, len, size, v.value.stringValue);
+        break;
+      default:
+        break;
+    }
+  } while (!p1SnapshotStable(generation));
+  if (item->unit != nullptr)
+  {
+    len += snprintf(out + len, size - len, ",\"Unit\":");
+    len = p1JsonString(out, len, size, item->unit->unitstr);
+  }
+  len += snprintf(out + len, size - len, "}");
+  return len < size ? len : size - 1;
+}
+
+/*
+Writes the next part of the document into buffer, returns the bytes written, 0 when the document is done.
+*/
+size_t p1JsonRead(P1JsonStream& s, char* buffer, size_t size)
+{
+  P1_TIMED_BEGIN(json);
+  size_t written = 0;
+  while (written < size)
+  {
+    if (s.pendingPos < s.pendingLength) //Copy out what is left of the current piece
+    {
+      size_t n = s.pendingLength - s.pendingPos;
+      if (n > size - written)
+      {
+        n = size - written;
+      }
+      memcpy(buffer + written, s.pending + s.pendingPos, n);
+      s.pendingPos += n;
+      written += n;
+      continue;
+    }
+
+    //Render the next piece
+    s.pendingPos = 0;
+    s.pendingLength = 0;
+    if (s.part == P1J_HEAD)
+    {
+      s.part = P1J_ITEMS;
+    }
+    if (s.part == P1J_ITEMS)
+    {
+      if (s.item != nullptr)
+      {
+        uint16_t channel = p1Channel(s.item);
+        if (channel > 0xFF && (!s.channels || channel != s.channel)) //First item of a sub-device
+        {
+          s.pendingLength = p1JsonChannel(s.item, !s.channels, s.pending, sizeof(s.pending));
+          s.channels = true;
+          s.channel = channel;
+          s.first = true;
+          continue;
+        }
+        s.pendingLength = p1JsonItem(s.item, s.first, s.pending, sizeof(s.pending));
+        s.first = false;
+        s.item = p1NextGrouped(s.item, s.outputs);
+        continue;
+      }
+      s.part = P1J_TAIL;
+    }
+    if (s.part == P1J_TAIL)
+    {
+      s.pendingLength = snprintf(s.pending, sizeof(s.pending), "%s%s", s.channels ? "]}" : "]", s.tail);
+      s.part = P1J_DONE;
+      continue;
+    }
+    break; //P1J_DONE
+  }
+  P1_TIMED_END(json, P1T_JSON);
+  return written;
+}
+
+#ifndef P1_JSON_CACHE
+#define P1_JSON_CACHE 2048 //Largest cached document, a larger one is streamed from the items instead
+#endif
+
+/*
+The document of one telegram, built by loop() after the telegram is parsed and served as is until the next
+one, so a request costs a copy and pollers get 304 by generation (ETag). Two buffers: a response holds its
+buffer (P1JsonCacheHold) until it is sent, the newer document waits for the buffer meanwhile.
+*/
+struct P1JsonCache
+{
+  char data[2][P1_JSON_CACHE];
+  int length[2]; //-1 if the document did not fit
+  std::atomic<uint32_t> generation[2];
+  std::atomic<int> current{-1}; //Buffer with the newest document, -1 before the first
+  std::atomic<int> readers[2]; //Responses holding the buffer
+};
+
+P1JsonCache p1JsonCache;
+
+/*
+A response's hold on the buffer it is sent from, released when the hold is destroyed (the response is done
+or dropped), see p1JsonCacheHold().
+*/
+struct P1JsonCacheHold
+{
+  int buffer = -1;
+
+  P1JsonCacheHold() = default;
+  P1JsonCacheHold(const P1JsonCacheHold&) = delete;
+  P1JsonCacheHold& operator=(const P1JsonCacheHold&) = delete;
+  ~P1JsonCacheHold()
+  {
+    if (buffer >= 0)
+    {
+      p1JsonCache.readers[buffer]--;
+    }
+  }
+};
+
+/*
+Holds the buffer with the newest document, so it is not written until the hold is released. False if there
+is none or it did not fit (stream it from the items then).
+*/
+bool p1JsonCacheHold(P1JsonCacheHold& hold)
+{
+  for (int tries = 0; tries < 2 && hold.buffer < 0; tries++)
+  {
+    int buffer = p1JsonCache.current.load();
+    if (buffer < 0)
+    {
+      return false;
+    }
+    p1JsonCache.readers[buffer]++;
+    if (p1JsonCache.current.load() == buffer) //Not flipped meanwhile, p1JsonCacheUpdate() does not write it now
+    {
+      hold.buffer = buffer;
+    }
+    else
+    {
+      p1JsonCache.readers[buffer]--;
+    }
+  }
+  return hold.buffer >= 0 && p1JsonCache.length[hold.buffer] >= 0;
+}
+
+/*
+Builds the document of the current telegram if it is not cached yet. Call from loop(), each time: while a
+response holds the other buffer this waits and the older document is served.
+*/
+void p1JsonCacheUpdate()
+{
+  uint32_t generation = p1SnapshotGeneration();
+  int current = p1JsonCache.current.load(std::memory_order_relaxed);
+  if (current >= 0 && p1JsonCache.generation[current].load(std::memory_order_relaxed) == generation)
+  {
+    return;
+  }
+  int next = current == 0 ? 1 : 0;
+  if (p1JsonCache.readers[next].load() > 0)
+  {
+    return;
+  }
+
+  static P1JsonStream stream;
+  p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_API);
+  int length = 0;
+  for (size_t n; (n = p1JsonRead(stream, p1JsonCache.data[next] + length, P1_JSON_CACHE - length)) > 0;)
+  {
+    length += n;
+  }
+  char more;
+  p1JsonCache.length[next] = p1JsonRead(stream, &more, 1) == 0 ? length : -1;
+  p1JsonCache.generation[next].store(generation, std::memory_order_release);
+  p1JsonCache.current.store(next, std::memory_order_release);
+}
+
+/*
+Copies the part of the held document at index into out, for a chunked response. Returns 0 at the end.
+*/
+size_t p1JsonCacheRead(const P1JsonCacheHold& hold, char* out, size_t size, size_t index)
+{
+  int buffer = hold.buffer;
+  int length = p1JsonCache.length[buffer];
+  if (length < 0 || index >= (size_t)length)
+  {
+    return 0;
+  }
+  size_t n = length - index < size ? length - index : size;
+  memcpy(out, p1JsonCache.data[buffer] + index, n);
+  return n;
+}
+
+#endif // P1JSON_H
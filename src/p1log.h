@@ -0,0 +1,296 @@
+/*
+ Telegram log on LittleFS for uploads that failed (no WiFi, server down), replayed once uploads work again.
+
+ Each failed upload appends a snapshot record (time and the numeric values) to a block in RAM. Only full
+ blocks of P1_LOG_BLOCK bytes are written, a whole number of flash pages, which keeps the writes (and wear)
+ to one per few snapshots. Blocks go to segment files /p1log0.bin ... used as a ring, each block starts with
+ the sequence number of its segment so the order is found again after a restart. When all segments are full
+ the oldest is removed (p1LogDropped counts the snapshots lost).
+
+ Record: length (2 bytes), time (4), then per item A B C D E (1 byte each), type (1) and the value
+ (DOUBLE: decimals (1) + varint mantissa, integers: varint). Strings are not logged.
+
+ A replayed record is posted in the delta line format (see p1delta.h) with the time in the first line:
+   /snapshot 1683784800\r\n
+   1-0:1.8.1(1240.051)\r\n
+   !\r\n
+ Snapshots replayed before a restart may be sent again after it (from the start of the current segment),
+ the receiver should ignore times it already has.
+ */
+#ifndef P1LOG_H
+#define P1LOG_H
+
+#include "antonp1.h"
+#include "p1upload.h"
+
+#ifndef P1_LOG_BLOCK
+#define P1_LOG_BLOCK 1024 //Bytes written at a time, four 256 byte flash pages
+#endif
+
+#ifndef P1_LOG_SEGMENT
+#define P1_LOG_SEGMENT 16384 //Bytes per segment file
+#endif
+
+#ifndef P1_LOG_SEGMENTS
+#define P1_LOG_SEGMENTS 16 //Segment files, 256 KB of flash in all (about a day and a half at one snapshot per 120 s)
+#endif
+
+uint8_t p1LogBlock[P1_LOG_BLOCK]; //Block being filled
+uint8_t p1LogScratch[P1_LOG_BLOCK]; //Record being built by p1LogAppend(), block being read by p1LogReplay()
+int p1LogBlockUsed = 0; //0 when empty, the sequence number is put in front when it is written
+uint32_t p1LogWriteSeq = 0; //Segment written to
+uint32_t p1LogReplaySeq = 0; //Segment and offset of the next record to replay
+long p1LogReplayOffset = 0;
+long p1LogReplayNext = 0; //Offset after the record returned by p1LogReplay()
+long p1LogDropped = 0; //Snapshots lost to full segments
+bool p1LogReady = false;
+bool p1LogPending = false; //Snapshots to replay, so p1LogReplay() needs not look at the files when there are none
+
+void p1LogPath(char* out, int size, uint32_t seq)
+{
+  snprintf(out, size, "/p1log%lu.bin", (unsigned long)(seq % P1_LOG_SEGMENTS));
+}
+
+/*
+Reads the sequence numbers of the segment files, replay starts at the oldest and writing continues in the newest.
+*/
+void p1LogSetup()
+{
+  p1LogReady = p1FsBegin();
+  p1LogBlockUsed = 0;
+  p1LogWriteSeq = p1LogReplaySeq = 0;
+  p1LogReplayOffset = p1LogReplayNext = 0;
+  bool found = false;
+  for (int i = 0; p1LogReady && i < P1_LOG_SEGMENTS; i++)
+  {
+    char path[24];
+    uint32_t seq;
+    p1LogPath(path, sizeof(path), i);
+    if (p1FsRead(path, 0, (uint8_t*)&seq, sizeof(seq)) != sizeof(seq) || seq % P1_LOG_SEGMENTS != (uint32_t)i)
+    {
+      continue;
+    }
+    if (!found || seq > p1LogWriteSeq) p1LogWriteSeq = seq;
+    if (!found || seq < p1LogReplaySeq) p1LogReplaySeq = seq;
+    found = true;
+  }
+  p1LogPending = found;
+}
+
+/*
+Writes the block being filled, padded to the full size. The next segment is started (removing the oldest) when full.
+*/
+void p1LogFlush()
+{
+  if (p1LogBlockUsed == 0 || !p1LogReady)
+  {
+    return;
+  }
+  char path[24];
+  p1LogPath(path, sizeof(path), p1LogWriteSeq);
+  long size = p1FsSize(path);
+  if (size >= P1_LOG_SEGMENT)
+  {
+    p1LogWriteSeq++;
+    p1LogPath(path, sizeof(path), p1LogWriteSeq);
+    if (p1LogReplaySeq + P1_LOG_SEGMENTS <= p1LogWriteSeq) //Oldest not replayed yet, it is lost
+    {
+      //Only the record lengths are read, p1LogScratch may hold the record being added
+      for (long offset = p1LogReplayOffset; offset < P1_LOG_SEGMENT;)
+      {
+        long blockStart = offset / P1_LOG_BLOCK * P1_LOG_BLOCK;
+        offset += offset == blockStart ? 4 : 0;
+        uint8_t bytes[2];
+        uint16_t length = p1FsRead(path, offset, bytes, 2) == 2 ? bytes[0] | bytes[1] << 8 : 0;
+        if (length < 6 || offset + length > blockStart + P1_LOG_BLOCK) //End of the block
+        {
+          offset = blockStart + P1_LOG_BLOCK;
+          continue;
+        }
+        p1LogDropped++;
+        offset += length;
+      }
+      p1LogReplaySeq = p1LogWriteSeq - P1_LOG_SEGMENTS + 1;
+      p1LogReplayOffset = 0;
+    }
+    p1FsRemove(path);
+  }
+  memcpy(p1LogBlock, &p1LogWriteSeq, 4);
+  memset(p1LogBlock + p1LogBlockUsed, 0, P1_LOG_BLOCK - p1LogBlockUsed); //Length 0 ends the block
+  p1FsAppend(path, p1LogBlock, P1_LOG_BLOCK);
+  p1LogBlockUsed = 0;
+}
+
+/*
+Adds a snapshot of the current values, taken at time now. Returns false if the log is not available.
+*/
+bool p1LogAppend(uint32_t now)
+{
+  if (!p1LogReady)
+  {
+    return false;
+  }
+  uint8_t* record = p1LogScratch;
+  int len = 6;
+  memcpy(record + 2, &now, 4);
+  for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+  {
+    const OBISItem::ValueSlot& v = item->current();
+    if ((v.type != OBISItem::DOUBLE && v.type != OBISItem::INT32 && v.type != OBISItem::INT64) || !(item->outputs & (1 << P1F_UPLOAD)))
+    {
+      continue;
+    }
+    if (item->obis[2] > 255 || item->obis[3] > 255 || item->obis[4] > 255 || len + 17 > P1_LOG_BLOCK - 4)
+    {
+      continue; //Does not fit the record format, or the record is full
+    }
+    for (int i = 0; i < 5; i++)
+    {
+      record[len++] = (uint8_t)item->obis[i];
+    }
+    record[len++] = v.type;
+    if (v.type == OBISItem::DOUBLE)
+    {
+      record[len++] = v.value.fixed.decimals;
+      len += p1VarintPut(record + len, v.value.fixed.mantissa);
+    }
+    else
+    {
+      len += p1VarintPut(record + len, v.type == OBISItem::INT32 ? v.value.i32Value : v.value.i64Value);
+    }
+  }
+  record[0] = len & 0xFF;
+  record[1] = len >> 8;
+
+  if (p1LogBlockUsed > 0 && p1LogBlockUsed + len > P1_LOG_BLOCK)
+  {
+    p1LogFlush();
+  }
+  if (p1LogBlockUsed == 0)
+  {
+    p1LogBlockUsed = 4; //Room for the sequence number
+  }
+  memcpy(p1LogBlock + p1LogBlockUsed, record, len);
+  p1LogBlockUsed += len;
+  p1LogPending = true;
+  if (p1LogBlockUsed + 2 > P1_LOG_BLOCK)
+  {
+    p1LogFlush();
+  }
+  return true;
+}
+
+uint64_t p1LogVarint(const uint8_t* data, int& pos, int end)
+{
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64 && pos < end; shift += 7)
+  {
+    uint8_t b = data[pos++];
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (b < 0x80)
+    {
+      break;
+    }
+  }
+  return v;
+}
+
+/*
+Writes the oldest snapshot not replayed yet into out, returns the length or 0 if there is none.
+Call p1LogReplayDone() when it has been uploaded, the same snapshot is returned until then.
+Returns -1 if it does not fit in size, nothing is cut.
+*/
+int p1LogReplay(char* out, int size)
+{
+  if (!p1LogPending)
+  {
+    return 0;
+  }
+  p1LogFlush(); //Snapshots still in RAM are written so they can be replayed in order
+  while (p1LogReady)
+  {
+    char path[24];
+    p1LogPath(path, sizeof(path), p1LogReplaySeq);
+    long fileSize = p1FsSize(path);
+    if (p1LogReplayOffset >= fileSize)
+    {
+      if (p1LogReplaySeq == p1LogWriteSeq)
+      {
+        p1LogPending = false;
+        return 0;
+      }
+      p1FsRemove(path); //Fully replayed
+      p1LogReplaySeq++;
+      p1LogReplayOffset = 0;
+      continue;
+    }
+
+    uint8_t* block = p1LogScratch;
+    long blockStart = p1LogReplayOffset / P1_LOG_BLOCK * P1_LOG_BLOCK;
+    int n = p1FsRead(path, blockStart, block, P1_LOG_BLOCK);
+    int pos = p1LogReplayOffset - blockStart;
+    if (pos == 0)
+    {
+      pos = 4;
+    }
+    uint16_t length = pos + 2 <= n ? block[pos] | block[pos + 1] << 8 : 0;
+    if (length < 6 || pos + length > n) //End of the block
+    {
+      p1LogReplayOffset = blockStart + P1_LOG_BLOCK;
+      continue;
+    }
+
+    uint32_t time;
+    memcpy(&time, block + pos + 2, 4);
+    int end = pos + length;
+    int len = snprintf(out, size, "/snapshot %lu\r\n", (unsigned long)time);
+    for (int i = pos + 6; i + 7 <= end && len < size;)
+    {
+      const uint8_t* obis = block + i;
+      uint8_t type = block[i + 5];
+      i += 6;
+      char value[24];
+      if (type == OBISItem::DOUBLE)
+      {
+        uint8_t decimals = block[i++];
+        p1FormatFixed(value, sizeof(value), p1LogVarint(block, i, end), decimals);
+      }
+      else
+      {
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)p1LogVarint(block, i, end));
+      }
+      len += snprintf(out + len, size - len, "%d-%d:%d.%d.%d(%s)\r\n", obis[0], obis[1], obis[2], obis[3], obis[4], value);
+    }
+    len += snprintf(out + len, size > len ? size - len : 0, "!\r\n");
+    p1LogReplayNext = blockStart + end;
+    return len < size ? len : -1;
+  }
+  return 0;
+}
+
+void p1LogReplayDone()
+{
+  p1LogReplayOffset = p1LogReplayNext;
+}
+
+/*
+Queues the oldest snapshot not replayed yet as a "snapshot" upload, written straight into the upload queue.
+Call from loop() while uploads work and p1LogReplayDone() when it has arrived. True if one was queued.
+A snapshot that does not fit waits for the queue to empty, one larger than the whole queue (P1_UPLOAD_BUFFER)
+is dropped and counted in p1LogDropped, so the ones after it are not held up.
+*/
+bool p1LogReplayQueue()
+{
+  int size;
+  char* body = p1UploadSpace(size);
+  int len = body != nullptr ? p1LogReplay(body, size) : 0;
+  if (len < 0 && size == P1_UPLOAD_BUFFER)
+  {
+    p1LogReplayDone();
+    p1LogDropped++;
+    return false;
+  }
+  return len > 0 && p1UploadQueue(body, len, "snapshot", 0);
+}
+
+#endif // P1LOG_H
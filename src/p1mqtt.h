@@ -0,0 +1,269 @@
+/*
+ MQTT publishing of the parsed values through a bounded outbound queue, so loop() (and the telegram reader)
+ never waits for the network. The client library (AsyncMqttClient on the device, a broker stub on the host)
+ is reached only through p1MqttTransport.
+
+ Every P1_MQTT_INTERVAL ms p1MqttSnapshot() queues either one message per code, topic <prefix>/<A-B:C.D.E>
+ with the value as text, or one batched JSON document (p1json.h) on <prefix>/snapshot. p1MqttDrain() hands
+ queued messages to the client while it takes them. QoS 0 messages are gone once handed over, QoS 1 stay
+ queued until the broker acks them (p1MqttAckReceived) and are sent again after a reconnect. When the queue
+ is full the oldest messages are dropped (p1MqttDropped), the newest values are the ones worth sending.
+ */
+#ifndef P1MQTT_H
+#define P1MQTT_H
+
+#include "antonp1.h"
+#include "p1json.h"
+
+#ifndef P1_MQTT_BUFFER
+#define P1_MQTT_BUFFER 4096 //Bytes for queued messages, topics and payloads
+#endif
+
+#ifndef P1_MQTT_INFLIGHT
+#define P1_MQTT_INFLIGHT 4 //QoS 1 messages sent but not acked yet
+#endif
+
+#ifndef P1_MQTT_ACKS
+#define P1_MQTT_ACKS 16 //Acks received and not handled yet, a power of 2
+#endif
+
+#ifndef P1_MQTT_INTERVAL
+#define P1_MQTT_INTERVAL 10000
+#endif
+
+/*
+The client, publish returns the packet id (1 for QoS 0), or 0 if it cannot take the message now.
+*/
+struct P1MqttTransport
+{
+  bool (*connected)();
+  uint16_t (*publish)(const char* topic, uint8_t qos, bool retain, const char* payload, int length);
+};
+
+P1MqttTransport p1MqttTransport = {nullptr, nullptr};
+
+void p1MqttAcked(uint16_t packetId);
+
+/*
+Acks come in the client's context (not loop()), they are passed on through a lock free ring and handled by p1MqttDrain().
+*/
+uint16_t p1MqttAcks[P1_MQTT_ACKS];
+std::atomic<uint32_t> p1MqttAckWrite(0);
+std::atomic<uint32_t> p1MqttAckRead(0);
+
+void p1MqttAckReceived(uint16_t packetId)
+{
+  uint32_t write = p1MqttAckWrite.load(std::memory_order_relaxed);
+  if (write - p1MqttAckRead.load(std::memory_order_acquire) >= P1_MQTT_ACKS)
+  {
+    return; //Full, the message is sent again after a reconnect
+  }
+  p1MqttAcks[write % P1_MQTT_ACKS] = packetId;
+  p1MqttAckWrite.store(write + 1, std::memory_order_release);
+}
+
+/*
+Queued message, followed by the topic (with its '\0') and the payload, in a byte ring that wraps around.
+*/
+struct P1MqttMessage
+{
+  uint16_t length; //Of the whole message, header included
+  uint16_t topicLength;
+  uint16_t payloadLength;
+  uint16_t packetId; //QoS 1 message waiting for its ack
+  uint8_t qos;
+  bool retain;
+  bool done; //Handed to the client (QoS 0) or acked (QoS 1)
+};
+
+uint8_t p1MqttBuffer[P1_MQTT_BUFFER];
+int p1MqttHead = 0; //Oldest message
+int p1MqttUsed = 0; //Bytes
+int p1MqttCount = 0; //Messages
+int p1MqttSent = 0; //Messages from the head handed to the client, QoS 1 ones may still wait for the ack
+int p1MqttSendPos = 0; //Message after those
+int p1MqttInflight = 0;
+long p1MqttDropped = 0;
+long p1MqttPublished = 0;
+bool p1MqttWasConnected = false;
+char p1MqttScratch[P1_MQTT_BUFFER / 2]; //One message in one piece, for the client and while building a snapshot
+
+void p1MqttCopy(int pos, void* out, int length)
+{
+  int first = length < P1_MQTT_BUFFER - pos ? length : P1_MQTT_BUFFER - pos;
+  memcpy(out, p1MqttBuffer + pos, first);
+  memcpy((uint8_t*)out + first, p1MqttBuffer, length - first);
+}
+
+void p1MqttPut(int pos, const void* data, int length)
+{
+  int first = length < P1_MQTT_BUFFER - pos ? length : P1_MQTT_BUFFER - pos;
+  memcpy(p1MqttBuffer + pos, data, first);
+  memcpy(p1MqttBuffer, (const uint8_t*)data + first, length - first);
+}
+
+void p1MqttPopHead()
+{
+  P1MqttMessage m;
+  p1MqttCopy(p1MqttHead, &m, sizeof(m));
+  p1MqttHead = (p1MqttHead + m.length) % P1_MQTT_BUFFER;
+  p1MqttUsed -= m.length;
+  p1MqttCount--;
+  if (p1MqttSent > 0)
+  {
+    p1MqttSent--;
+    p1MqttInflight -= m.qos > 0 && !m.done;
+  }
+  else
+  {
+    p1MqttSendPos = p1MqttHead;
+  }
+  if (m.done) p1MqttPublished++;
+  else p1MqttDropped++;
+}
+
+/*
+Queues a message, dropping the oldest ones if there is no room. False if it can never fit.
+*/
+bool p1MqttQueue(const char* topic, uint8_t qos, bool retain, const char* payload, int length)
+{
+  P1MqttMessage m = {0, (uint16_t)(strlen(topic) + 1), (uint16_t)length, 0, qos, retain, false};
+  m.length = sizeof(m) + m.topicLength + length;
+  if (m.length > P1_MQTT_BUFFER / 2)
+  {
+    p1MqttDropped++;
+    return false;
+  }
+  while (P1_MQTT_BUFFER - p1MqttUsed < m.length)
+  {
+    p1MqttPopHead(); //Drop the oldest
+  }
+  int pos = (p1MqttHead + p1MqttUsed) % P1_MQTT_BUFFER;
+  p1MqttPut(pos, &m, sizeof(m));
+  p1MqttPut((pos + sizeof(m)) % P1_MQTT_BUFFER, topic, m.topicLength);
+  p1MqttPut((pos + sizeof(m) + m.topicLength) % P1_MQTT_BUFFER, payload, length);
+  p1MqttUsed += m.length;
+  p1MqttCount++;
+  return true;
+}
+
+/*
+Hands queued messages to the client while it takes them, never waits. Call from loop().
+*/
+void p1MqttDrain()
+{
+  if (p1MqttTransport.connected == nullptr || !p1MqttTransport.connected())
+  {
+    p1MqttWasConnected = false;
+    return;
+  }
+  uint32_t read = p1MqttAckRead.load(std::memory_order_relaxed);
+  for (; read != p1MqttAckWrite.load(std::memory_order_acquire); read++)
+  {
+    p1MqttAcked(p1MqttAcks[read % P1_MQTT_ACKS]);
+    p1MqttAckRead.store(read + 1, std::memory_order_release);
+  }
+  if (!p1MqttWasConnected) //(Re)connected, QoS 1 messages without an ack are sent again
+  {
+    p1MqttWasConnected = true;
+    p1MqttSent = 0;
+    p1MqttSendPos = p1MqttHead;
+    p1MqttInflight = 0;
+  }
+  while (p1MqttSent < p1MqttCount && p1MqttInflight < P1_MQTT_INFLIGHT)
+  {
+    P1MqttMessage m;
+    p1MqttCopy(p1MqttSendPos, &m, sizeof(m));
+    if (!m.done)
+    {
+      p1MqttCopy((p1MqttSendPos + sizeof(m)) % P1_MQTT_BUFFER, p1MqttScratch, m.length - sizeof(m));
+      uint16_t id = p1MqttTransport.publish(p1MqttScratch, m.qos, m.retain, p1MqttScratch + m.topicLength, m.payloadLength);
+      if (id == 0)
+      {
+        break; //Client is full, again next loop()
+      }
+      m.done = m.qos == 0;
+      m.packetId = id;
+      p1MqttInflight += m.qos > 0;
+      p1MqttPut(p1MqttSendPos, &m, sizeof(m));
+    }
+    p1MqttSent++;
+    p1MqttSendPos = (p1MqttSendPos + m.length) % P1_MQTT_BUFFER;
+  }
+  p1MqttAcked(0);
+}
+
+/*
+The broker acked a QoS 1 message. Done messages leave the queue from the front, in order.
+*/
+void p1MqttAcked(uint16_t packetId)
+{
+  int pos = p1MqttHead;
+  for (int i = 0; packetId != 0 && i < p1MqttSent; i++)
+  {
+    P1MqttMessage m;
+    p1MqttCopy(pos, &m, sizeof(m));
+    if (!m.done && m.qos > 0 && m.packetId == packetId)
+    {
+      m.done = true;
+      p1MqttInflight--;
+      p1MqttPut(pos, &m, sizeof(m));
+      break;
+    }
+    pos = (pos + m.length) % P1_MQTT_BUFFER;
+  }
+  while (p1MqttSent > 0)
+  {
+    P1MqttMessage m;
+    p1MqttCopy(p1MqttHead, &m, sizeof(m));
+    if (!m.done)
+    {
+      break;
+    }
+    p1MqttPopHead();
+  }
+}
+
+/*
+Queues the current values: one message per code (perCode) or one JSON document on <prefix>/snapshot.
+*/
+void p1MqttSnapshot(const char* prefix, uint8_t qos, bool perCode)
+{
+  if (perCode)
+  {
+    for (OBISItem* item = p1parsed->items; item != nullptr; item = item->next)
+    {
+      const OBISItem::ValueSlot& v = item->current();
+      if (v.type == OBISItem::NONE || !(item->outputs & (1 << P1F_MQTT)))
+      {
+        continue;
+      }
+      char topic[64], value[P1_MAXVALUE + 24];
+      snprintf(topic, sizeof(topic), "%s/%d-%d:%s", prefix, item->obis[0], item->obis[1], item->getObisCode());
+      int length = p1FormatValue(v, value, sizeof(value));
+      p1MqttQueue(topic, qos, true, value, length < (int)sizeof(value) ? length : sizeof(value) - 1);
+    }
+    return;
+  }
+  char topic[64];
+  snprintf(topic, sizeof(topic), "%s/snapshot", prefix);
+  static P1JsonStream stream;
+  p1JsonBegin(stream, "{\"OBIS\":[", "}", P1F_MQTT);
+  size_t size = sizeof(p1MqttScratch) - sizeof(P1MqttMessage) - strlen(topic) - 1; //Largest payload the queue takes
+  size_t length = 0;
+  for (size_t n; (n = p1JsonRead(stream, p1MqttScratch + length, size - length)) > 0;)
+  {
+    length += n;
+  }
+  char more;
+  if (p1JsonRead(stream, &more, 1) == 0) //Whole document fitted
+  {
+    p1MqttQueue(topic, qos, false, p1MqttScratch, length);
+  }
+  else
+  {
+    p1MqttDropped++;
+  }
+}
+
+#endif // P1MQTT_H
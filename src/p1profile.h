@@ -0,0 +1,230 @@
+/*
+ Compile-time meter profiles: the OBIS codes a meter model is known to send, with their types and units,
+ for a fleet of mostly one model. A profile is a list (X macro) of
+
+   X(name, A, B, C, D, E, type, "unit")
+
+ and P1_PROFILE_DEFINE() generates from it, at compile time, a perfect hash of the codes (one multiply, no
+ probing, a table of 4 or more slots per code), the code order and a struct with an accessor per code, e.g.
+
+   P1ProfileDsmr5 meter = {p1main.parsed};
+   double kw = meter.activePowerImport(); //0 until the code has been seen, see seen()
+
+ A parser using a profile (ParsedOBIS::profile, all of them when built with -D P1_PROFILE=P1ProfileDsmr5)
+ has the profile's items first in its pool, in the list's order, with their units set. Their lines are found
+ by the perfect hash instead of the index and their values are stored as the type the profile gives when
+ they are of it (else guessed as usual). Codes not in the profile go the dynamic way as before.
+ Items are still put in the items list when their code is first seen, so outputs are the same as without.
+ The two do not combine with P1_LAZY_VALUES: values are then decoded from their bytes at the commit and their
+ types guessed (the same values come out), the profile's types are not used, only its hash and accessors.
+ */
+#ifndef P1PROFILE_H
+#define P1PROFILE_H
+
+#include <stdint.h>
+
+/*
+Same numbers as OBISItem::ValueType (checked there), the profile is known before OBISItem is.
+*/
+enum P1ProfileType {P1PT_NONE=0, P1PT_DOUBLE=1, P1PT_INT32=2, P1PT_INT64=3, P1PT_CHARARR=5};
+
+/*
+Iskraemeco MIE5E single phase, the meter of the telegram in antonp1.h.
+*/
+#define P1_PROFILE_ISKRA(X) \
+  X(meterNumber,         0, 0, 96, 1, 0, INT32,   "") \
+  X(meterId,             0, 0, 96, 1, 1, CHARARR, "") \
+  X(time,                1, 0, 0, 9, 1,  INT32,   "") \
+  X(date,                1, 0, 0, 9, 2,  INT32,   "") \
+  X(activeEnergyImport,  1, 0, 1, 8, 0,  DOUBLE,  "kWh") \
+  X(activeEnergyExport,  1, 0, 2, 8, 0,  DOUBLE,  "kWh") \
+  X(activePowerImport,   1, 0, 1, 7, 0,  DOUBLE,  "kW") \
+  X(activePowerExport,   1, 0, 2, 7, 0,  DOUBLE,  "kW") \
+  X(reactivePowerImport, 1, 0, 3, 7, 0,  DOUBLE,  "kvar") \
+  X(reactivePowerExport, 1, 0, 4, 7, 0,  DOUBLE,  "kvar") \
+  X(currentL1,           1, 0, 31, 7, 0, INT32,   "A") \
+  X(voltageL1,           1, 0, 32, 7, 0, DOUBLE,  "V")
+
+/*
+DSMR 5 three phase with a gas meter on M-Bus channel 1 (telegrams/dsmr5-three-phase-mbus.txt).
+*/
+#define P1_PROFILE_DSMR5(X) \
+  X(version,              1, 3, 0, 2, 8,   INT32,   "") \
+  X(timestamp,            0, 0, 1, 0, 0,   CHARARR, "") \
+  X(meterId,              0, 0, 96, 1, 1,  CHARARR, "") \
+  X(energyImportT1,       1, 0, 1, 8, 1,   DOUBLE,  "kWh") \
+  X(energyImportT2,       1, 0, 1, 8, 2,   DOUBLE,  "kWh") \
+  X(energyExportT1,       1, 0, 2, 8, 1,   DOUBLE,  "kWh") \
+  X(energyExportT2,       1, 0, 2, 8, 2,   DOUBLE,  "kWh") \
+  X(tariff,               0, 0, 96, 14, 0, INT32,   "") \
+  X(activePowerImport,    1, 0, 1, 7, 0,   DOUBLE,  "kW") \
+  X(activePowerExport,    1, 0, 2, 7, 0,   DOUBLE,  "kW") \
+  X(powerFailures,        0, 0, 96, 7, 21, INT32,   "") \
+  X(longPowerFailures,    0, 0, 96, 7, 9,  INT32,   "") \
+  X(powerFailureLog,      1, 0, 99, 97, 0, INT64,   "s") \
+  X(voltageSagsL1,        1, 0, 32, 32, 0, INT32,   "") \
+  X(voltageSagsL2,        1, 0, 52, 32, 0, INT32,   "") \
+  X(voltageSagsL3,        1, 0, 72, 32, 0, INT32,   "") \
+  X(voltageSwellsL1,      1, 0, 32, 36, 0, INT32,   "") \
+  X(textMessage,          0, 0, 96, 13, 0, CHARARR, "") \
+  X(voltageL1,            1, 0, 32, 7, 0,  DOUBLE,  "V") \
+  X(voltageL2,            1, 0, 52, 7, 0,  DOUBLE,  "V") \
+  X(voltageL3,            1, 0, 72, 7, 0,  DOUBLE,  "V") \
+  X(currentL1,            1, 0, 31, 7, 0,  INT32,   "A") \
+  X(currentL2,            1, 0, 51, 7, 0,  INT32,   "A") \
+  X(currentL3,            1, 0, 71, 7, 0,  INT32,   "A") \
+  X(powerImportL1,        1, 0, 21, 7, 0,  DOUBLE,  "kW") \
+  X(powerImportL2,        1, 0, 41, 7, 0,  DOUBLE,  "kW") \
+  X(powerImportL3,        1, 0, 61, 7, 0,  DOUBLE,  "kW") \
+  X(powerExportL1,        1, 0, 22, 7, 0,  DOUBLE,  "kW") \
+  X(powerExportL2,        1, 0, 42, 7, 0,  DOUBLE,  "kW") \
+  X(powerExportL3,        1, 0, 62, 7, 0,  DOUBLE,  "kW") \
+  X(gasDeviceType,        0, 1, 24, 1, 0,  INT32,   "") \
+  X(gasMeterId,           0, 1, 96, 1, 0,  CHARARR, "") \
+  X(gasDelivered,         0, 1, 24, 2, 1,  DOUBLE,  "m3")
+
+/*
+What a parser needs of a profile at run time, see ParsedOBIS::profile.
+*/
+struct P1ProfileTable
+{
+  const char* name;
+  int count;
+  const uint64_t* keys; //By code, as obisKey()
+  const uint8_t* types; //P1ProfileType by code
+  const char* const* units; //By code, "" if none
+  const uint8_t* slots; //Code of each hash slot, 0xFF if none
+  uint32_t multiplier;
+  uint8_t bits; //The table has 1 << bits slots
+};
+
+constexpr uint64_t p1ProfileKey(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+  return (a & 0xFF) << 56 | (b & 0xFF) << 48 | c << 32 | d << 16 | e; //As obisKey()
+}
+
+constexpr uint32_t p1ProfileFold(uint64_t key)
+{
+  return (uint32_t)(key ^ (key >> 29));
+}
+
+/*
+Slots for count codes: a power of 2 and at least 4 per code, so a multiplier that puts each in its own
+slot is found within a few hundred tries.
+*/
+constexpr int p1ProfileBits(int count)
+{
+  int bits = 1;
+  while ((1 << bits) < 4 * count)
+  {
+    bits++;
+  }
+  return bits;
+}
+
+template <int Bits>
+struct P1ProfileHash
+{
+  uint32_t multiplier = 0; //0 if none was found
+  uint8_t slots[1 << Bits] = {};
+};
+
+/*
+Tries odd multipliers until slot (fold(key) * multiplier) >> (32 - Bits) is different for each key.
+Run by the compiler, duplicate keys never get one (see the static_assert in P1_PROFILE_DEFINE).
+*/
+template <int Count, int Bits>
+constexpr P1ProfileHash<Bits> p1ProfileHashBuild(const uint64_t (&keys)[Count])
+{
+  P1ProfileHash<Bits> hash;
+  uint32_t multiplier = 2654435761u;
+  for (int tries = 0; tries < 4096; tries++, multiplier += 0x9E3779B8u) //Stays odd
+  {
+    for (int slot = 0; slot < (1 << Bits); slot++)
+    {
+      hash.slots[slot] = 0xFF;
+    }
+    bool perfect = true;
+    for (int i = 0; i < Count && perfect; i++)
+    {
+      uint32_t slot = (p1ProfileFold(keys[i]) * multiplier) >> (32 - Bits);
+      perfect = hash.slots[slot] == 0xFF;
+      hash.slots[slot] = i;
+    }
+    if (perfect)
+    {
+      hash.multiplier = multiplier;
+      return hash;
+    }
+  }
+  return hash;
+}
+
+/*
+Code of the key in the profile, -1 if it is not one of them.
+*/
+inline int p1ProfileIndex(const P1ProfileTable& table, uint64_t key)
+{
+  uint8_t code = table.slots[(p1ProfileFold(key) * table.multiplier) >> (32 - table.bits)];
+  return code != 0xFF && table.keys[code] == key ? code : -1;
+}
+
+/*
+Value of the profile's item code in the last valid telegram of the parser, 0 or "" if it has not been
+seen or is not of that type. Defined in antonp1.h.
+*/
+class ParsedOBIS;
+bool p1ProfileSeen(ParsedOBIS& parsed, int code);
+double p1ProfileDouble(ParsedOBIS& parsed, int code);
+uint32_t p1ProfileInt32(ParsedOBIS& parsed, int code);
+uint64_t p1ProfileInt64(ParsedOBIS& parsed, int code);
+const char* p1ProfileString(ParsedOBIS& parsed, int code);
+
+#define P1_PROFILE_CODE(name, a, b, c, d, e, type, unit) name,
+#define P1_PROFILE_KEY(name, a, b, c, d, e, type, unit) p1ProfileKey(a, b, c, d, e),
+#define P1_PROFILE_TYPE(name, a, b, c, d, e, type, unit) P1PT_##type,
+#define P1_PROFILE_UNIT(name, a, b, c, d, e, type, unit) unit,
+#define P1_PROFILE_GET(name, a, b, c, d, e, type, unit) P1_PROFILE_GET_##type(name)
+#define P1_PROFILE_GET_DOUBLE(name) double name() const { return p1ProfileDouble(parsed, Code::name); }
+#define P1_PROFILE_GET_INT32(name) uint32_t name() const { return p1ProfileInt32(parsed, Code::name); }
+#define P1_PROFILE_GET_INT64(name) uint64_t name() const { return p1ProfileInt64(parsed, Code::name); }
+#define P1_PROFILE_GET_CHARARR(name) const char* name() const { return p1ProfileString(parsed, Code::name); }
+
+/*
+Profile Name from the list LIST: Name::table for the parser, Name::Code::<name> the code order (and the
+item's index in the pool), and objects of Name read the values of one parser.
+*/
+#define P1_PROFILE_DEFINE(Name, LIST) \
+  struct Name \
+  { \
+    struct Code \
+    { \
+      enum : uint8_t { LIST(P1_PROFILE_CODE) count }; \
+    }; \
+    static constexpr uint64_t keys[] = { LIST(P1_PROFILE_KEY) }; \
+    static constexpr uint8_t types[] = { LIST(P1_PROFILE_TYPE) }; \
+    static constexpr const char* units[] = { LIST(P1_PROFILE_UNIT) }; \
+    static constexpr P1ProfileHash<p1ProfileBits(Code::count)> hash = p1ProfileHashBuild<Code::count, p1ProfileBits(Code::count)>(keys); \
+    static_assert(hash.multiplier != 0, "No perfect hash for the codes of " #Name ", is one of them there twice?"); \
+    static_assert(Code::count <= 64, "A profile has up to 64 codes, see ParsedOBIS::profileListed"); \
+    static const P1ProfileTable table; \
+    ParsedOBIS& parsed; \
+    bool seen(int code) const { return p1ProfileSeen(parsed, code); } \
+    LIST(P1_PROFILE_GET) \
+  }; \
+  const P1ProfileTable Name::table = {#Name, Name::Code::count, Name::keys, Name::types, Name::units, \
+                                      Name::hash.slots, Name::hash.multiplier, p1ProfileBits(Name::Code::count)};
+
+P1_PROFILE_DEFINE(P1ProfileIskra, P1_PROFILE_ISKRA)
+P1_PROFILE_DEFINE(P1ProfileDsmr5, P1_PROFILE_DSMR5)
+
+/*
+Profile of every parser, e.g. -D P1_PROFILE=P1ProfileDsmr5, none by default (all codes dynamic).
+*/
+#ifdef P1_PROFILE
+#define P1_PROFILE_TABLE (&P1_PROFILE::table)
+#else
+#define P1_PROFILE_TABLE nullptr
+#endif
+
+#endif // P1PROFILE_H
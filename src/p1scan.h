@@ -0,0 +1,196 @@
+/*
+ Bulk scanning for the parser, several bytes per step instead of one switch per byte: the length of a run
+ of digits (with its value) and the position of the next line or field delimiter. p1ParseChunk() uses them
+ to take whole digit runs of a value and whole skipped lines at once, single bytes still go to p1ParseByte().
+
+ Paths (P1_SCAN_BEST is the default):
+   P1_SCAN_SCALAR  one byte at a time, any target, the default
+   P1_SCAN_SWAR    4 bytes in a 32 bit word, digit values 4 or 8 at a time, little endian only
+ The gain is in taking a run or a line in one call, not in the bytes per step: values and lines in a telegram
+ are short (mostly under 16 bytes), so SWAR measures the same as scalar on the host ('p1host scan', within a
+ few %) and the ESP8266 has no unaligned word loads. Build with -D P1_SCAN_BEST=P1_SCAN_SWAR to try it.
+ With P1_SCAN_SELECTABLE the path is p1ScanPath, set at run time (host tests and benchmarks).
+ */
+#ifndef P1SCAN_H
+#define P1SCAN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define P1_SCAN_SCALAR 0
+#define P1_SCAN_SWAR 1
+
+#ifndef P1_SCAN_BEST
+#define P1_SCAN_BEST P1_SCAN_SCALAR
+#endif
+#if P1_SCAN_BEST == P1_SCAN_SWAR && defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "P1_SCAN_SWAR needs a little endian target"
+#endif
+
+#ifdef P1_SCAN_SELECTABLE
+int p1ScanPath = P1_SCAN_BEST;
+#define P1_SCAN_PATH p1ScanPath
+#else
+#define P1_SCAN_PATH P1_SCAN_BEST
+#endif
+
+inline bool p1IsDigit(char c)
+{
+  return (uint8_t)(c - '0') < 10;
+}
+
+/*
+Scalar, the reference the other paths must match.
+*/
+int p1ScanDigitsScalar(const char* s, int length)
+{
+  int i = 0;
+  while (i < length && p1IsDigit(s[i])) i++;
+  return i;
+}
+
+int p1ScanFindScalar(const char* s, int length, char a, char b, char c)
+{
+  int i = 0;
+  while (i < length && s[i] != a && s[i] != b && s[i] != c) i++;
+  return i;
+}
+
+/*
+SWAR, little endian: the first byte in memory is the lowest one of the word. Bytes after the first match
+may be flagged wrongly (carries), only the first one is used.
+*/
+inline uint32_t p1Load32(const char* s)
+{
+  uint32_t w;
+  memcpy(&w, s, 4);
+  return w;
+}
+
+int p1ScanDigitsSwar(const char* s, int length)
+{
+  int i = 0;
+  for (; i + 4 <= length; i += 4)
+  {
+    uint32_t x = p1Load32(s + i) ^ 0x30303030; //Digits become 0..9
+    uint32_t bad = (x | (x + 0x06060606)) & 0xF0F0F0F0; //High nibble set, or above 9
+    if (bad != 0)
+    {
+      return i + (__builtin_ctz(bad) >> 3);
+    }
+  }
+  return i + p1ScanDigitsScalar(s + i, length - i);
+}
+
+inline uint32_t p1SwarZero(uint32_t x)
+{
+  return (x - 0x01010101) & ~x & 0x80808080;
+}
+
+int p1ScanFindSwar(const char* s, int length, char a, char b, char c)
+{
+  int i = 0;
+  for (; i + 4 <= length; i += 4)
+  {
+    uint32_t w = p1Load32(s + i);
+    uint32_t hit = p1SwarZero(w ^ (0x01010101u * (uint8_t)a)) | p1SwarZero(w ^ (0x01010101u * (uint8_t)b))
+                 | p1SwarZero(w ^ (0x01010101u * (uint8_t)c));
+    if (hit != 0)
+    {
+      return i + (__builtin_ctz(hit) >> 3);
+    }
+  }
+  return i + p1ScanFindScalar(s + i, length - i, a, b, c);
+}
+
+/*
+Number of digits s starts with, at most length.
+*/
+inline int p1ScanDigits(const char* s, int length)
+{
+  switch (P1_SCAN_PATH)
+  {
+    case P1_SCAN_SWAR:
+      return p1ScanDigitsSwar(s, length);
+    default:
+      return p1ScanDigitsScalar(s, length);
+  }
+}
+
+/*
+Position of the first byte that is a, b or c, length if there is none.
+*/
+inline int p1ScanFind(const char* s, int length, char a, char b, char c)
+{
+  switch (P1_SCAN_PATH)
+  {
+    case P1_SCAN_SWAR:
+      return p1ScanFindSwar(s, length, a, b, c);
+    default:
+      return p1ScanFindScalar(s, length, a, b, c);
+  }
+}
+
+/*
+value * 10^length + the digits (all digits, see p1ScanDigits), wrapping at 64 bits like adding them one by one.
+Four digits per step with two multiplies (first digit in the lowest byte), eight on 64 bit hosts.
+*/
+inline uint64_t p1DigitsValue(const char* s, int length, uint64_t value)
+{
+  int i = 0;
+  if (P1_SCAN_PATH != P1_SCAN_SCALAR)
+  {
+#if UINTPTR_MAX > 0xFFFFFFFF
+    for (; i + 8 <= length; i += 8)
+    {
+      uint64_t x;
+      memcpy(&x, s + i, 8);
+      x = ((x & 0x0F0F0F0F0F0F0F0Full) * 2561) >> 8;
+      x = ((x & 0x00FF00FF00FF00FFull) * 6553601) >> 16;
+      x = ((x & 0x0000FFFF0000FFFFull) * 42949672960001ull) >> 32;
+      value = value * 100000000 + x;
+    }
+#endif
+    for (; i + 4 <= length; i += 4)
+    {
+      uint32_t x = p1Load32(s + i);
+      x = ((x & 0x0F0F0F0F) * 2561) >> 8;
+      x = ((x & 0x00FF00FF) * 6553601) >> 16;
+      value = value * 10000 + x;
+    }
+  }
+  for (; i < length; i++)
+  {
+    value = value * 10 + (s[i] - '0');
+  }
+  return value;
+}
+
+/*
+64 bit hash of a line, 4 bytes per step in two 32 bit lanes (no 64 bit multiplies on the ESP8266).
+Each step is one to one for a given word, so lines of the same length that differ within one 4 byte word
+(e.g. a counter that moved) never hash the same. Never 0, that is kept for "not known".
+*/
+inline uint64_t p1LineHash(const char* s, int length)
+{
+  uint32_t h1 = 2166136261u, h2 = length;
+  for (int i = 0; i < length; i += 4)
+  {
+    uint32_t w = 0;
+    if (i + 4 <= length)
+    {
+      w = p1Load32(s + i);
+    }
+    else
+    {
+      memcpy(&w, s + i, length - i); //Last bytes, the rest stays 0
+    }
+    h1 = (h1 ^ w) * 2654435761u;
+    h1 ^= h1 >> 15;
+    h2 = (h2 ^ w) * 2246822519u;
+    h2 ^= h2 >> 13;
+  }
+  return ((uint64_t)h1 << 32 | h2) | 1;
+}
+
+#endif // P1SCAN_H
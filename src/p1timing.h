@@ -0,0 +1,98 @@
+/*
+ Optional timing of the hot paths, build with -D P1_TIMING (otherwise the macros are empty).
+ Ticks are CPU cycles on the ESP (ESP.getCycleCount, 80/160 per us) and nanoseconds on the host.
+ On the device the report is printed over telnet after each telegram, see main.cpp.
+ */
+#ifndef P1TIMING_H
+#define P1TIMING_H
+
+#include "p1hal.h"
+
+enum P1TimerId {P1T_READ=0, P1T_TELEGRAM=1, P1T_COMMIT=2, P1T_JSON=3, P1T_COUNT=4};
+
+struct P1Timer
+{
+  const char* name;
+  uint32_t calls;
+  uint64_t total;
+  uint32_t max;
+};
+
+#ifdef P1_TIMING
+
+#ifdef ARDUINO
+inline uint32_t p1Ticks()
+{
+  return ESP.getCycleCount();
+}
+#define P1_TICK_UNIT "cycles"
+#else
+#include <chrono>
+inline uint32_t p1Ticks()
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#define P1_TICK_UNIT "ns"
+#endif
+
+P1Timer p1Timers[P1T_COUNT] = {{"read chunk"}, {"telegram"}, {"commit"}, {"json"}};
+
+inline void p1TimerAdd(P1TimerId id, uint32_t ticks)
+{
+  P1Timer& t = p1Timers[id];
+  t.calls++;
+  t.total += ticks;
+  if (ticks > t.max)
+  {
+    t.max = ticks;
+  }
+}
+
+/*
+Writes one line per timer that has been used, returns the length written.
+*/
+int p1TimingReport(char* out, int size)
+{
+  int len = 0;
+  for (int i = 0; i < P1T_COUNT && len < size; i++)
+  {
+    P1Timer& t = p1Timers[i];
+    if (t.calls == 0)
+    {
+      continue;
+    }
+    len += snprintf(out + len, size - len, "%-10s n=%lu avg=%lu max=%lu " P1_TICK_UNIT "\r\n", t.name,
+      (unsigned long)t.calls, (unsigned long)(t.total / t.calls), (unsigned long)t.max);
+  }
+  return len < size ? len : size - 1;
+}
+
+uint32_t p1TelegramTicks = 0; //Sum of the read chunks of the telegram being read
+
+/*
+Adds a read chunk, and the whole telegram (all its chunks) when it is finished.
+*/
+inline void p1TimedRead(uint32_t ticks, bool done)
+{
+  p1TimerAdd(P1T_READ, ticks);
+  p1TelegramTicks += ticks;
+  if (done)
+  {
+    p1TimerAdd(P1T_TELEGRAM, p1TelegramTicks);
+    p1TelegramTicks = 0;
+  }
+}
+
+#define P1_TIMED_BEGIN(name) uint32_t name##Start = p1Ticks()
+#define P1_TIMED_END(name, id) p1TimerAdd(id, p1Ticks() - name##Start)
+#define P1_TIMED_READ(name, done) p1TimedRead(p1Ticks() - name##Start, done)
+
+#else
+
+#define P1_TIMED_BEGIN(name)
+#define P1_TIMED_END(name, id)
+#define P1_TIMED_READ(name, done) (void)(done)
+
+#endif // P1_TIMING
+
+#endif // P1TIMING_H
@@ -0,0 +1,369 @@
+/*
+ Uploads to the server without blocking loop(). p1UploadQueue() copies a payload into the queue and
+ p1UploadPoll() (called from loop()) sends them one at a time over a kept-alive HTTP/1.1 connection, writing
+ only as much as the client has room for. Headers that do not change (host, MAC, IP) are built once by
+ p1UploadSetup().
+
+ The payloads lie back to back in one buffer of P1_UPLOAD_BUFFER bytes, so a 300 byte delta takes 300 bytes.
+ A payload can also be built in place, in the free space p1UploadSpace() gives, and is then not copied.
+
+ A payload that fails (no connection, timeout, no 2xx status) is sent again after P1_UPLOAD_BACKOFF ms,
+ doubled each time, and given up after P1_UPLOAD_RETRIES. The result of each payload goes to p1UploadDone.
+
+ The client (AsyncClient on the device, a socket on the host) is reached only through p1UploadTransport.
+ It passes the response back with p1UploadReceived() and tells of a lost connection with p1UploadClosed().
+ */
+#ifndef P1UPLOAD_H
+#define P1UPLOAD_H
+
+#include "antonp1.h"
+
+#ifndef P1_UPLOAD_QUEUE
+#define P1_UPLOAD_QUEUE 3 //Payloads waiting to be sent, the one being sent included
+#endif
+
+#ifndef P1_UPLOAD_BUFFER
+#define P1_UPLOAD_BUFFER 2048 //Bytes for the queued payloads, also the largest one: a raw telegram (keyframe)
+#endif
+
+static_assert(P1_UPLOAD_BUFFER >= P1_MAXBUFFER, "P1_UPLOAD_BUFFER must hold a raw telegram");
+
+#ifndef P1_UPLOAD_TIMEOUT
+#define P1_UPLOAD_TIMEOUT 10000 //Connecting, sending and the response, in ms
+#endif
+
+#ifndef P1_UPLOAD_BACKOFF
+#define P1_UPLOAD_BACKOFF 2000 //Wait before the first retry, doubled for each one after
+#endif
+
+#ifndef P1_UPLOAD_RETRIES
+#define P1_UPLOAD_RETRIES 5
+#endif
+
+/*
+The client. write returns how many bytes it took, signal is the WiFi RSSI (may be null).
+*/
+struct P1UploadTransport
+{
+  bool (*connected)();
+  void (*connect)(const char* host, uint16_t port);
+  int (*space)();
+  int (*write)(const char* data, int length);
+  void (*close)();
+  int (*signal)();
+};
+
+P1UploadTransport p1UploadTransport = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+/*
+Result of a payload, tag is whatever was given to p1UploadQueue().
+*/
+void (*p1UploadDone)(const char* format, uint32_t tag, bool ok) = nullptr;
+
+struct P1UploadSlot
+{
+  const char* format; //p1control-format header, e.g. "delta"
+  uint32_t tag;
+  bool valid; //P1valid when queued
+  int length;
+  char* body; //In p1UploadData
+};
+
+enum P1UploadState
+{
+  P1U_IDLE,
+  P1U_CONNECTING,
+  P1U_SENDING,
+  P1U_WAITING
+};
+
+P1UploadSlot p1UploadSlots[P1_UPLOAD_QUEUE]; //Oldest first, the one being sent
+int p1UploadCount = 0;
+char p1UploadData[P1_UPLOAD_BUFFER]; //Bodies of the slots in the same order, from the start
+int p1UploadUsed = 0;
+P1UploadState p1UploadState = P1U_IDLE;
+int p1UploadAttempts = 0; //Failed sends of the oldest slot
+unsigned long p1UploadRetryMillis = 0;
+unsigned long p1UploadDeadline = 0;
+char p1UploadHost[64];
+uint16_t p1UploadPort = 80;
+char p1UploadFixed[256]; //Request line and the headers that never change
+char p1UploadHead[384]; //Headers of the request being sent
+int p1UploadHeadLength = 0;
+int p1UploadSendPos = 0; //In the head and then the body
+long p1UploadSent = 0;
+long p1UploadFailed = 0; //Given up after P1_UPLOAD_RETRIES
+long p1UploadRetried = 0;
+
+/*
+Response parser, only run from the client's callbacks. p1UploadResult hands the outcome to loop():
+0 still waiting, the status code, or -1 if the connection was lost first.
+*/
+std::atomic<int> p1UploadResult(0);
+bool p1UploadKeepAlive = true; //Set by the response, the connection can take the next request
+char p1UploadLine[64];
+int p1UploadLineLength = 0;
+int p1UploadStatus = 0;
+long p1UploadBodyLeft = -1; //-1 until the headers are done
+long p1UploadContentLength = -1;
+bool p1UploadExpecting = false;
+
+void p1UploadSetup(const char* host, uint16_t port, const char* path, const char* headers)
+{
+  snprintf(p1UploadHost, sizeof(p1UploadHost), "%s", host);
+  p1UploadPort = port;
+  snprintf(p1UploadFixed, sizeof(p1UploadFixed), "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n%s",
+    path, host, headers);
+}
+
+void p1UploadHeaderLine()
+{
+  char* line = p1UploadLine;
+  if (p1UploadStatus == 0)
+  {
+    const char* space = strchr(line, ' ');
+    p1UploadStatus = space != nullptr ? atoi(space + 1) : 0;
+    p1UploadStatus = p1UploadStatus > 0 ? p1UploadStatus : 1; //Not HTTP, counts as a failure
+    return;
+  }
+  if (strncasecmp(line, "Content-Length:", 15) == 0)
+  {
+    p1UploadContentLength = atol(line + 15);
+  }
+  else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close") != nullptr)
+  {
+    p1UploadKeepAlive = false;
+  }
+}
+
+void p1UploadReceived(const char* data, int length)
+{
+  for (int i = 0; i < length && p1UploadExpecting; i++)
+  {
+    if (p1UploadBodyLeft >= 0) //Body, skipped
+    {
+      int n = length - i < p1UploadBodyLeft ? length - i : p1UploadBodyLeft;
+      p1UploadBodyLeft -= n;
+      i += n - 1;
+    }
+    else if (data[i] != '\n')
+    {
+      if (data[i] != '\r' && p1UploadLineLength < (int)sizeof(p1UploadLine) - 1)
+      {
+        p1UploadLine[p1UploadLineLength++] = data[i];
+      }
+      continue;
+    }
+    else if (p1UploadLineLength > 0)
+    {
+      p1UploadLine[p1UploadLineLength] = '\0';
+      p1UploadHeaderLine();
+      p1UploadLineLength = 0;
+      continue;
+    }
+    else //Empty line, end of the headers
+    {
+      if (p1UploadContentLength < 0)
+      {
+        p1UploadKeepAlive = false; //Length unknown (chunked or until closed), not worth parsing
+      }
+      p1UploadBodyLeft = p1UploadContentLength > 0 ? p1UploadContentLength : 0;
+    }
+    if (p1UploadBodyLeft == 0)
+    {
+      p1UploadExpecting = false;
+      p1UploadResult.store(p1UploadStatus, std::memory_order_release);
+    }
+  }
+}
+
+void p1UploadClosed()
+{
+  if (p1UploadExpecting)
+  {
+    p1UploadExpecting = false;
+    p1UploadResult.store(-1, std::memory_order_release);
+  }
+}
+
+/*
+Free space after the queued payloads, for a payload to be built there and passed to p1UploadQueue().
+Null if every slot is taken, else size is set to the bytes free (P1_UPLOAD_BUFFER when the queue is empty).
+The space is the caller's only until the next p1UploadQueue() or p1UploadPoll().
+*/
+char* p1UploadSpace(int& size)
+{
+  if (p1UploadCount == P1_UPLOAD_QUEUE)
+  {
+    return nullptr;
+  }
+  size = P1_UPLOAD_BUFFER - p1UploadUsed;
+  return p1UploadData + p1UploadUsed;
+}
+
+/*
+Copies the payload into the queue, not if it was built in p1UploadSpace(). False if the queue is full,
+the caller may keep it elsewhere (p1log.h).
+*/
+bool p1UploadQueue(const char* data, int length, const char* format, uint32_t tag)
+{
+  if (p1UploadCount == P1_UPLOAD_QUEUE || length > P1_UPLOAD_BUFFER - p1UploadUsed)
+  {
+    return false;
+  }
+  P1UploadSlot& slot = p1UploadSlots[p1UploadCount];
+  slot.format = format;
+  slot.tag = tag;
+  slot.valid = P1valid;
+  slot.length = length;
+  slot.body = p1UploadData + p1UploadUsed;
+  if (data != slot.body)
+  {
+    memcpy(slot.body, data, length);
+  }
+  p1UploadUsed += length;
+  p1UploadCount++;
+  return true;
+}
+
+void p1UploadFinish(bool ok, unsigned long now)
+{
+  P1UploadSlot slot = p1UploadSlots[0];
+  p1UploadState = P1U_IDLE;
+  if (!ok)
+  {
+    p1UploadTransport.close();
+    p1UploadKeepAlive = true;
+    if (++p1UploadAttempts <= P1_UPLOAD_RETRIES)
+    {
+      p1UploadRetried++;
+      p1UploadRetryMillis = now + ((unsigned long)P1_UPLOAD_BACKOFF << (p1UploadAttempts - 1));
+      return;
+    }
+    p1UploadFailed++;
+  }
+  else
+  {
+    p1UploadSent++;
+    if (!p1UploadKeepAlive)
+    {
+      p1UploadTransport.close();
+      p1UploadKeepAlive = true;
+    }
+  }
+  p1UploadAttempts = 0;
+  p1UploadCount--;
+  p1UploadUsed -= slot.length;
+  memmove(p1UploadData, p1UploadData + slot.length, p1UploadUsed); //The next one is sent from the start
+  for (int i = 0; i < p1UploadCount; i++)
+  {
+    p1UploadSlots[i] = p1UploadSlots[i + 1];
+    p1UploadSlots[i].body -= slot.length;
+  }
+  if (p1UploadDone != nullptr)
+  {
+    p1UploadDone(slot.format, slot.tag, ok);
+  }
+}
+
+void p1UploadStart(unsigned long now)
+{
+  P1UploadSlot& slot = p1UploadSlots[0];
+  int signal = p1UploadTransport.signal != nullptr ? p1UploadTransport.signal() : 0;
+  p1UploadHeadLength = snprintf(p1UploadHead, sizeof(p1UploadHead),
+    "%sContent-Type: %s\r\np1control-format: %s\r\np1control-isvalid: %s\r\np1control-wifisignal: %d\r\nContent-Length: %d\r\n\r\n",
+    p1UploadFixed, strcmp(slot.format, "wire") == 0 ? "application/octet-stream" : "text/plain", slot.format,
+    slot.valid ? "Yes" : "No", signal, slot.length);
+  if (p1UploadHeadLength >= (int)sizeof(p1UploadHead))
+  {
+    p1UploadHeadLength = sizeof(p1UploadHead) - 1;
+  }
+  p1UploadSendPos = 0;
+  p1UploadStatus = 0;
+  p1UploadLineLength = 0;
+  p1UploadBodyLeft = -1;
+  p1UploadContentLength = -1;
+  p1UploadResult.store(0, std::memory_order_relaxed);
+  p1UploadExpecting = true;
+  p1UploadState = P1U_SENDING;
+  p1UploadDeadline = now + P1_UPLOAD_TIMEOUT;
+}
+
+/*
+Moves the oldest payload on as far as it can go without waiting. Call from loop().
+*/
+void p1UploadPoll()
+{
+  if (p1UploadTransport.connected == nullptr)
+  {
+    return;
+  }
+  unsigned long now = p1Millis();
+  switch (p1UploadState)
+  {
+    case P1U_IDLE:
+      if (p1UploadCount == 0 || (long)(now - p1UploadRetryMillis) < 0)
+      {
+        return;
+      }
+      if (p1UploadTransport.connected())
+      {
+        p1UploadStart(now);
+        break;
+      }
+      p1UploadTransport.connect(p1UploadHost, p1UploadPort);
+      p1UploadState = P1U_CONNECTING;
+      p1UploadDeadline = now + P1_UPLOAD_TIMEOUT;
+      return;
+
+    case P1U_CONNECTING:
+      if (p1UploadTransport.connected())
+      {
+        p1UploadStart(now);
+        break;
+      }
+      if ((long)(now - p1UploadDeadline) > 0)
+      {
+        p1UploadFinish(false, now);
+      }
+      return;
+
+    default:
+      break;
+  }
+
+  if (p1UploadState == P1U_SENDING)
+  {
+    P1UploadSlot& slot = p1UploadSlots[0];
+    int total = p1UploadHeadLength + slot.length;
+    while (p1UploadSendPos < total && p1UploadTransport.connected())
+    {
+      int room = p1UploadTransport.space();
+      bool head = p1UploadSendPos < p1UploadHeadLength;
+      const char* data = head ? p1UploadHead + p1UploadSendPos : slot.body + p1UploadSendPos - p1UploadHeadLength;
+      int left = head ? p1UploadHeadLength - p1UploadSendPos : total - p1UploadSendPos;
+      int n = room > 0 ? p1UploadTransport.write(data, left < room ? left : room) : 0;
+      if (n <= 0)
+      {
+        break; //Client is full, again next loop()
+      }
+      p1UploadSendPos += n;
+    }
+    if (p1UploadSendPos == total)
+    {
+      p1UploadState = P1U_WAITING;
+    }
+  }
+
+  int result = p1UploadResult.load(std::memory_order_acquire);
+  if (result != 0)
+  {
+    p1UploadFinish(p1UploadState == P1U_WAITING && result >= 200 && result < 300, now);
+  }
+  else if (!p1UploadTransport.connected() || (long)(now - p1UploadDeadline) > 0)
+  {
+    p1UploadFinish(false, now);
+  }
+}
+
+#endif // P1UPLOAD_H
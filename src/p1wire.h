@@ -0,0 +1,186 @@
+/*
+ Compact binary snapshot of the parsed OBIS items, served at /api.bin and optionally posted instead of the text.
+ Little endian, numbers are varints (see p1VarintPut), version P1_WIRE_VERSION:
+
+   'P' '1' version flags(bit 0: has schema) schemaId(4) generation(4)
+   schema (if flagged):  units(varint) {length(1) text}...  items(varint) {A(1) B(1) C D E unit+1(varints)}...
+   values:               items(varint) {type(1) value}...
+
+ The schema (codes and units, from p1parsed and unitList) only changes when a new code shows up, so a receiver
+ keeps it by schemaId (FNV-1a of the schema bytes) and it is sent only when asked for or not known to be there.
+ Values are in schema order, type is OBISItem::ValueType: DOUBLE decimals(1) mantissa(varint), INT32 and INT64
+ varint, CHARARR length(varint) text, NONE nothing. Decoder for the host: host/p1wiredecode.h.
+ */
+#ifndef P1WIRE_H
+#define P1WIRE_H
+
+#include "antonp1.h"
+
+#define P1_WIRE_VERSION 1
+#define P1_WIRE_HAS_SCHEMA 0x01
+#define P1_WIRE_HEADER 12
+
+#ifndef P1_WIRE_BUFFER
+#define P1_WIRE_BUFFER 2048 //Largest message, with the schema
+#endif
+
+struct P1WireWriter
+{
+  uint8_t* out;
+  int size;
+  int len;
+  bool full;
+
+  void byte(uint8_t b)
+  {
+    if (len < size) out[len++] = b;
+    else full = true;
+  }
+
+  void varint(uint64_t v)
+  {
+    uint8_t bytes[10];
+    int n = p1VarintPut(bytes, v);
+    write(bytes, n);
+  }
+
+  void write(const void* data, int n)
+  {
+    if (len + n <= size)
+    {
+      memcpy(out + len, data, n);
+      len += n;
+    }
+    else
+    {
+      full = true;
+    }
+  }
+
+  void u32(uint32_t v)
+  {
+    for (int i = 0; i < 4; i++) byte(v >> (8 * i));
+  }
+};
+
+int p1WireUnitIndex(OBISUnit* unit)
+{
+  int index = 0;
+  for (OBISUnit* u = unitList; u != nullptr; u = u->next, index++)
+  {
+    if (u == unit)
+    {
+      return index;
+    }
+  }
+  return -1;
+}
+
+/*
+Writes a message of the current values of the output's items (see p1filter.h) into out, with the schema
+if withSchema. Returns the length, or -1 if it did not fit. schemaId is set either way, so the caller can
+tell if the receiver needs the schema.
+*/
+int p1WireEncode(uint8_t* out, int size, bool withSchema, uint32_t* schemaId, P1FilterOutput output)
+{
+  uint8_t outputs = 1 << output;
+  P1WireWriter w = {out, size, P1_WIRE_HEADER, false};
+  if (size < P1_WIRE_HEADER)
+  {
+    return -1;
+  }
+
+  //Schema, always written to get its id, left out again if not wanted
+  int units = 0;
+  for (OBISUnit* u = unitList; u != nullptr; u = u->next) units++;
+  w.varint(units);
+  for (OBISUnit* u = unitList; u != nullptr; u = u->next)
+  {
+    uint8_t n = strlen(u->unitstr);
+    w.byte(n);
+    w.write(u->unitstr, n);
+  }
+  OBISItem* first = p1parsed->items; //Items are only ever put in front, the rest of the list stays as it is
+  int items = 0;
+  for (OBISItem* item = first; item != nullptr; item = item->next) items += (item->outputs & outputs) != 0;
+  w.varint(items);
+  for (OBISItem* item = first; item != nullptr; item = item->next)
+  {
+    if (!(item->outputs & outputs)) continue;
+    w.byte(item->obis[0]);
+    w.byte(item->obis[1]);
+    w.varint(item->obis[2]);
+    w.varint(item->obis[3]);
+    w.varint(item->obis[4]);
+    w.varint(p1WireUnitIndex(item->unit) + 1);
+  }
+  if (w.full)
+  {
+    return -1;
+  }
+  uint32_t id = 2166136261u; //FNV-1a
+  for (int i = P1_WIRE_HEADER; i < w.len; i++)
+  {
+    id = (id ^ out[i]) * 16777619u;
+  }
+  *schemaId = id;
+  if (!withSchema)
+  {
+    w.len = P1_WIRE_HEADER;
+  }
+
+  //Values of one snapshot, written again if a new telegram was made current meanwhile
+  int valuesStart = w.len;
+  uint32_t generation;
+  do
+  {
+    generation = p1SnapshotGeneration();
+    w.len = valuesStart;
+    w.full = false;
+    w.varint(items);
+    for (OBISItem* item = first; item != nullptr; item = item->next)
+    {
+      if (!(item->outputs & outputs)) continue;
+      const OBISItem::ValueSlot& v = item->at(generation);
+      w.byte(v.type);
+      switch (v.type)
+      {
+        case OBISItem::DOUBLE:
+          w.byte(v.value.fixed.decimals);
+          w.varint(v.value.fixed.mantissa);
+          break;
+        case OBISItem::INT32:
+          w.varint(v.value.i32Value);
+          break;
+        case OBISItem::INT64:
+          w.varint(v.value.i64Value);
+          break;
+        case OBISItem::CHARARR:
+        {
+          int n = strlen(v.value.stringValue);
+          w.varint(n);
+          w.write(v.value.stringValue, n);
+          break;
+        }
+        default:
+          break;
+      }
+    }
+  } while (!p1SnapshotStable(generation));
+  if (w.full)
+  {
+    return -1;
+  }
+
+  int len = w.len;
+  w.len = 0;
+  w.byte('P');
+  w.byte('1');
+  w.byte(P1_WIRE_VERSION);
+  w.byte(withSchema ? P1_WIRE_HAS_SCHEMA : 0);
+  w.u32(id);
+  w.u32(generation);
+  return len;
+}
+
+#endif // P1WIRE_H